@@ -0,0 +1,207 @@
+#include "algorithm.h"
+
+#include <stdio.h>
+
+uint32_t algorithm_decode(
+    const struct algorithm *alg,
+    uint16_t write_bc_ticks,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count,
+    struct bc_buffer *out,
+    struct kv_pair *params,
+    struct data_logger *logger)
+{
+    void *state = calloc(1, alg->state_size);
+    if (state == NULL)
+    {
+        fprintf(stderr, "ERROR: failed to allocate %s state\n", alg->name);
+        return 0;
+    }
+
+    // Growing past the estimate is handled by the bitstream, so a failure
+    // here only matters if the decode actually needs the memory.
+    bc_buffer_prepare(out, ff_sample_count);
+
+    uint32_t bc_prod = 0;
+    if (alg->init(state, write_bc_ticks, out, params, logger) == 0)
+    {
+        alg->feed(state, ff_samples, ff_sample_count);
+        bc_prod = alg->finish(state);
+    }
+
+    free(state);
+    return bc_prod;
+}
+
+int algorithm_batchable(const struct algorithm *alg, struct kv_pair *params)
+{
+    return alg->batch_lanes > 1 && alg->batch_accepts != NULL && alg->batch_accepts(params);
+}
+
+// Sets up a state for each lane that init() accepts.  lane_of[] maps the
+// ready states back to their lanes.  Returns the number ready.
+static unsigned int init_lanes(
+    const struct algorithm *alg,
+    uint16_t write_bc_ticks,
+    size_t ff_sample_count,
+    struct bc_buffer *outs,
+    struct kv_pair *const *params,
+    unsigned int lanes,
+    void **states,
+    unsigned int *lane_of)
+{
+    unsigned int ready = 0;
+
+    for (unsigned int lane = 0; lane < lanes; ++lane)
+    {
+        void *state = calloc(1, alg->state_size);
+        if (state == NULL)
+        {
+            fprintf(stderr, "ERROR: failed to allocate %s state\n", alg->name);
+            continue;
+        }
+
+        bc_buffer_prepare(&outs[lane], ff_sample_count);
+        if (alg->init(state, write_bc_ticks, &outs[lane], params[lane], NULL) < 0)
+        {
+            free(state);
+            continue;
+        }
+
+        states[ready] = state;
+        lane_of[ready++] = lane;
+    }
+
+    return ready;
+}
+
+// Returns a batch decoding the ready states together, or NULL if they have
+// to be decoded one at a time.
+static void *init_batch(const struct algorithm *alg, void *const *states, unsigned int ready)
+{
+    void *batch = NULL;
+    if (ready > 1 && alg->batch_init != NULL && ready <= alg->batch_lanes)
+    {
+        batch = calloc(1, alg->batch_state_size);
+        if (batch != NULL && alg->batch_init(batch, states, ready) < 0)
+        {
+            free(batch);
+            batch = NULL;
+        }
+    }
+    return batch;
+}
+
+void algorithm_decode_batch(
+    const struct algorithm *alg,
+    uint16_t write_bc_ticks,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count,
+    struct bc_buffer *outs,
+    struct kv_pair *const *params,
+    unsigned int lanes,
+    uint32_t *bc_prods)
+{
+    void *states[ALGORITHM_MAX_BATCH_LANES];
+    unsigned int lane_of[ALGORITHM_MAX_BATCH_LANES];
+
+    for (unsigned int lane = 0; lane < lanes; ++lane)
+    {
+        bc_prods[lane] = 0;
+    }
+
+    unsigned int ready = init_lanes(alg, write_bc_ticks, ff_sample_count, outs, params, lanes, states, lane_of);
+    void *batch = init_batch(alg, states, ready);
+
+    if (batch != NULL)
+    {
+        alg->batch_feed(batch, ff_samples, ff_sample_count);
+        alg->batch_finish(batch, states);
+        free(batch);
+    }
+    else
+    {
+        for (unsigned int ii = 0; ii < ready; ++ii)
+        {
+            alg->feed(states[ii], ff_samples, ff_sample_count);
+        }
+    }
+
+    for (unsigned int ii = 0; ii < ready; ++ii)
+    {
+        bc_prods[lane_of[ii]] = alg->finish(states[ii]);
+        free(states[ii]);
+    }
+}
+
+void algorithm_decode_checked(
+    const struct algorithm *alg,
+    uint16_t write_bc_ticks,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count,
+    struct bc_buffer *outs,
+    struct kv_pair *const *params,
+    unsigned int lanes,
+    const struct algorithm_check *check,
+    uint32_t *bc_prods,
+    size_t *samples_fed)
+{
+    void *states[ALGORITHM_MAX_BATCH_LANES];
+    unsigned int lane_of[ALGORITHM_MAX_BATCH_LANES];
+    int done[ALGORITHM_MAX_BATCH_LANES] = {0};
+    int failed[ALGORITHM_MAX_BATCH_LANES] = {0};
+
+    for (unsigned int lane = 0; lane < lanes; ++lane)
+    {
+        bc_prods[lane] = 0;
+        samples_fed[lane] = 0;
+    }
+
+    unsigned int ready = init_lanes(alg, write_bc_ticks, ff_sample_count, outs, params, lanes, states, lane_of);
+    void *batch = init_batch(alg, states, ready);
+    unsigned int running = ready;
+
+    // A batch carries lanes that are done along with the rest, since their
+    // results were taken when they stopped.  Their buffers may still fail to
+    // grow after that, which mustn't count against the results.
+    for (size_t offset = 0; offset < ff_sample_count && running > 0;)
+    {
+        size_t count = ff_sample_count - offset < check->chunk ? ff_sample_count - offset : check->chunk;
+        int final = offset + count == ff_sample_count;
+
+        if (batch != NULL)
+        {
+            alg->batch_feed(batch, &ff_samples[offset], count);
+            alg->batch_finish(batch, states);
+        }
+        offset += count;
+
+        for (unsigned int ii = 0; ii < ready; ++ii)
+        {
+            if (done[ii])
+                continue;
+
+            if (batch == NULL)
+                alg->feed(states[ii], &ff_samples[offset - count], count);
+
+            unsigned int lane = lane_of[ii];
+            bc_prods[lane] = alg->finish(states[ii]);
+            samples_fed[lane] = offset;
+
+            if (outs[lane].failed || check->check(check->arg, lane, outs[lane].words, bc_prods[lane], final) != 0)
+            {
+                done[ii] = 1;
+                failed[ii] = outs[lane].failed;
+                --running;
+            }
+        }
+    }
+
+    free(batch);
+    for (unsigned int ii = 0; ii < ready; ++ii)
+    {
+        if (done[ii])
+            outs[lane_of[ii]].failed = failed[ii];
+        free(states[ii]);
+    }
+}
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "bc_buffer.h"
 #include "data_logger.h"
 #include "kv_pair.h"
 
@@ -12,20 +13,127 @@ struct parameter
     const char *name;
     uint8_t required;
     const char *description;
+
+    // Range the tuner searches, log spaced, when the parameter isn't given.
+    // Both 0 if the parameter isn't tuned.
+    int32_t tune_min;
+    int32_t tune_max;
 };
 
+// Algorithms decode a capture incrementally, the same way FlashFloppy's write
+// DMA loop hands samples to its decoder: init() once when WGATE is asserted,
+// feed() for each chunk of samples as it arrives and finish() to flush the
+// last partial bitcell word.  All PLL and output state lives in a caller
+// allocated block of state_size bytes so decoding can resume across chunks.
 struct algorithm
 {
     const char *name;
-    uint32_t (*func)(
+    size_t state_size;
+
+    // Returns 0 on success or -1 if params are invalid.  Bitcells are written
+    // to out, which grows as needed.
+    int (*init)(
+        void *state,
         uint16_t write_bc_ticks,
-        uint16_t *ff_samples,
-        size_t ff_sample_count,
-        uint32_t *bc_buf,
-        uint32_t bc_buf_mask,
+        struct bc_buffer *out,
         struct kv_pair *params,
         struct data_logger *logger);
+
+    void (*feed)(
+        void *state,
+        const uint16_t *ff_samples,
+        size_t ff_sample_count);
+
+    // Returns the total number of bitcells produced.  The state is left as
+    // it was, so finish() may also be called between feeds to look at the
+    // bitcells so far.
+    uint32_t (*finish)(void *state);
+
     const struct parameter *params;
+
+    // Optional lockstep decoding of up to batch_lanes parameter sets in a
+    // single pass over a capture, for sweeps.  batch_init() takes over lanes
+    // states that init() has set up and returns -1, leaving them untouched,
+    // if any of them can't be batched.  batch_accepts() tells from a lane's
+    // params alone whether batch_init() would refuse it, so callers can group
+    // only lanes that will share a pass.  batch_finish() hands each lane's
+    // progress back to its state, ready for finish(), and may likewise be
+    // called between feeds.
+    unsigned int batch_lanes;
+    size_t batch_state_size;
+    int (*batch_init)(void *batch, void *const *states, unsigned int lanes);
+    int (*batch_accepts)(struct kv_pair *params);
+    void (*batch_feed)(void *batch, const uint16_t *ff_samples, size_t ff_sample_count);
+    void (*batch_finish)(void *batch, void *const *states);
+};
+
+// Most lanes any algorithm batches.
+#define ALGORITHM_MAX_BATCH_LANES 8
+
+// Every algorithm, NULL terminated.  Defined in algorithm_registry.c.
+extern struct algorithm *const ALGS[];
+
+// Splits an algorithm spec such as "name[key=value,...]" in place into its
+// name and parameter list and looks up the named algorithm.  Returns NULL if
+// the algorithm is unknown.
+struct algorithm *algorithm_lookup(char *spec, struct kv_pair **params);
+
+// Returns non-zero if a decode of alg with params can share a batch with
+// others.
+int algorithm_batchable(const struct algorithm *alg, struct kv_pair *params);
+
+// Decodes a whole capture held in memory with a single feed(), sizing out for
+// it first.  Returns the number of bitcells produced, or 0 if the algorithm
+// could not be initialized.  out->failed is set if bitcells were dropped.
+uint32_t algorithm_decode(
+    const struct algorithm *alg,
+    uint16_t write_bc_ticks,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count,
+    struct bc_buffer *out,
+    struct kv_pair *params,
+    struct data_logger *logger);
+
+// Decodes a whole capture with lanes parameter sets of alg, lanes being at
+// most ALGORITHM_MAX_BATCH_LANES, into outs[lane] and sets bc_prods[lane]
+// as algorithm_decode() would return it.  The lanes share one pass over the
+// capture if alg supports batching them, otherwise each is decoded in turn.
+void algorithm_decode_batch(
+    const struct algorithm *alg,
+    uint16_t write_bc_ticks,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count,
+    struct bc_buffer *outs,
+    struct kv_pair *const *params,
+    unsigned int lanes,
+    uint32_t *bc_prods);
+
+// Watches decodes in progress for algorithm_decode_checked().  check() is
+// handed a lane's bitcells so far after every chunk samples, with final set
+// after the last, and returns non-zero once the lane's outcome is known.
+struct algorithm_check
+{
+    size_t chunk;
+    int (*check)(void *arg, unsigned int lane, const uint32_t *bc_buf, uint32_t bc_prod, int final);
+    void *arg;
 };
 
-#endif
\ No newline at end of file
+// Decodes like algorithm_decode_batch(), with lanes from 1, but a lane stops
+// as soon as check says it's done, and the whole decode stops once every lane
+// has.  bc_prods[lane] is set to the bitcells the lane had produced at that
+// point and samples_fed[lane] to the samples it had decoded.  check() isn't
+// called for a lane whose buffer couldn't grow; see outs[lane].failed, which
+// is left as it was when the lane stopped.
+void algorithm_decode_checked(
+    const struct algorithm *alg,
+    uint16_t write_bc_ticks,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count,
+    struct bc_buffer *outs,
+    struct kv_pair *const *params,
+    unsigned int lanes,
+    const struct algorithm_check *check,
+    uint32_t *bc_prods,
+    size_t *samples_fed);
+
+#endif
@@ -3,6 +3,10 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "bitstream.h"
+#include "op_count.h"
+#include "trace.h"
+
 // WARNING
 //
 // This version uses extremely confusing terminology throughout the
@@ -35,19 +39,70 @@ static int parse_param_integer(const char *value, int *dst)
     return 0;
 }
 
-static uint32_t bitcell_width_pi_v1(
+// Returns log2(value) if value is a power of two, otherwise -1.
+static int exact_log2(int value)
+{
+    if (value <= 0 || (value & (value - 1)) != 0)
+        return -1;
+    return __builtin_ctz(value);
+}
+
+// value / 2**shift, rounding towards zero exactly as '/' does, so the
+// power-of-two kernel is bit-exact with the generic one.
+static inline int32_t div_pow2(int32_t value, int shift)
+{
+    return (value + ((value >> 31) & ((1 << shift) - 1))) >> shift;
+}
+
+enum bitcell_width_pi_v1_kernel
+{
+    KERNEL_AUTO,
+    KERNEL_GENERIC,
+    KERNEL_POW2,
+};
+
+struct bitcell_width_pi_v1_state
+{
+    int p_mul;
+    int p_div;
+    int i_mul;
+    int i_div;
+
+    // Gains as shifts when both multipliers are 1 and both divisors powers of
+    // two, for the kernel without divides.
+    int pow2_kernel;
+    int p_shift;
+    int i_shift;
+
+    uint16_t write_bc_ticks;
+    struct data_logger *logger;
+    uint64_t timestamp;
+    uint16_t prev_sample;
+    int have_prev_sample;
+
+    // dma_wr struct
+    uint32_t phase_step;
+    int32_t phase_integral;
+    uint32_t prev_bc_left;
+    uint32_t curr_bc_left;
+
+    struct bitstream bs;
+};
+
+static int bitcell_width_pi_v1_init(
+    void *state,
     uint16_t write_bc_ticks,
-    uint16_t *ff_samples,
-    size_t ff_sample_count,
-    uint32_t *bc_buf,
-    uint32_t bc_bufmask,
+    struct bc_buffer *out,
     struct kv_pair *params,
     struct data_logger *logger)
 {
+    struct bitcell_width_pi_v1_state *s = state;
+
     int p_mul = -1;
     int p_div = -1;
     int i_mul = -1;
     int i_div = -1;
+    enum bitcell_width_pi_v1_kernel kernel = KERNEL_AUTO;
 
     for (
         struct kv_pair *param = params;
@@ -59,7 +114,7 @@ static uint32_t bitcell_width_pi_v1(
             if (parse_param_integer(param->value, &p_mul) < 0)
             {
                 fprintf(stderr, "bitcell_width_pi parameter %s must be a positive integer\n", param->key);
-                return 0;
+                return -1;
             }
         }
         else if (strcmp(param->key, "p_div") == 0)
@@ -67,7 +122,7 @@ static uint32_t bitcell_width_pi_v1(
             if (parse_param_integer(param->value, &p_div) < 0)
             {
                 fprintf(stderr, "bitcell_width_pi parameter %s must be a positive integer\n", param->key);
-                return 0;
+                return -1;
             }
         }
         else if (strcmp(param->key, "i_mul") == 0)
@@ -75,7 +130,7 @@ static uint32_t bitcell_width_pi_v1(
             if (parse_param_integer(param->value, &i_mul) < 0)
             {
                 fprintf(stderr, "bitcell_width_pi parameter %s must be a positive integer\n", param->key);
-                return 0;
+                return -1;
             }
         }
         else if (strcmp(param->key, "i_div") == 0)
@@ -83,7 +138,21 @@ static uint32_t bitcell_width_pi_v1(
             if (parse_param_integer(param->value, &i_div) < 0)
             {
                 fprintf(stderr, "bitcell_width_pi parameter %s must be a positive integer\n", param->key);
-                return 0;
+                return -1;
+            }
+        }
+        else if (strcmp(param->key, "kernel") == 0)
+        {
+            if (strcmp(param->value, "auto") == 0)
+                kernel = KERNEL_AUTO;
+            else if (strcmp(param->value, "generic") == 0)
+                kernel = KERNEL_GENERIC;
+            else if (strcmp(param->value, "pow2") == 0)
+                kernel = KERNEL_POW2;
+            else
+            {
+                fprintf(stderr, "bitcell_width_pi parameter kernel must be auto, generic or pow2\n");
+                return -1;
             }
         }
         else
@@ -95,36 +164,83 @@ static uint32_t bitcell_width_pi_v1(
     if (p_mul == -1 || p_div == -1 || i_mul == -1 || i_div == -1)
     {
         fprintf(stderr, "bitcell_width_pi_v1: required parameters not set\n");
-        return 0;
+        return -1;
     }
 
-    uint64_t timestamp = 0ULL;
-    data_logger_set_timestamp_freq(logger, 72000000);
+    s->p_mul = p_mul;
+    s->p_div = p_div;
+    s->i_mul = i_mul;
+    s->i_div = i_div;
 
-    // dma_wr struct
-    uint32_t phase_step;
-    int32_t phase_integral;
-    uint32_t prev_bc_left;
-    uint32_t curr_bc_left;
+    s->p_shift = exact_log2(p_div);
+    s->i_shift = exact_log2(i_div);
+    int pow2_ok = p_mul == 1 && i_mul == 1 && s->p_shift >= 0 && s->i_shift >= 0;
+    if (kernel == KERNEL_POW2 && !pow2_ok)
+    {
+        fprintf(stderr, "bitcell_width_pi_v1: kernel=pow2 needs p_mul=i_mul=1 and power of two divisors\n");
+        return -1;
+    }
+    s->pow2_kernel = kernel != KERNEL_GENERIC && pow2_ok;
+
+    s->write_bc_ticks = write_bc_ticks;
+    s->logger = logger;
+    s->timestamp = 0ULL;
+    s->have_prev_sample = 0;
+    data_logger_set_timestamp_freq(logger, 72000000);
+    data_logger_set_phase_fraction_bits(logger, 16);
 
     // Things that happen when write-enable is asserted.
-    phase_step = 1 << 16;
-    phase_integral = 0;
-    prev_bc_left = 0;
-    curr_bc_left = 0;
+    s->phase_step = 1 << 16;
+    s->phase_integral = 0;
+    s->prev_bc_left = 0;
+    s->curr_bc_left = 0;
 
     // Things that happen on each DMA
-    uint32_t bc_prod = 0;
-    uint32_t bc_dat = ~0;
+    bitstream_init(&s->bs, out);
 
-    for (int ii = 0; ii < ff_sample_count; ++ii)
+    return 0;
+}
+
+// The decode loop, instantiated once with divides for arbitrary gains and once
+// with shifts for power-of-two gains.
+static inline __attribute__((always_inline)) void bitcell_width_pi_v1_feed_kernel(
+    void *state,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count,
+    const int pow2)
+{
+    struct bitcell_width_pi_v1_state *s = state;
+
+    const int32_t p_mul = s->p_mul;
+    const int32_t p_div = s->p_div;
+    const int32_t i_mul = s->i_mul;
+    const int32_t i_div = s->i_div;
+    const int p_shift = s->p_shift;
+    const int i_shift = s->i_shift;
+    const uint16_t write_bc_ticks = s->write_bc_ticks;
+    struct data_logger *logger = s->logger;
+
+    uint64_t timestamp = s->timestamp;
+    uint32_t phase_step = s->phase_step;
+    int32_t phase_integral = s->phase_integral;
+    uint32_t prev_bc_left = s->prev_bc_left;
+    uint32_t curr_bc_left = s->curr_bc_left;
+
+    struct bitstream bs = s->bs;
+
+    for (size_t ii = 0; ii < ff_sample_count; ++ii)
     {
-        if (ii > 0) {
-            timestamp += (uint16_t)(ff_samples[ii] - ff_samples[ii-1]);
+        if (s->have_prev_sample) {
+            timestamp += (uint16_t)(ff_samples[ii] - s->prev_sample);
         }
+        s->prev_sample = ff_samples[ii];
+        s->have_prev_sample = 1;
 
         // Scale the NCO frequency to the expected data frequency
         uint32_t bc_step = phase_step * (uint32_t)write_bc_ticks;
+        OPS(OP_FLUX, 1);
+        OPS(OP_BRANCH, 3);
+        OPS(OP_MUL, 1);
 
         // Shifted up 16-bits so samples wraparound at the same time as the
         // phase accumulator
@@ -145,7 +261,7 @@ static uint32_t bitcell_width_pi_v1(
         // If the next edge would fall within the previous
         if (distance_from_prev_bc_left < (curr_bc_left - prev_bc_left))
         {
-            printf("Runt\n");
+            TRACE(TRACE_LEVEL_EVENTS, TRACE_RUNT, timestamp, 16, distance_from_prev_bc_left, 0, 0);
             continue;
         }
 
@@ -159,16 +275,14 @@ static uint32_t bitcell_width_pi_v1(
         int zeros = 0;
         while (distance_from_curr_bc_left > bc_step)
         {
-            bc_dat <<= 1;
-            bc_prod++;
-
-            if (!(bc_prod & 31))
-                bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
-
             zeros++;
             distance_from_curr_bc_left -= bc_step;
             curr_bc_left += bc_step;
         }
+        OPS(OP_LOOP, zeros);
+        OPS(OP_BRANCH, zeros + 1);
+
+        TRACE(TRACE_LEVEL_DETAIL, TRACE_ZERO_RUN, timestamp, 16, zeros, distance_from_curr_bc_left, 0);
 
         // printf("Zeros: %3d Edge bc: [%10u,%10u) ([%8x,%8x)) Dist: %10d (%8.3f) ",
         //        zeros,
@@ -177,15 +291,13 @@ static uint32_t bitcell_width_pi_v1(
         //        distance_from_curr_bc_left, (double)distance_from_curr_bc_left / 65536.0);
 
         // Record a one for this bitcell
-        bc_dat = (bc_dat << 1) | 1;
-        bc_prod++;
-        if (!(bc_prod & 31))
-            bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
+        bitstream_put_run(&bs, zeros);
 
         // Figure out the phase error before we start mucking with state
         int32_t phase_error = ((int32_t)distance_from_curr_bc_left - ((int32_t)bc_step / 2)) / (int32_t)write_bc_ticks;
+        OPS(OP_DIV, 1);
 
-        data_logger_event(logger, timestamp, (double)phase_error*(double)write_bc_ticks/65536.0);
+        data_logger_event(logger, timestamp, phase_error * (int32_t)write_bc_ticks);
 
         // printf("Phase Error: %8d ", phase_error);
 
@@ -209,24 +321,62 @@ static uint32_t bitcell_width_pi_v1(
 
         // printf("P: %10d I: %10d ", phase_error/16, phase_integral/1024);
 
-        phase_step = (uint32_t)((int32_t)(1 << 16) + (phase_error * p_mul / p_div) + (phase_integral * i_mul / i_div));
+        int32_t p_term = pow2 ? div_pow2(phase_error, p_shift) : phase_error * p_mul / p_div;
+        int32_t i_term = pow2 ? div_pow2(phase_integral, i_shift) : phase_integral * i_mul / i_div;
+        OPS(OP_BRANCH, 2);
+        OPS(OP_MUL, pow2 ? 0 : 2);
+        OPS(OP_DIV, pow2 ? 0 : 2);
+        phase_step = (uint32_t)((int32_t)(1 << 16) + p_term + i_term);
+
+        // Traced as bitcell widths, like the other PLLs, rather than NCO steps.
+        TRACE(TRACE_LEVEL_DETAIL, TRACE_PHASE_ADJUST, timestamp, 16,
+            phase_error * (int32_t)write_bc_ticks, (p_term + i_term) * (int32_t)write_bc_ticks,
+            phase_step * (uint32_t)write_bc_ticks);
 
         // printf("Phase step: %10u\n", phase_step);
     }
 
-    bc_buf[(bc_prod / 32) & bc_bufmask] = htobe32(bc_dat << (-bc_prod & 31));
-    return bc_prod;
+    s->timestamp = timestamp;
+    s->phase_step = phase_step;
+    s->phase_integral = phase_integral;
+    s->prev_bc_left = prev_bc_left;
+    s->curr_bc_left = curr_bc_left;
+    s->bs = bs;
+}
+
+static void bitcell_width_pi_v1_feed(
+    void *state,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count)
+{
+    struct bitcell_width_pi_v1_state *s = state;
+
+    if (s->pow2_kernel)
+        bitcell_width_pi_v1_feed_kernel(state, ff_samples, ff_sample_count, 1);
+    else
+        bitcell_width_pi_v1_feed_kernel(state, ff_samples, ff_sample_count, 0);
+}
+
+static uint32_t bitcell_width_pi_v1_finish(void *state)
+{
+    struct bitcell_width_pi_v1_state *s = state;
+
+    return bitstream_finish(&s->bs);
 }
 
 static struct parameter bitcell_width_pi_v1_params[] = {
     {.name = "p_mul", .required = 1, .description = "f"},
-    {.name = "p_div", .required = 1, .description = ""},
+    {.name = "p_div", .required = 1, .description = "", .tune_min = 2, .tune_max = 256 * 1024},
     {.name = "i_mul", .required = 1, .description = ""},
-    {.name = "i_div", .required = 1, .description = ""},
+    {.name = "i_div", .required = 1, .description = "", .tune_min = 8, .tune_max = 1024 * 1024},
+    {.name = "kernel", .required = 0, .description = "auto, generic or pow2 (default: auto)"},
     {.name = NULL, .description = NULL}};
 
 struct algorithm algorithm_bitcell_width_pi_v1 = {
     .name = "bitcell_width_pi_v1",
-    .func = bitcell_width_pi_v1,
+    .state_size = sizeof(struct bitcell_width_pi_v1_state),
+    .init = bitcell_width_pi_v1_init,
+    .feed = bitcell_width_pi_v1_feed,
+    .finish = bitcell_width_pi_v1_finish,
     .params = bitcell_width_pi_v1_params,
 };
\ No newline at end of file
@@ -3,11 +3,9 @@
 #include <stdio.h>
 #include <string.h>
 
-#if 0
-#define DEBUG(...) printf(__VA_ARGS__)
-#else
-#define DEBUG(...)
-#endif
+#include "bitstream.h"
+#include "op_count.h"
+#include "trace.h"
 
 // bitcell_width_pi_v2 applies a PI control loop adjusting bitcell width based
 // on the distance of a WDATA# edge from the center of the bitcell.  Because
@@ -35,21 +33,79 @@ static int parse_param_integer(const char *value, int *dst)
     return 0;
 }
 
+// Returns log2(value) if value is a power of two, otherwise -1.
+static int exact_log2(int value)
+{
+    if (value <= 0 || (value & (value - 1)) != 0)
+        return -1;
+    return __builtin_ctz(value);
+}
+
+// Whether gains can run on the power-of-two kernel: both multipliers 1 and
+// both divisors powers of two.
+static int pow2_gains(int p_mul, int p_div, int i_mul, int i_div)
+{
+    return p_mul == 1 && i_mul == 1 && exact_log2(p_div) >= 0 && exact_log2(i_div) >= 0;
+}
+
+// value / 2**shift, rounding towards zero exactly as '/' does, so the
+// power-of-two kernel is bit-exact with the generic one.
+static inline int32_t div_pow2(int32_t value, int shift)
+{
+    return (value + ((value >> 31) & ((1 << shift) - 1))) >> shift;
+}
+
 #define BC_WIDTH_FRACTIONAL_BITS    16
 
-static uint32_t bitcell_width_pi_v2(
+enum bitcell_width_pi_v2_kernel
+{
+    KERNEL_AUTO,
+    KERNEL_GENERIC,
+    KERNEL_POW2,
+};
+
+struct bitcell_width_pi_v2_state
+{
+    int p_mul;
+    int p_div;
+    int i_mul;
+    int i_div;
+
+    // Gains as shifts when both multipliers are 1 and both divisors powers of
+    // two, for the kernel without divides.
+    int pow2_kernel;
+    int p_shift;
+    int i_shift;
+
+    uint16_t write_bc_ticks;
+    struct data_logger *logger;
+    uint64_t timestamp;
+    uint16_t prev_sample;
+    int have_prev_sample;
+
+    // dma_wr struct
+    uint32_t bc_width;  // in (2**BC_WIDTH_FRACTIONAL_BITS)ths of a sample clock
+    int32_t bc_width_error_integral;
+    uint32_t prev_bc_left;
+    uint32_t curr_bc_left;
+
+    struct bitstream bs;
+};
+
+static int bitcell_width_pi_v2_init(
+    void *state,
     uint16_t write_bc_ticks,
-    uint16_t *ff_samples,
-    size_t ff_sample_count,
-    uint32_t *bc_buf,
-    uint32_t bc_bufmask,
+    struct bc_buffer *out,
     struct kv_pair *params,
     struct data_logger *logger)
 {
+    struct bitcell_width_pi_v2_state *s = state;
+
     int p_mul = -1;
     int p_div = -1;
     int i_mul = -1;
     int i_div = -1;
+    enum bitcell_width_pi_v2_kernel kernel = KERNEL_AUTO;
 
     for (
         struct kv_pair *param = params;
@@ -61,7 +117,7 @@ static uint32_t bitcell_width_pi_v2(
             if (parse_param_integer(param->value, &p_mul) < 0)
             {
                 fprintf(stderr, "bitcell_width_pi parameter %s must be a positive integer\n", param->key);
-                return 0;
+                return -1;
             }
         }
         else if (strcmp(param->key, "p_div") == 0)
@@ -69,7 +125,7 @@ static uint32_t bitcell_width_pi_v2(
             if (parse_param_integer(param->value, &p_div) < 0)
             {
                 fprintf(stderr, "bitcell_width_pi parameter %s must be a positive integer\n", param->key);
-                return 0;
+                return -1;
             }
         }
         else if (strcmp(param->key, "i_mul") == 0)
@@ -77,7 +133,7 @@ static uint32_t bitcell_width_pi_v2(
             if (parse_param_integer(param->value, &i_mul) < 0)
             {
                 fprintf(stderr, "bitcell_width_pi parameter %s must be a positive integer\n", param->key);
-                return 0;
+                return -1;
             }
         }
         else if (strcmp(param->key, "i_div") == 0)
@@ -85,7 +141,21 @@ static uint32_t bitcell_width_pi_v2(
             if (parse_param_integer(param->value, &i_div) < 0)
             {
                 fprintf(stderr, "bitcell_width_pi parameter %s must be a positive integer\n", param->key);
-                return 0;
+                return -1;
+            }
+        }
+        else if (strcmp(param->key, "kernel") == 0)
+        {
+            if (strcmp(param->value, "auto") == 0)
+                kernel = KERNEL_AUTO;
+            else if (strcmp(param->value, "generic") == 0)
+                kernel = KERNEL_GENERIC;
+            else if (strcmp(param->value, "pow2") == 0)
+                kernel = KERNEL_POW2;
+            else
+            {
+                fprintf(stderr, "bitcell_width_pi parameter kernel must be auto, generic or pow2\n");
+                return -1;
             }
         }
         else
@@ -97,41 +167,80 @@ static uint32_t bitcell_width_pi_v2(
     if (p_mul == -1 || p_div == -1 || i_mul == -1 || i_div == -1)
     {
         fprintf(stderr, "bitcell_width_pi_v2: required parameters not set\n");
-        return 0;
+        return -1;
     }
 
-    uint64_t timestamp = 0ULL;
-    data_logger_set_timestamp_freq(logger, 72000000);
+    s->p_mul = p_mul;
+    s->p_div = p_div;
+    s->i_mul = i_mul;
+    s->i_div = i_div;
 
-    // dma_wr struct
-    uint32_t bc_width;  // in (2**BC_WIDTH_FRACTIONAL_BITS)ths of a sample clock
-    int32_t bc_width_error_integral;
-    uint32_t prev_bc_left;
-    uint32_t curr_bc_left;
+    s->p_shift = exact_log2(p_div);
+    s->i_shift = exact_log2(i_div);
+    int pow2_ok = pow2_gains(p_mul, p_div, i_mul, i_div);
+    if (kernel == KERNEL_POW2 && !pow2_ok)
+    {
+        fprintf(stderr, "bitcell_width_pi_v2: kernel=pow2 needs p_mul=i_mul=1 and power of two divisors\n");
+        return -1;
+    }
+    s->pow2_kernel = kernel != KERNEL_GENERIC && pow2_ok;
+
+    s->write_bc_ticks = write_bc_ticks;
+    s->logger = logger;
+    s->timestamp = 0ULL;
+    s->have_prev_sample = 0;
+    data_logger_set_timestamp_freq(logger, 72000000);
+    data_logger_set_phase_fraction_bits(logger, BC_WIDTH_FRACTIONAL_BITS);
 
     // Things that happen when write-enable is asserted.
-    bc_width_error_integral = 0;
-    prev_bc_left = 0;
-    curr_bc_left = 0;
+    s->bc_width = 0;
+    s->bc_width_error_integral = 0;
+    s->prev_bc_left = 0;
+    s->curr_bc_left = 0;
 
     // Things that happen on each DMA
-    uint32_t bc_prod = 0;
-    uint32_t bc_dat = ~0;
+    bitstream_init(&s->bs, out);
+
+    return 0;
+}
 
-    for (int ii = 0; ii < ff_sample_count; ++ii)
+// The decode loop, instantiated once with divides for arbitrary gains and once
+// with shifts for power-of-two gains.
+static inline __attribute__((always_inline)) void bitcell_width_pi_v2_feed_kernel(
+    void *state,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count,
+    const int pow2)
+{
+    struct bitcell_width_pi_v2_state *s = state;
+
+    const int32_t p_mul = s->p_mul;
+    const int32_t p_div = s->p_div;
+    const int32_t i_mul = s->i_mul;
+    const int32_t i_div = s->i_div;
+    const int p_shift = s->p_shift;
+    const int i_shift = s->i_shift;
+    const uint16_t write_bc_ticks = s->write_bc_ticks;
+
+    uint64_t timestamp = s->timestamp;
+    uint32_t bc_width = s->bc_width;
+    int32_t bc_width_error_integral = s->bc_width_error_integral;
+    uint32_t prev_bc_left = s->prev_bc_left;
+    uint32_t curr_bc_left = s->curr_bc_left;
+
+    struct bitstream bs = s->bs;
+
+    for (size_t ii = 0; ii < ff_sample_count; ++ii)
     {
         uint32_t curr_edge = ff_samples[ii] << BC_WIDTH_FRACTIONAL_BITS;
+        OPS(OP_FLUX, 1);
+        OPS(OP_BRANCH, 3);
 
-        DEBUG("\n");
-
-        if (ii > 0) {
-            DEBUG("timestamp: %lu\tprev_sample=%u\tcurr_sample=%u\tdist=%u\n",
-                timestamp, ff_samples[ii-1], ff_samples[ii], (uint16_t)(ff_samples[ii] - ff_samples[ii-1]));
-            timestamp += (uint16_t)(ff_samples[ii] - ff_samples[ii-1]);
+        if (s->have_prev_sample) {
+            timestamp += (uint16_t)(ff_samples[ii] - s->prev_sample);
         }
-
-        DEBUG("timestamp: %lu\tbc_width=%u\tprev_bc_left=%u\tcurr_bc_left=%u\tcurr_edge=%u\n",
-            timestamp, bc_width, prev_bc_left, curr_bc_left, curr_edge);
+        s->prev_sample = ff_samples[ii];
+        s->have_prev_sample = 1;
 
         // If this is the first pulse since WGATE was asserted, treat it as
         // perfectly aligned with the center of the current bitcell.
@@ -141,8 +250,7 @@ static uint32_t bitcell_width_pi_v2(
             curr_bc_left = curr_edge - (bc_width / 2);
             prev_bc_left = curr_bc_left - bc_width;
 
-            DEBUG("timestamp: %lu\tFIRST EDGE AFTER WGATE\tbc_width=%u\tprev_bc_left=%u\tcurr_bc_left=%u\tcurr_edge=%u\n",
-                timestamp, bc_width, prev_bc_left, curr_bc_left, curr_edge);
+            TRACE(TRACE_LEVEL_EVENTS, TRACE_FIRST_EDGE, timestamp, BC_WIDTH_FRACTIONAL_BITS, bc_width, 0, 0);
         }
 
         // If the next edge would fall within the previous, consider it a runt
@@ -150,8 +258,7 @@ static uint32_t bitcell_width_pi_v2(
         uint32_t distance_from_prev_bc_left = curr_edge - prev_bc_left;
         if (distance_from_prev_bc_left < (curr_bc_left - prev_bc_left))
         {
-            DEBUG("timestamp: %lu\tRUNT\tdistance_from_prev_bc_left=%u\n",
-                timestamp, distance_from_prev_bc_left);
+            TRACE(TRACE_LEVEL_EVENTS, TRACE_RUNT, timestamp, BC_WIDTH_FRACTIONAL_BITS, distance_from_prev_bc_left, 0, 0);
             continue;
         }
 
@@ -160,31 +267,23 @@ static uint32_t bitcell_width_pi_v2(
         int zeros = 0;
         while (distance_from_curr_bc_left > bc_width)
         {
-            bc_dat <<= 1;
-            bc_prod++;
-
-            if (!(bc_prod & 31))
-                bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
-
             zeros++;
             distance_from_curr_bc_left -= bc_width;
             curr_bc_left += bc_width;
         }
+        OPS(OP_LOOP, zeros);
+        OPS(OP_BRANCH, zeros + 1);
 
-        DEBUG("timestamp: %lu\tzeros=%d\tcurr_bc_left=%u\tcurr_edge=%u\tdistance_from_curr_bc_left=%u\n",
-            timestamp, zeros, curr_bc_left, curr_edge, distance_from_curr_bc_left);
+        TRACE(TRACE_LEVEL_DETAIL, TRACE_ZERO_RUN, timestamp, BC_WIDTH_FRACTIONAL_BITS, zeros, distance_from_curr_bc_left, 0);
 
         // Record a one for this bitcell
-        bc_dat = (bc_dat << 1) | 1;
-        bc_prod++;
-        if (!(bc_prod & 31))
-            bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
+        bitstream_put_run(&bs, zeros);
 
         // Calculate distance of the edge from the bitcell's center
         uint32_t curr_bc_center = curr_bc_left + bc_width/2;
         int32_t distance_from_curr_bc_center = curr_edge - curr_bc_center;
 
-        data_logger_event(logger, timestamp, (double)distance_from_curr_bc_center/(double)(1 << BC_WIDTH_FRACTIONAL_BITS));
+        data_logger_event(s->logger, timestamp, distance_from_curr_bc_center);
 
         // Accumulate error into integral, saturating as necessary
         if ((bc_width_error_integral > 0)
@@ -202,11 +301,13 @@ static uint32_t bitcell_width_pi_v2(
             bc_width_error_integral += distance_from_curr_bc_center;
         }
 
-        int32_t p_term = distance_from_curr_bc_center * (int32_t)p_mul / (int32_t)p_div;
-        int32_t i_term = bc_width_error_integral * (int32_t)i_mul / (int32_t)i_div;
-
-        DEBUG("timestamp: %lu\tdistance_from_curr_bc_center=%d\tbc_width_error_integral=%d\tp_term=%ld\ti_term=%ld\n",
-            timestamp, distance_from_curr_bc_center, bc_width_error_integral, p_term, i_term);
+        int32_t p_term = pow2 ? div_pow2(distance_from_curr_bc_center, p_shift)
+            : distance_from_curr_bc_center * p_mul / p_div;
+        int32_t i_term = pow2 ? div_pow2(bc_width_error_integral, i_shift)
+            : bc_width_error_integral * i_mul / i_div;
+        OPS(OP_BRANCH, 2);
+        OPS(OP_MUL, pow2 ? 0 : 2);
+        OPS(OP_DIV, pow2 ? 0 : 2);
 
         prev_bc_left = curr_bc_left;
         curr_bc_left += bc_width;
@@ -214,21 +315,364 @@ static uint32_t bitcell_width_pi_v2(
             (uint32_t)(write_bc_ticks << BC_WIDTH_FRACTIONAL_BITS)
             + p_term 
             + i_term;
+
+        TRACE(TRACE_LEVEL_DETAIL, TRACE_PHASE_ADJUST, timestamp, BC_WIDTH_FRACTIONAL_BITS,
+            distance_from_curr_bc_center, p_term + i_term, bc_width);
     }
 
-    bc_buf[(bc_prod / 32) & bc_bufmask] = htobe32(bc_dat << (-bc_prod & 31));
-    return bc_prod;
+    s->timestamp = timestamp;
+    s->bc_width = bc_width;
+    s->bc_width_error_integral = bc_width_error_integral;
+    s->prev_bc_left = prev_bc_left;
+    s->curr_bc_left = curr_bc_left;
+    s->bs = bs;
+}
+
+static void bitcell_width_pi_v2_feed(
+    void *state,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count)
+{
+    struct bitcell_width_pi_v2_state *s = state;
+
+    if (s->pow2_kernel)
+        bitcell_width_pi_v2_feed_kernel(state, ff_samples, ff_sample_count, 1);
+    else
+        bitcell_width_pi_v2_feed_kernel(state, ff_samples, ff_sample_count, 0);
+}
+
+static uint32_t bitcell_width_pi_v2_finish(void *state)
+{
+    struct bitcell_width_pi_v2_state *s = state;
+
+    return bitstream_finish(&s->bs);
+}
+
+// Sweeps run the same capture through many gain settings, so up to
+// PI_V2_BATCH_LANES of them are decoded in lockstep, each in one lane of a
+// vector.  Lanes whose edge is a runt, or whose run of zeros has ended, are
+// masked out rather than branched around.  Only power-of-two gains are
+// batched since there's no vector integer divide, and nothing is logged or
+// traced.  Each lane produces exactly what the scalar loop would.
+#define PI_V2_BATCH_LANES 8
+
+// Lockstep steps through a run of zeros before the remaining lanes divide.
+// MFM runs are at most 3 zeros long.
+#define PI_V2_BATCH_MAX_STEPS 4
+
+typedef uint32_t pi_v2_lanes __attribute__((vector_size(PI_V2_BATCH_LANES * sizeof(uint32_t))));
+typedef int32_t pi_v2_slanes __attribute__((vector_size(PI_V2_BATCH_LANES * sizeof(int32_t))));
+typedef uint64_t pi_v2_wide_lanes __attribute__((vector_size(PI_V2_BATCH_LANES * sizeof(uint64_t))));
+
+// Built for AVX2, SSE4.2 and baseline x86-64, picked at load time.  Other
+// architectures get whatever the compiler makes of the vector types.
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define PI_V2_BATCH_TARGETS __attribute__((target_clones("avx2", "sse4.2", "default")))
+#endif
+#endif
+#ifndef PI_V2_BATCH_TARGETS
+#define PI_V2_BATCH_TARGETS
+#endif
+
+struct bitcell_width_pi_v2_batch
+{
+    unsigned int lanes;
+    uint16_t write_bc_ticks;
+    uint64_t timestamp;
+    uint16_t prev_sample;
+    int have_prev_sample;
+
+    // Per lane state, loaded into vectors for the duration of a feed().
+    // Unused lanes repeat lane 0 but produce no output.
+    int32_t p_shift[PI_V2_BATCH_LANES];
+    int32_t i_shift[PI_V2_BATCH_LANES];
+    uint32_t bc_width[PI_V2_BATCH_LANES];
+    int32_t bc_width_error_integral[PI_V2_BATCH_LANES];
+    uint32_t prev_bc_left[PI_V2_BATCH_LANES];
+    uint32_t curr_bc_left[PI_V2_BATCH_LANES];
+
+    // All ones for lanes still producing output: those in use whose bitcell
+    // width hasn't run away to 0.
+    uint32_t in_use[PI_V2_BATCH_LANES];
+
+    struct bitstream bs[PI_V2_BATCH_LANES];
+};
+
+_Static_assert(PI_V2_BATCH_LANES <= ALGORITHM_MAX_BATCH_LANES, "too many batch lanes");
+
+static int bitcell_width_pi_v2_batch_init(void *batch, void *const *states, unsigned int lanes)
+{
+    struct bitcell_width_pi_v2_batch *b = batch;
+    const struct bitcell_width_pi_v2_state *first = states[0];
+
+    if (lanes > PI_V2_BATCH_LANES || trace_sink != NULL)
+        return -1;
+
+    for (unsigned int lane = 0; lane < lanes; ++lane)
+    {
+        const struct bitcell_width_pi_v2_state *s = states[lane];
+        if (!s->pow2_kernel || s->logger != NULL || s->write_bc_ticks != first->write_bc_ticks
+            || s->have_prev_sample != first->have_prev_sample || s->prev_sample != first->prev_sample)
+            return -1;
+    }
+
+    b->lanes = lanes;
+    b->write_bc_ticks = first->write_bc_ticks;
+    b->timestamp = first->timestamp;
+    b->prev_sample = first->prev_sample;
+    b->have_prev_sample = first->have_prev_sample;
+
+    for (unsigned int lane = 0; lane < PI_V2_BATCH_LANES; ++lane)
+    {
+        const struct bitcell_width_pi_v2_state *s = states[lane < lanes ? lane : 0];
+        b->p_shift[lane] = s->p_shift;
+        b->i_shift[lane] = s->i_shift;
+        b->bc_width[lane] = s->bc_width;
+        b->bc_width_error_integral[lane] = s->bc_width_error_integral;
+        b->prev_bc_left[lane] = s->prev_bc_left;
+        b->curr_bc_left[lane] = s->curr_bc_left;
+        b->in_use[lane] = lane < lanes ? ~0U : 0;
+        b->bs[lane] = s->bs;
+    }
+
+    return 0;
+}
+
+// Lanes batch_init() takes are those on the power-of-two kernel.  Loggers and
+// tracing aren't given by params, so are still left to batch_init().
+static int bitcell_width_pi_v2_batch_accepts(struct kv_pair *params)
+{
+    int p_mul = -1;
+    int p_div = -1;
+    int i_mul = -1;
+    int i_div = -1;
+
+    for (
+        struct kv_pair *param = params;
+        param != NULL && param->key != NULL;
+        ++param)
+    {
+        int *dst = strcmp(param->key, "p_mul") == 0 ? &p_mul
+            : strcmp(param->key, "p_div") == 0 ? &p_div
+            : strcmp(param->key, "i_mul") == 0 ? &i_mul
+            : strcmp(param->key, "i_div") == 0 ? &i_div
+            : NULL;
+        if (dst != NULL && parse_param_integer(param->value, dst) < 0)
+            return 0;
+        if (strcmp(param->key, "kernel") == 0 && strcmp(param->value, "generic") == 0)
+            return 0;
+    }
+
+    return pow2_gains(p_mul, p_div, i_mul, i_div);
+}
+
+// Macros rather than functions, as passing vectors wider than the baseline
+// ISA's registers by value changes the ABI.
+#define PI_V2_LANES_ANY(mask) ({ \
+        pi_v2_lanes lanes_ = (pi_v2_lanes)(mask); \
+        uint32_t any_ = 0; \
+        for (unsigned int ii_ = 0; ii_ < PI_V2_BATCH_LANES; ++ii_) \
+            any_ |= lanes_[ii_]; \
+        any_ != 0; \
+    })
+
+// Lanes of on_true where mask is set, otherwise of on_false.
+#define PI_V2_SELECT(mask, on_true, on_false) \
+    (((on_true) & (pi_v2_lanes)(mask)) | ((on_false) & ~(pi_v2_lanes)(mask)))
+
+static PI_V2_BATCH_TARGETS void bitcell_width_pi_v2_batch_feed(
+    void *batch,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count)
+{
+    struct bitcell_width_pi_v2_batch *b = batch;
+    const unsigned int lanes = b->lanes;
+
+    const pi_v2_lanes write_bc_width = (pi_v2_lanes){0} + ((uint32_t)b->write_bc_ticks << BC_WIDTH_FRACTIONAL_BITS);
+    pi_v2_slanes p_shift, i_shift;
+    memcpy(&p_shift, b->p_shift, sizeof(p_shift));
+    memcpy(&i_shift, b->i_shift, sizeof(i_shift));
+    const pi_v2_slanes p_round = (((pi_v2_slanes){0} + 1) << p_shift) - 1;
+    const pi_v2_slanes i_round = (((pi_v2_slanes){0} + 1) << i_shift) - 1;
+
+    uint64_t timestamp = b->timestamp;
+    pi_v2_lanes bc_width, prev_bc_left, curr_bc_left;
+    pi_v2_slanes bc_width_error_integral;
+    memcpy(&bc_width, b->bc_width, sizeof(bc_width));
+    memcpy(&bc_width_error_integral, b->bc_width_error_integral, sizeof(bc_width_error_integral));
+    memcpy(&prev_bc_left, b->prev_bc_left, sizeof(prev_bc_left));
+    memcpy(&curr_bc_left, b->curr_bc_left, sizeof(curr_bc_left));
+
+    // Each lane's bitstream is appended to in vectors too, leaving only the
+    // word stores to do lane by lane.  Lanes not in use emit nothing.
+    struct bitstream bs[PI_V2_BATCH_LANES];
+    pi_v2_wide_lanes dat;
+    pi_v2_lanes prod;
+    pi_v2_lanes in_use;
+    memcpy(bs, b->bs, sizeof(bs));
+    memcpy(&in_use, b->in_use, sizeof(in_use));
+    for (unsigned int lane = 0; lane < PI_V2_BATCH_LANES; ++lane)
+    {
+        dat[lane] = bs[lane].dat;
+        prod[lane] = bs[lane].prod;
+    }
+
+    for (size_t ii = 0; ii < ff_sample_count; ++ii)
+    {
+        pi_v2_lanes curr_edge = (pi_v2_lanes){0} + ((uint32_t)ff_samples[ii] << BC_WIDTH_FRACTIONAL_BITS);
+
+        if (b->have_prev_sample) {
+            timestamp += (uint16_t)(ff_samples[ii] - b->prev_sample);
+        }
+        b->prev_sample = ff_samples[ii];
+        b->have_prev_sample = 1;
+
+        // First pulse since WGATE, as in the scalar loop.
+        pi_v2_slanes first = (prev_bc_left == 0) & (curr_bc_left == 0);
+        if (__builtin_expect(PI_V2_LANES_ANY(first), 0))
+        {
+            bc_width = PI_V2_SELECT(first, write_bc_width, bc_width);
+            curr_bc_left = PI_V2_SELECT(first, curr_edge - (bc_width / 2), curr_bc_left);
+            prev_bc_left = PI_V2_SELECT(first, curr_bc_left - bc_width, prev_bc_left);
+        }
+
+        // Runts leave their lane untouched.
+        pi_v2_slanes active = ~((curr_edge - prev_bc_left) < (curr_bc_left - prev_bc_left));
+
+        // Step every lane still short of its edge on by a bitcell until none
+        // are.  A lane whose gains have run away can be millions of bitcells
+        // short, which would hold up the others, so after a few steps any
+        // stragglers jump straight to their edge.  One whose bitcell width
+        // has run away to 0 would never get there, and the scalar loop would
+        // spin forever, so that lane is finished and emits nothing more.
+        pi_v2_lanes distance_from_curr_bc_left = curr_edge - curr_bc_left;
+        pi_v2_lanes zeros = {0};
+        pi_v2_slanes more = active & (pi_v2_slanes)in_use & (distance_from_curr_bc_left > bc_width);
+        for (int step = 0; PI_V2_LANES_ANY(more); ++step)
+        {
+            if (__builtin_expect(step == PI_V2_BATCH_MAX_STEPS, 0))
+            {
+                for (unsigned int lane = 0; lane < PI_V2_BATCH_LANES; ++lane)
+                {
+                    if (!more[lane])
+                        continue;
+
+                    if (bc_width[lane] == 0)
+                    {
+                        in_use[lane] = 0;
+                        continue;
+                    }
+
+                    uint32_t skip = (distance_from_curr_bc_left[lane] - 1) / bc_width[lane];
+                    zeros[lane] += skip;
+                    distance_from_curr_bc_left[lane] -= skip * bc_width[lane];
+                    curr_bc_left[lane] += skip * bc_width[lane];
+                }
+                break;
+            }
+
+            zeros -= (pi_v2_lanes)more;
+            distance_from_curr_bc_left -= bc_width & (pi_v2_lanes)more;
+            curr_bc_left += bc_width & (pi_v2_lanes)more;
+            more &= distance_from_curr_bc_left > bc_width;
+        }
+
+        // Append each lane's zeros and one, at most 32 bitcells at a time as
+        // bitstream_put() does.
+        pi_v2_lanes remaining = (zeros + 1) & (pi_v2_lanes)active & in_use;
+        do
+        {
+            pi_v2_slanes whole = remaining > 32;
+            pi_v2_lanes count = PI_V2_SELECT(whole, (pi_v2_lanes){0} + 32, remaining);
+            pi_v2_lanes bits = (pi_v2_lanes)~whole & (remaining != 0) & 1;
+            pi_v2_lanes fill = (prod & 31) + count;
+
+            dat = (dat << __builtin_convertvector(count, pi_v2_wide_lanes)) | __builtin_convertvector(bits, pi_v2_wide_lanes);
+            prod += count;
+            remaining -= count;
+
+            pi_v2_slanes full = fill >= 32;
+            if (PI_V2_LANES_ANY(full))
+            {
+                for (unsigned int lane = 0; lane < lanes; ++lane)
+                {
+                    uint32_t idx = (prod[lane] >> 5) - 1;
+                    if (full[lane] && bitstream_reach(&bs[lane], idx) == 0)
+                        bs[lane].buf[idx] = htobe32((uint32_t)(dat[lane] >> (fill[lane] - 32)));
+                }
+            }
+        } while (__builtin_expect(PI_V2_LANES_ANY((pi_v2_slanes)remaining), 0));
+
+        pi_v2_slanes distance_from_curr_bc_center = (pi_v2_slanes)(curr_edge - (curr_bc_left + bc_width / 2));
+
+        // Saturating add: the sum overflowed if it differs in sign from both
+        // operands.
+        pi_v2_slanes sum = (pi_v2_slanes)((pi_v2_lanes)bc_width_error_integral + (pi_v2_lanes)distance_from_curr_bc_center);
+        pi_v2_slanes overflow = ((bc_width_error_integral ^ sum) & (distance_from_curr_bc_center ^ sum)) < 0;
+        pi_v2_slanes saturated = (bc_width_error_integral >> 31) ^ INT32_MAX;
+        pi_v2_slanes integral = (pi_v2_slanes)PI_V2_SELECT(overflow, (pi_v2_lanes)saturated, (pi_v2_lanes)sum);
+
+        pi_v2_slanes p_term = (distance_from_curr_bc_center + ((distance_from_curr_bc_center >> 31) & p_round)) >> p_shift;
+        pi_v2_slanes i_term = (integral + ((integral >> 31) & i_round)) >> i_shift;
+
+        bc_width_error_integral = (pi_v2_slanes)PI_V2_SELECT(active, (pi_v2_lanes)integral, (pi_v2_lanes)bc_width_error_integral);
+        prev_bc_left = PI_V2_SELECT(active, curr_bc_left, prev_bc_left);
+        curr_bc_left = PI_V2_SELECT(active, curr_bc_left + bc_width, curr_bc_left);
+        bc_width = PI_V2_SELECT(active, write_bc_width + (pi_v2_lanes)p_term + (pi_v2_lanes)i_term, bc_width);
+    }
+
+    b->timestamp = timestamp;
+    memcpy(b->bc_width, &bc_width, sizeof(bc_width));
+    memcpy(b->bc_width_error_integral, &bc_width_error_integral, sizeof(bc_width_error_integral));
+    memcpy(b->prev_bc_left, &prev_bc_left, sizeof(prev_bc_left));
+    memcpy(b->curr_bc_left, &curr_bc_left, sizeof(curr_bc_left));
+    memcpy(b->in_use, &in_use, sizeof(in_use));
+    for (unsigned int lane = 0; lane < PI_V2_BATCH_LANES; ++lane)
+    {
+        bs[lane].dat = dat[lane];
+        bs[lane].prod = prod[lane];
+    }
+    memcpy(b->bs, bs, sizeof(bs));
+}
+
+static void bitcell_width_pi_v2_batch_finish(void *batch, void *const *states)
+{
+    struct bitcell_width_pi_v2_batch *b = batch;
+
+    for (unsigned int lane = 0; lane < b->lanes; ++lane)
+    {
+        struct bitcell_width_pi_v2_state *s = states[lane];
+        s->timestamp = b->timestamp;
+        s->prev_sample = b->prev_sample;
+        s->have_prev_sample = b->have_prev_sample;
+        s->bc_width = b->bc_width[lane];
+        s->bc_width_error_integral = b->bc_width_error_integral[lane];
+        s->prev_bc_left = b->prev_bc_left[lane];
+        s->curr_bc_left = b->curr_bc_left[lane];
+        s->bs = b->bs[lane];
+    }
 }
 
 static struct parameter bitcell_width_pi_v2_params[] = {
     {.name = "p_mul", .required = 1, .description = "f"},
-    {.name = "p_div", .required = 1, .description = ""},
+    {.name = "p_div", .required = 1, .description = "", .tune_min = 2, .tune_max = 256 * 1024},
     {.name = "i_mul", .required = 1, .description = ""},
-    {.name = "i_div", .required = 1, .description = ""},
+    {.name = "i_div", .required = 1, .description = "", .tune_min = 8, .tune_max = 1024 * 1024},
+    {.name = "kernel", .required = 0, .description = "auto, generic or pow2 (default: auto)"},
     {.name = NULL, .description = NULL}};
 
 struct algorithm algorithm_bitcell_width_pi_v2 = {
     .name = "bitcell_width_pi_v2",
-    .func = bitcell_width_pi_v2,
+    .state_size = sizeof(struct bitcell_width_pi_v2_state),
+    .init = bitcell_width_pi_v2_init,
+    .feed = bitcell_width_pi_v2_feed,
+    .finish = bitcell_width_pi_v2_finish,
     .params = bitcell_width_pi_v2_params,
+    .batch_lanes = PI_V2_BATCH_LANES,
+    .batch_state_size = sizeof(struct bitcell_width_pi_v2_batch),
+    .batch_init = bitcell_width_pi_v2_batch_init,
+    .batch_accepts = bitcell_width_pi_v2_batch_accepts,
+    .batch_feed = bitcell_width_pi_v2_batch_feed,
+    .batch_finish = bitcell_width_pi_v2_batch_finish,
 };
\ No newline at end of file
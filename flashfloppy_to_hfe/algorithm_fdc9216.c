@@ -1,90 +1,130 @@
 #include <stdlib.h>
 #include <stdint.h>
-#include <stdio.h>
 
 #include "algorithm_fdc9216.h"
+#include "bitstream.h"
+#include "op_count.h"
+#include "trace.h"
 
-static uint32_t fdc9216(
+struct fdc9216_state
+{
+    struct data_logger *logger;
+    uint64_t timestamp;
+    uint16_t prev_sample;
+
+    uint32_t write_pll_period;
+    uint32_t write_pll_period_adjust;
+    uint32_t write_pll_period_max;
+    uint32_t write_pll_period_min;
+    uint8_t write_pll_phase_incs;
+    uint8_t write_pll_phase_decs;
+    uint32_t write_prev_bc_left_edge;
+    int pll_phase_offset;
+
+    struct bitstream bs;
+};
+
+static int fdc9216_init(
+    void *state,
     uint16_t write_bc_ticks,
-    uint16_t *ff_samples,
-    size_t ff_sample_count,
-    uint32_t *bc_buf,
-    uint32_t bc_bufmask,
+    struct bc_buffer *out,
     struct kv_pair *params,
     struct data_logger *logger)
 {
+    struct fdc9216_state *s = state;
+
     // A PLL that actually adjusts phase gradually
 
+    s->logger = logger;
+    s->timestamp = 0;
+    data_logger_set_timestamp_freq(logger, 72000000);
+    data_logger_set_phase_fraction_bits(logger, 16);
+    s->prev_sample = 0;
+
     // Things that happen when write-enable is asserted.
-    uint32_t write_pll_period = (uint32_t)write_bc_ticks << 16; // write_bc_ticks
-    uint32_t write_pll_period_adjust = write_pll_period / 800;
-    uint32_t write_pll_period_max = write_pll_period * 11 / 10;
-    uint32_t write_pll_period_min = write_pll_period * 9 / 10;
-    uint8_t write_pll_phase_incs = 0;
-    uint8_t write_pll_phase_decs = 0;
-    uint32_t write_prev_bc_left_edge = 0 - write_pll_period;
-    int pll_phase_offset = 0;
-
-    uint32_t bc_prod = 0;
-    uint32_t bc_dat = ~0;
+    s->write_pll_period = (uint32_t)write_bc_ticks << 16; // write_bc_ticks
+    s->write_pll_period_adjust = s->write_pll_period / 800;
+    s->write_pll_period_max = s->write_pll_period * 11 / 10;
+    s->write_pll_period_min = s->write_pll_period * 9 / 10;
+    s->write_pll_phase_incs = 0;
+    s->write_pll_phase_decs = 0;
+    s->write_prev_bc_left_edge = 0 - s->write_pll_period;
+    s->pll_phase_offset = 0;
+
+    bitstream_init(&s->bs, out);
+
+    return 0;
+}
+
+static void fdc9216_feed(
+    void *state,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count)
+{
+    struct fdc9216_state *s = state;
+
+    uint64_t timestamp = s->timestamp;
+    uint16_t prev_sample = s->prev_sample;
+
+    uint32_t write_pll_period = s->write_pll_period;
+    uint32_t write_pll_period_adjust = s->write_pll_period_adjust;
+    uint32_t write_pll_period_max = s->write_pll_period_max;
+    uint32_t write_pll_period_min = s->write_pll_period_min;
+    uint8_t write_pll_phase_incs = s->write_pll_phase_incs;
+    uint8_t write_pll_phase_decs = s->write_pll_phase_decs;
+    uint32_t write_prev_bc_left_edge = s->write_prev_bc_left_edge;
+    int pll_phase_offset = s->pll_phase_offset;
+
+    struct bitstream bs = s->bs;
 
     // Things that happen on a write DMA buffer full
 
-    for (int ii = 0; ii < ff_sample_count; ++ii)
+    for (size_t ii = 0; ii < ff_sample_count; ++ii)
     {
         uint32_t next_edge = ff_samples[ii] << 16;
+        timestamp += (uint16_t)(ff_samples[ii] - prev_sample);
+        prev_sample = ff_samples[ii];
+        OPS(OP_FLUX, 1);
+        OPS(OP_BRANCH, 1);
 
         // By computing distance, wraparound is accounted for naturally.
         uint32_t distance_from_prev_bc_left_edge = next_edge - write_prev_bc_left_edge;
-        printf("Period: %10u (%8.3f) Phase: %6d (%8.3f) Next edge: %10u (%8x) ",
-               write_pll_period, (double)write_pll_period / 65536.0,
-               pll_phase_offset, (double)pll_phase_offset / 65536.0, next_edge, next_edge);
 
         // If the next edge would fall in the last bitcell, ignore it.
         if (distance_from_prev_bc_left_edge < write_pll_period)
         {
-            printf("Runt\n");
+            TRACE(TRACE_LEVEL_EVENTS, TRACE_RUNT, timestamp, 16, distance_from_prev_bc_left_edge, 0, 0);
             continue;
         }
 
         // Advance to the current bitcell
         uint32_t curr_bc_left_edge = write_prev_bc_left_edge + write_pll_period;
         uint32_t distance_from_curr_bc_left_edge = next_edge - curr_bc_left_edge;
-        printf("Curr bc: %10u (%8x) Dist: %10d (%8.3f) ", curr_bc_left_edge, curr_bc_left_edge,
-               distance_from_curr_bc_left_edge, (double)distance_from_curr_bc_left_edge / 65536.0);
 
         // Record zeros for each bitcell that passed before this pulse
         int zeros = 0;
         while (distance_from_curr_bc_left_edge > write_pll_period)
         {
-            bc_dat <<= 1;
-            bc_prod++;
-
-            if (!(bc_prod & 31))
-                bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
-
             zeros++;
             distance_from_curr_bc_left_edge -= write_pll_period;
             curr_bc_left_edge += write_pll_period;
         }
+        OPS(OP_LOOP, zeros);
+        OPS(OP_BRANCH, zeros + 1);
 
-        printf("Zeros: %3d Edge bc: [%10u,%10u) ([%8x,%8x)) Edge pos: %1u ",
-               zeros,
-               curr_bc_left_edge, curr_bc_left_edge + write_pll_period,
-               curr_bc_left_edge, curr_bc_left_edge + write_pll_period,
-               distance_from_curr_bc_left_edge / (write_pll_period / 16));
+        TRACE(TRACE_LEVEL_DETAIL, TRACE_ZERO_RUN, timestamp, 16, zeros, distance_from_curr_bc_left_edge, 0);
+        data_logger_event(s->logger, timestamp, (int32_t)(distance_from_curr_bc_left_edge - write_pll_period / 2));
 
         // Record a one for this bitcell
-        bc_dat = (bc_dat << 1) | 1;
-        bc_prod++;
-        if (!(bc_prod & 31))
-            bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
+        bitstream_put_run(&bs, zeros);
 
         // If the edge lands more than 1/8th of a pll period from the center,
         // adjust the pll phase by 1/8 so the pulse moves toward the center
         uint32_t pll_phase_adjust = write_pll_period / 8;
         uint32_t pll_phase_early_threshold = write_pll_period * 3 / 8;
         uint32_t pll_phase_late_threshold = write_pll_period * 5 / 8;
+        OPS(OP_MUL, 2);
+        OPS(OP_BRANCH, 3);
 
         if (distance_from_curr_bc_left_edge < pll_phase_early_threshold)
         {
@@ -92,7 +132,8 @@ static uint32_t fdc9216(
             pll_phase_offset -= pll_phase_adjust;
             curr_bc_left_edge -= pll_phase_adjust;
             write_pll_phase_decs++;
-            printf("Early. phase- %8.3f ", (double)pll_phase_offset / 65536.0);
+            TRACE(TRACE_LEVEL_DETAIL, TRACE_PHASE_ADJUST, timestamp, 16,
+                (int32_t)(distance_from_curr_bc_left_edge - write_pll_period / 2), -(int32_t)pll_phase_adjust, write_pll_period);
         }
         else if (distance_from_curr_bc_left_edge > pll_phase_late_threshold)
         {
@@ -100,12 +141,14 @@ static uint32_t fdc9216(
             pll_phase_offset += pll_phase_adjust;
             curr_bc_left_edge += pll_phase_adjust;
             write_pll_phase_incs++;
-            printf("Late.  phase+ %8.3f ", (double)pll_phase_offset / 65536.0);
+            TRACE(TRACE_LEVEL_DETAIL, TRACE_PHASE_ADJUST, timestamp, 16,
+                (int32_t)(distance_from_curr_bc_left_edge - write_pll_period / 2), pll_phase_adjust, write_pll_period);
         }
 
         if (write_pll_phase_incs + write_pll_phase_decs >= 5)
         {
             int history_trend = (int)write_pll_phase_incs - (int)write_pll_phase_decs;
+            OPS(OP_BRANCH, 3);
 
             if (history_trend > 2)
             {
@@ -114,8 +157,9 @@ static uint32_t fdc9216(
                 if (write_pll_period > write_pll_period_max)
                 {
                     write_pll_period = write_pll_period_max;
+                    TRACE(TRACE_LEVEL_EVENTS, TRACE_CLAMP, timestamp, 16, write_pll_period, 1, 0);
                 }
-                printf("period+ %8.3f", (double)write_pll_period / 65536.0);
+                TRACE(TRACE_LEVEL_DETAIL, TRACE_PERIOD_ADJUST, timestamp, 16, write_pll_period_adjust, write_pll_period, 0);
             }
             else if (history_trend < -2)
             {
@@ -124,8 +168,9 @@ static uint32_t fdc9216(
                 if (write_pll_period < write_pll_period_min)
                 {
                     write_pll_period = write_pll_period_min;
+                    TRACE(TRACE_LEVEL_EVENTS, TRACE_CLAMP, timestamp, 16, write_pll_period, -1, 0);
                 }
-                printf("period- %8.3f", (double)write_pll_period / 65536.0);
+                TRACE(TRACE_LEVEL_DETAIL, TRACE_PERIOD_ADJUST, timestamp, 16, -(int32_t)write_pll_period_adjust, write_pll_period, 0);
             }
 
             write_pll_phase_incs = 0;
@@ -133,16 +178,31 @@ static uint32_t fdc9216(
         }
 
         write_prev_bc_left_edge = curr_bc_left_edge;
-
-        printf("\n");
     }
 
-    bc_buf[(bc_prod / 32) & bc_bufmask] = htobe32(bc_dat << (-bc_prod & 31));
-    return bc_prod;
+    s->timestamp = timestamp;
+    s->prev_sample = prev_sample;
+
+    s->write_pll_period = write_pll_period;
+    s->write_pll_phase_incs = write_pll_phase_incs;
+    s->write_pll_phase_decs = write_pll_phase_decs;
+    s->write_prev_bc_left_edge = write_prev_bc_left_edge;
+    s->pll_phase_offset = pll_phase_offset;
+    s->bs = bs;
+}
+
+static uint32_t fdc9216_finish(void *state)
+{
+    struct fdc9216_state *s = state;
+
+    return bitstream_finish(&s->bs);
 }
 
 struct algorithm algorithm_fdc9216 = {
     .name = "fdc9216",
-    .func = fdc9216,
+    .state_size = sizeof(struct fdc9216_state),
+    .init = fdc9216_init,
+    .feed = fdc9216_feed,
+    .finish = fdc9216_finish,
     .params = NULL,
 };
\ No newline at end of file
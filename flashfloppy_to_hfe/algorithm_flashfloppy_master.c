@@ -1,62 +1,192 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "algorithm_flashfloppy_master.h"
+#include "bitstream.h"
+#include "op_count.h"
+#include "trace.h"
 
-static uint32_t flashfloppy_master(
+// Intervals shorter than this many ticks are decoded by table lookup.  That
+// covers the longest MFM interval down to about 125kbps; anything longer,
+// such as a gap, falls back to the loop.
+#define FLASHFLOPPY_MASTER_TABLE_SIZE 2048
+
+struct flashfloppy_master_state
+{
+    struct data_logger *logger;
+    uint64_t timestamp;
+
+    /* FlashFloppy master */
+    int cell;
+    uint16_t prev;
+
+    // Decoded interval for each interval below the table size that isn't a
+    // runt: the zero run in the low 16 bits and the final, signed, offset
+    // into the bitcell in the high 16.
+    int table_kernel;
+    uint32_t table[FLASHFLOPPY_MASTER_TABLE_SIZE];
+
+    struct bitstream bs;
+};
+
+// Counts the zero bitcells before the one for an edge *curr ticks past the
+// middle of the last bitcell, leaving the final offset in *curr.
+static inline uint32_t flashfloppy_master_zero_run(int *curr, int cell)
+{
+    uint32_t zeros = 0;
+    while ((*curr -= cell) > 0)
+    {
+        zeros++;
+    }
+    return zeros;
+}
+
+static int flashfloppy_master_init(
+    void *state,
     uint16_t write_bc_ticks,
-    uint16_t *ff_samples,
-    size_t ff_sample_count,
-    uint32_t *bc_buf,
-    uint32_t bc_bufmask,
+    struct bc_buffer *out,
     struct kv_pair *params,
     struct data_logger *logger)
 {
-    uint64_t timestamp = 0ULL;
+    struct flashfloppy_master_state *s = state;
+
+    int table_kernel = 1;
+    for (
+        struct kv_pair *param = params;
+        param != NULL && param->key != NULL;
+        ++param)
+    {
+        if (strcmp(param->key, "kernel") == 0)
+        {
+            if (strcmp(param->value, "table") == 0)
+                table_kernel = 1;
+            else if (strcmp(param->value, "loop") == 0)
+                table_kernel = 0;
+            else
+            {
+                fprintf(stderr, "flashfloppy_master parameter kernel must be table or loop\n");
+                return -1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "flashfloppy_master: unknown parameter %s\n", param->key);
+        }
+    }
+
+    s->logger = logger;
+    s->timestamp = 0ULL;
     data_logger_set_timestamp_freq(logger, 72000000);
 
-    /* FlashFloppy master */
-    int cell = write_bc_ticks;
+    s->cell = write_bc_ticks;
+    s->prev = 0;
 
-    uint16_t prev = 0;
-    uint32_t bc_prod = 0;
-    uint32_t bc_dat = ~0;
+    // The decode only depends on the interval, so work it out once for every
+    // interval the table holds.  Runts are caught before the lookup.
+    s->table_kernel = table_kernel;
+    if (table_kernel)
+    {
+        for (int interval = s->cell >> 1; interval < FLASHFLOPPY_MASTER_TABLE_SIZE; ++interval)
+        {
+            int curr = interval - (s->cell >> 1);
+            uint32_t zeros = flashfloppy_master_zero_run(&curr, s->cell);
+            s->table[interval] = zeros | ((uint32_t)(uint16_t)curr << 16);
+        }
+    }
+
+    bitstream_init(&s->bs, out);
+
+    return 0;
+}
+
+// The decode loop, instantiated once looking intervals up in the table and
+// once running the zero run loop for every interval as the firmware does.
+static inline __attribute__((always_inline)) void flashfloppy_master_feed_kernel(
+    void *state,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count,
+    const int table_kernel)
+{
+    struct flashfloppy_master_state *s = state;
+
+    int cell = s->cell;
+    uint16_t prev = s->prev;
+    const uint32_t *table = s->table;
+    struct bitstream bs = s->bs;
 
-    for (int ii = 0; ii < ff_sample_count; ++ii)
+    for (size_t ii = 0; ii < ff_sample_count; ++ii)
     {
         uint16_t next = ff_samples[ii];
-        int curr = (uint16_t)(next - prev) - (cell >> 1);
+        uint16_t interval = next - prev;
+        int curr = interval - (cell >> 1);
+        OPS(OP_FLUX, 1);
+        OPS(OP_BRANCH, 1);
 
         if (curr < 0)
         {
             /* Runt flux, much shorter than bitcell clock. Merge it forward. */
+            TRACE(TRACE_LEVEL_EVENTS, TRACE_RUNT, s->timestamp + interval, 0, interval, 0, 0);
             continue;
         }
-        timestamp += (uint16_t)(next - prev);
+        s->timestamp += interval;
         prev = next;
 
-        while ((curr -= cell) > 0)
+        uint32_t zeros;
+        if (table_kernel && __builtin_expect(interval < FLASHFLOPPY_MASTER_TABLE_SIZE, 1))
         {
-            bc_dat <<= 1;
-            bc_prod++;
-            if (!(bc_prod & 31))
-                bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
+            uint32_t entry = table[interval];
+            zeros = entry & 0xffff;
+            curr = (int16_t)(entry >> 16);
+            OPS(OP_BRANCH, 1);
         }
+        else
+        {
+            zeros = flashfloppy_master_zero_run(&curr, cell);
+            OPS(OP_LOOP, zeros);
+            OPS(OP_BRANCH, zeros + 1);
+        }
+        TRACE(TRACE_LEVEL_DETAIL, TRACE_ZERO_RUN, s->timestamp, 0, zeros, curr, 0);
 
-        data_logger_event(logger, timestamp, curr + (cell >> 1));
+        data_logger_event(s->logger, s->timestamp, curr + (cell >> 1));
 
-        bc_dat = (bc_dat << 1) | 1;
-        bc_prod++;
-        if (!(bc_prod & 31))
-            bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
+        bitstream_put_run(&bs, zeros);
     }
 
-    bc_buf[(bc_prod / 32) & bc_bufmask] = htobe32(bc_dat << (-bc_prod & 31));
-    return bc_prod;
+    s->prev = prev;
+    s->bs = bs;
+}
+
+static void flashfloppy_master_feed(
+    void *state,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count)
+{
+    struct flashfloppy_master_state *s = state;
+
+    if (s->table_kernel)
+        flashfloppy_master_feed_kernel(state, ff_samples, ff_sample_count, 1);
+    else
+        flashfloppy_master_feed_kernel(state, ff_samples, ff_sample_count, 0);
 }
 
+static uint32_t flashfloppy_master_finish(void *state)
+{
+    struct flashfloppy_master_state *s = state;
+
+    return bitstream_finish(&s->bs);
+}
+
+static struct parameter flashfloppy_master_params[] = {
+    {.name = "kernel", .required = 0, .description = "table or loop (default: table)"},
+    {.name = NULL, .description = NULL}};
+
 struct algorithm algorithm_flashfloppy_master = {
     .name = "flashfloppy_master",
-    .func = flashfloppy_master,
-    .params = NULL,
-};
\ No newline at end of file
+    .state_size = sizeof(struct flashfloppy_master_state),
+    .init = flashfloppy_master_init,
+    .feed = flashfloppy_master_feed,
+    .finish = flashfloppy_master_finish,
+    .params = flashfloppy_master_params,
+};
@@ -1,57 +1,184 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "algorithm_flashfloppy_v341.h"
+#include "bitstream.h"
+#include "op_count.h"
+#include "trace.h"
 
-static uint32_t flashfloppy_v341(
+// Intervals shorter than this many ticks are decoded by table lookup.  That
+// covers the longest MFM interval down to about 125kbps; anything longer,
+// such as a gap, falls back to the loop.
+#define FLASHFLOPPY_V341_TABLE_SIZE 2048
+
+struct flashfloppy_v341_state
+{
+    struct data_logger *logger;
+    uint64_t timestamp;
+
+    /* FlashFloppy v3.41 */
+    uint16_t cell;
+    uint16_t window;
+    uint16_t prev;
+
+    // Decoded interval for each interval below the table size: the zero run
+    // in the low 16 bits and what's left of the interval in the high 16.
+    int table_kernel;
+    uint32_t table[FLASHFLOPPY_V341_TABLE_SIZE];
+
+    struct bitstream bs;
+};
+
+// Counts the zero bitcells before the one for an interval of *curr ticks,
+// leaving the remainder in *curr.
+static inline uint32_t flashfloppy_v341_zero_run(uint16_t *curr, uint16_t cell, uint16_t window)
+{
+    uint32_t zeros = 0;
+    while (*curr > window)
+    {
+        *curr -= cell;
+        zeros++;
+    }
+    return zeros;
+}
+
+static int flashfloppy_v341_init(
+    void *state,
     uint16_t write_bc_ticks,
-    uint16_t *ff_samples,
-    size_t ff_sample_count,
-    uint32_t *bc_buf,
-    uint32_t bc_bufmask,
+    struct bc_buffer *out,
     struct kv_pair *params,
     struct data_logger *logger)
 {
-    uint64_t timestamp = 0ULL;
+    struct flashfloppy_v341_state *s = state;
+
+    int table_kernel = 1;
+    for (
+        struct kv_pair *param = params;
+        param != NULL && param->key != NULL;
+        ++param)
+    {
+        if (strcmp(param->key, "kernel") == 0)
+        {
+            if (strcmp(param->value, "table") == 0)
+                table_kernel = 1;
+            else if (strcmp(param->value, "loop") == 0)
+                table_kernel = 0;
+            else
+            {
+                fprintf(stderr, "flashfloppy_v341 parameter kernel must be table or loop\n");
+                return -1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "flashfloppy_v341: unknown parameter %s\n", param->key);
+        }
+    }
+
+    s->logger = logger;
+    s->timestamp = 0ULL;
     data_logger_set_timestamp_freq(logger, 72000000);
 
-    /* FlashFloppy v3.41 */
-    uint16_t cell = write_bc_ticks;
-    uint16_t window = cell + (cell >> 1);
+    s->cell = write_bc_ticks;
+    s->window = s->cell + (s->cell >> 1);
+    s->prev = 0;
 
-    uint16_t prev = 0;
-    uint32_t bc_dat = ~0;
-    uint32_t bc_prod = 0;
+    // The decode only depends on the interval, so work it out once for every
+    // interval the table holds.
+    s->table_kernel = table_kernel;
+    if (table_kernel)
+    {
+        for (uint32_t interval = 0; interval < FLASHFLOPPY_V341_TABLE_SIZE; ++interval)
+        {
+            uint16_t curr = interval;
+            uint32_t zeros = flashfloppy_v341_zero_run(&curr, s->cell, s->window);
+            s->table[interval] = zeros | ((uint32_t)curr << 16);
+        }
+    }
+
+    bitstream_init(&s->bs, out);
+
+    return 0;
+}
+
+// The decode loop, instantiated once looking intervals up in the table and
+// once running the zero run loop for every interval as the firmware does.
+static inline __attribute__((always_inline)) void flashfloppy_v341_feed_kernel(
+    void *state,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count,
+    const int table_kernel)
+{
+    struct flashfloppy_v341_state *s = state;
+
+    uint16_t cell = s->cell;
+    uint16_t window = s->window;
+    uint16_t prev = s->prev;
+    const uint32_t *table = s->table;
+    struct bitstream bs = s->bs;
 
-    for (int ii = 0; ii < ff_sample_count; ++ii)
+    for (size_t ii = 0; ii < ff_sample_count; ++ii)
     {
         uint16_t next = ff_samples[ii];
         uint16_t curr = next - prev;
-        timestamp += curr;
+        s->timestamp += curr;
         prev = next;
-        while (curr > window)
+        uint32_t zeros;
+        if (table_kernel && __builtin_expect(curr < FLASHFLOPPY_V341_TABLE_SIZE, 1))
         {
-            curr -= cell;
-            bc_dat <<= 1;
-            bc_prod++;
-            if (!(bc_prod & 31))
-                bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
+            uint32_t entry = table[curr];
+            zeros = entry & 0xffff;
+            curr = entry >> 16;
+            OPS(OP_FLUX, 1);
+            OPS(OP_BRANCH, 1);
         }
-        data_logger_event(logger, timestamp, curr - cell);
-        bc_dat = (bc_dat << 1) | 1;
-        bc_prod++;
-
-        if (!(bc_prod & 31))
-            bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
+        else
+        {
+            zeros = flashfloppy_v341_zero_run(&curr, cell, window);
+            OPS(OP_FLUX, 1);
+            OPS(OP_LOOP, zeros);
+            OPS(OP_BRANCH, zeros + 1);
+        }
+        TRACE(TRACE_LEVEL_DETAIL, TRACE_ZERO_RUN, s->timestamp, 0, zeros, curr, 0);
+        data_logger_event(s->logger, s->timestamp, curr - cell);
+        bitstream_put_run(&bs, zeros);
     }
 
-    bc_buf[(bc_prod / 32) & bc_bufmask] = htobe32(bc_dat << (-bc_prod & 31));
+    s->prev = prev;
+    s->bs = bs;
+}
+
+static void flashfloppy_v341_feed(
+    void *state,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count)
+{
+    struct flashfloppy_v341_state *s = state;
 
-    return bc_prod;
+    if (s->table_kernel)
+        flashfloppy_v341_feed_kernel(state, ff_samples, ff_sample_count, 1);
+    else
+        flashfloppy_v341_feed_kernel(state, ff_samples, ff_sample_count, 0);
 }
 
+static uint32_t flashfloppy_v341_finish(void *state)
+{
+    struct flashfloppy_v341_state *s = state;
+
+    return bitstream_finish(&s->bs);
+}
+
+static struct parameter flashfloppy_v341_params[] = {
+    {.name = "kernel", .required = 0, .description = "table or loop (default: table)"},
+    {.name = NULL, .description = NULL}};
+
 struct algorithm algorithm_flashfloppy_v341 = {
     .name = "flashfloppy_v341",
-    .func = flashfloppy_v341,
-    .params = NULL,
-};
\ No newline at end of file
+    .state_size = sizeof(struct flashfloppy_v341_state),
+    .init = flashfloppy_v341_init,
+    .feed = flashfloppy_v341_feed,
+    .finish = flashfloppy_v341_finish,
+    .params = flashfloppy_v341_params,
+};
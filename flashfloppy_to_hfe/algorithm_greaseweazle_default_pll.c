@@ -1,72 +1,106 @@
 #include <stdlib.h>
 #include <stdint.h>
-#include <stdio.h>
 
 #include "algorithm_greaseweazle_default_pll.h"
+#include "bitstream.h"
+#include "op_count.h"
+#include "trace.h"
 
-static uint32_t greaseweazle_default_pll(
+struct greaseweazle_default_pll_state
+{
+    struct data_logger *logger;
+    uint64_t timestamp;
+
+    /* FlashFloppy master w/ Greaseweazle's Default PLL */
+    int cell_nominal;
+    int cell_min;
+    int cell_max;
+
+    int cell;
+    uint16_t prev;
+
+    struct bitstream bs;
+};
+
+static int greaseweazle_default_pll_init(
+    void *state,
     uint16_t write_bc_ticks,
-    uint16_t *ff_samples,
-    size_t ff_sample_count,
-    uint32_t *bc_buf,
-    uint32_t bc_bufmask,
+    struct bc_buffer *out,
     struct kv_pair *params,
     struct data_logger *logger)
 {
-    uint64_t timestamp = 0;
+    struct greaseweazle_default_pll_state *s = state;
+
+    s->logger = logger;
+    s->timestamp = 0;
     data_logger_set_timestamp_freq(logger, 72000000);
 
-    /* FlashFloppy master w/ Greaseweazle's Default PLL */
-    int cell_nominal = write_bc_ticks;
-    int cell_min = cell_nominal - (cell_nominal * 10 / 100);
-    int cell_max = cell_nominal + (cell_nominal * 10 / 100);
+    s->cell_nominal = write_bc_ticks;
+    s->cell_min = s->cell_nominal - (s->cell_nominal * 10 / 100);
+    s->cell_max = s->cell_nominal + (s->cell_nominal * 10 / 100);
+
+    s->cell = s->cell_nominal;
+    s->prev = 0;
 
-    int cell = cell_nominal;
-    uint16_t prev = 0;
-    uint32_t bc_prod = 0;
-    uint32_t bc_dat = ~0;
+    bitstream_init(&s->bs, out);
 
-    for (int ii = 0; ii < ff_sample_count; ++ii)
+    return 0;
+}
+
+static void greaseweazle_default_pll_feed(
+    void *state,
+    const uint16_t *ff_samples,
+    size_t ff_sample_count)
+{
+    struct greaseweazle_default_pll_state *s = state;
+
+    int cell_nominal = s->cell_nominal;
+    int cell_min = s->cell_min;
+    int cell_max = s->cell_max;
+    int cell = s->cell;
+    uint16_t prev = s->prev;
+    struct bitstream bs = s->bs;
+
+    for (size_t ii = 0; ii < ff_sample_count; ++ii)
     {
         uint16_t next = ff_samples[ii];
         int curr = (uint16_t)(next - prev);
+        OPS(OP_FLUX, 1);
+        OPS(OP_BRANCH, 1);
 
         if (curr < (cell / 2))
         {
             /* Runt flux, much shorter than bitcell clock. Merge it forward. */
-            printf("Runt flux\n");
+            TRACE(TRACE_LEVEL_EVENTS, TRACE_RUNT, s->timestamp + curr, 0, curr, 0, 0);
             continue;
         }
-        timestamp += curr;
+        s->timestamp += curr;
         prev = next;
 
-        uint8_t zeros = 0;
+        uint32_t zeros = 0;
         while ((curr -= cell) > (cell / 2))
         {
             zeros += 1;
-            bc_dat <<= 1;
-            bc_prod++;
-            if (!(bc_prod & 31))
-                bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
         }
-        data_logger_event(logger, timestamp, curr);
+        OPS(OP_LOOP, zeros);
+        OPS(OP_BRANCH, zeros + 1);
+        data_logger_event(s->logger, s->timestamp, curr);
 
-        bc_dat = (bc_dat << 1) | 1;
-        bc_prod++;
-        if (!(bc_prod & 31))
-            bc_buf[((bc_prod - 1) / 32) & bc_bufmask] = htobe32(bc_dat);
+        bitstream_put_run(&bs, zeros);
 
-        printf("Encountered %hhu zeros with phase offset %d ticks\n", zeros, curr);
+        TRACE(TRACE_LEVEL_DETAIL, TRACE_ZERO_RUN, s->timestamp, 0, zeros, curr, 0);
 
         // PLL: Adjust clock frequency according to phase mismatch.
         // curr is now the accumulated phase offset since last pulse
+        OPS(OP_BRANCH, 3);
+        OPS(OP_MUL, 2);
         if (zeros <= 3)
         {
             // In sync: adjust clock by a fraction of the phase mismatch.
             int adj_amount = curr * 5 / 100;
 
             cell += adj_amount;
-            printf("In Sync: adjusting clock by %d ticks to %d\n", adj_amount, cell);
+            TRACE(TRACE_LEVEL_DETAIL, TRACE_PHASE_ADJUST, s->timestamp, 0, curr, adj_amount, cell);
         }
         else
         {
@@ -74,28 +108,39 @@ static uint32_t greaseweazle_default_pll(
             int adj_amount = (cell_nominal - cell) * 5 / 100;
 
             cell += adj_amount;
-            printf("Out of Sync: adjusting clock by %d ticks to %d\n", adj_amount, cell);
+            TRACE(TRACE_LEVEL_DETAIL, TRACE_PHASE_ADJUST, s->timestamp, 0, curr, adj_amount, cell);
         }
 
         // Clamp the clock's adjustment range.
         if (cell > cell_max)
         {
             cell = cell_max;
-            printf("Clock clamped to max %d\n", cell);
+            TRACE(TRACE_LEVEL_EVENTS, TRACE_CLAMP, s->timestamp, 0, cell, 1, 0);
         }
         else if (cell < cell_min)
         {
             cell = cell_min;
-            printf("Clock clamped to min %d\n", cell);
+            TRACE(TRACE_LEVEL_EVENTS, TRACE_CLAMP, s->timestamp, 0, cell, -1, 0);
         }
     }
 
-    bc_buf[(bc_prod / 32) & bc_bufmask] = htobe32(bc_dat << (-bc_prod & 31));
-    return bc_prod;
+    s->cell = cell;
+    s->prev = prev;
+    s->bs = bs;
+}
+
+static uint32_t greaseweazle_default_pll_finish(void *state)
+{
+    struct greaseweazle_default_pll_state *s = state;
+
+    return bitstream_finish(&s->bs);
 }
 
 struct algorithm algorithm_greaseweazle_default_pll = {
     .name = "greaseweazle_default_pll",
-    .func = greaseweazle_default_pll,
+    .state_size = sizeof(struct greaseweazle_default_pll_state),
+    .init = greaseweazle_default_pll_init,
+    .feed = greaseweazle_default_pll_feed,
+    .finish = greaseweazle_default_pll_finish,
     .params = NULL,
-};
\ No newline at end of file
+};
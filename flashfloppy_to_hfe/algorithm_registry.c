@@ -0,0 +1,45 @@
+#include "algorithm.h"
+
+#include <string.h>
+
+#include "algorithm_bitcell_width_pi_v1.h"
+#include "algorithm_bitcell_width_pi_v2.h"
+#include "algorithm_fdc9216.h"
+#include "algorithm_flashfloppy_v341.h"
+#include "algorithm_flashfloppy_master.h"
+#include "algorithm_greaseweazle_default_pll.h"
+#include "algorithm_greaseweazle_fallback_pll.h"
+
+struct algorithm *const ALGS[] = {
+    &algorithm_bitcell_width_pi_v1,
+    &algorithm_bitcell_width_pi_v2,
+    &algorithm_fdc9216,
+    &algorithm_flashfloppy_v341,
+    &algorithm_flashfloppy_master,
+    &algorithm_greaseweazle_default_pll,
+    &algorithm_greaseweazle_fallback_pll,
+    NULL
+};
+
+struct algorithm *algorithm_lookup(char *spec, struct kv_pair **params)
+{
+    *params = NULL;
+
+    char *param_start = strchr(spec, '[');
+    char *param_end = strrchr(spec, ']');
+    if (param_start != NULL && param_end != NULL) {
+        *param_start = '\0';
+        *param_end = '\0';
+
+        param_start++;
+
+        *params = kv_pair_list_from_string(param_start);
+    }
+
+    for (struct algorithm *const *alg = ALGS; *alg != NULL; ++alg) {
+        if (strcmp(spec, (*alg)->name) == 0)
+            return *alg;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,62 @@
+#include "bc_buffer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Every bitcell index a uint32_t bitcell count can reach.
+#define BC_BUFFER_MAX_WORDS ((size_t)1 << 27)
+
+// Memory is committed in multiples of this many words (256KiB).
+#define BC_BUFFER_CHUNK_WORDS ((size_t)64 * 1024)
+
+int bc_buffer_init(struct bc_buffer *buf) {
+    memset(buf, 0, sizeof(*buf));
+
+    void *addr = mmap(NULL, BC_BUFFER_MAX_WORDS * sizeof(uint32_t), PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "ERROR: unable to reserve bitcell buffer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    buf->words = addr;
+    buf->reserved = BC_BUFFER_MAX_WORDS;
+    return 0;
+}
+
+void bc_buffer_free(struct bc_buffer *buf) {
+    if (buf->words != NULL) {
+        munmap(buf->words, buf->reserved * sizeof(uint32_t));
+    }
+    memset(buf, 0, sizeof(*buf));
+}
+
+int bc_buffer_reserve(struct bc_buffer *buf, size_t words) {
+    if (words <= buf->committed) {
+        return 0;
+    }
+
+    size_t target = (words + BC_BUFFER_CHUNK_WORDS - 1) / BC_BUFFER_CHUNK_WORDS * BC_BUFFER_CHUNK_WORDS;
+    if (target > buf->reserved) {
+        target = buf->reserved;
+    }
+
+    if (words > target || mprotect(buf->words + buf->committed,
+            (target - buf->committed) * sizeof(uint32_t), PROT_READ | PROT_WRITE) < 0) {
+        if (!buf->failed) {
+            fprintf(stderr, "ERROR: unable to grow bitcell buffer to %zu bytes\n", words * sizeof(uint32_t));
+        }
+        buf->failed = 1;
+        return -1;
+    }
+
+    buf->committed = target;
+    return 0;
+}
+
+int bc_buffer_prepare(struct bc_buffer *buf, size_t sample_count) {
+    buf->failed = 0;
+    return bc_buffer_reserve(buf, sample_count * BC_BUFFER_BITCELLS_PER_FLUX / 32 + 1);
+}
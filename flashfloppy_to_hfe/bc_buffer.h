@@ -0,0 +1,39 @@
+#ifndef BC_BUFFER_H_
+#define BC_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Output buffer for decoded bitcells.  Address space for the largest possible
+// track (2**32 bitcells) is reserved up front and committed in chunks as the
+// decoder reaches it, so the buffer grows without ever moving or copying and
+// a short track only touches the pages it uses.  Committed pages are kept, so
+// a buffer reused for the next run of a sweep or disk doesn't grow again.
+struct bc_buffer {
+    uint32_t *words;
+    size_t committed;
+    size_t reserved;
+
+    // Set if committing more memory failed.  Bitcells past the committed
+    // words were dropped.
+    int failed;
+};
+
+// Expected bitcells per flux transition when sizing a buffer up front.  MFM
+// transitions are 2, 3 or 4 bitcells apart.
+#define BC_BUFFER_BITCELLS_PER_FLUX 3
+
+// Returns 0 on success or -1 if the address space couldn't be reserved.
+int bc_buffer_init(struct bc_buffer *buf);
+
+void bc_buffer_free(struct bc_buffer *buf);
+
+// Commits at least words words.  Returns 0 on success or -1, also setting
+// failed, if memory couldn't be committed.
+int bc_buffer_reserve(struct bc_buffer *buf, size_t words);
+
+// Commits enough for sample_count flux transitions of typical MFM and clears
+// failed ahead of a decode.
+int bc_buffer_prepare(struct bc_buffer *buf, size_t sample_count);
+
+#endif
@@ -0,0 +1,697 @@
+#include <errno.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "algorithm.h"
+#include "ff_samples.h"
+#include "mfm_synth.h"
+#include "op_count.h"
+
+// Samples per DMA chunk in --budget mode unless given with --chunk.
+#define BUDGET_DEFAULT_CHUNK 512
+
+// FlashFloppy's sample clock, and the MCU clock the budget model assumes.
+#define SAMPLE_CLOCK_HZ 72000000
+
+// Parameters used for algorithms that have required parameters unless the
+// algorithm is given explicitly with --algorithm.
+static const struct {
+    const char *name;
+    const char *spec;
+} default_specs[] = {
+    {"bitcell_width_pi_v1", "bitcell_width_pi_v1[p_mul=1,p_div=8,i_mul=1,i_div=1024]"},
+    {"bitcell_width_pi_v2", "bitcell_width_pi_v2[p_mul=1,p_div=16,i_mul=1,i_div=256]"},
+};
+
+struct bench_trace {
+    char *name;
+    unsigned long rate_kbps;
+    const uint16_t *samples;
+    size_t count;
+    struct ff_samples_map map;
+    uint16_t *synthetic;
+};
+
+struct bench_counters {
+    int cycles_fd;
+    int branch_misses_fd;
+};
+
+struct bench_result {
+    uint32_t bitcells;
+    double ns_per_flux_min;
+    double ns_per_flux_median;
+    double ns_per_flux_p99;
+    double flux_per_s;
+    double bitcells_per_s;
+
+    // Medians over all runs, or -1 if counters are unavailable.
+    double cycles_per_flux;
+    double branch_misses_per_flux;
+};
+
+// Worst DMA chunk of a decode.  Loads are the time to decode a chunk over the
+// time its samples took to arrive, so above 1 the decoder falls behind.
+struct budget_result {
+    size_t chunks;
+    uint64_t min_chunk_ticks;
+    uint64_t host_cycles_worst;
+    double host_load_worst;
+
+    // Per flux over the whole trace, and the model's estimate for the worst
+    // chunk.  Only filled in when built with OP_COUNT=1.
+    double ops_per_flux[OP_KINDS];
+    uint64_t mcu_cycles_worst;
+    double mcu_load_worst;
+};
+
+static void usage(const char *const progname)
+{
+    fprintf(stderr, "Usage: %s [options] [<ff_samples>:<kbps>...]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Times every algorithm over synthesized 250, 500 and 1000kbps IBM MFM tracks and\n");
+    fprintf(stderr, "any recorded traces given.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "\t-a, --algorithm <spec>  benchmark <spec> instead of every algorithm (repeatable)\n");
+    fprintf(stderr, "\t-r, --runs <n>          timed runs per algorithm and trace (default: 21)\n");
+    fprintf(stderr, "\t-s, --no-synthetic      skip the synthetic traces\n");
+    fprintf(stderr, "\t-J, --json              write JSON instead of CSV\n");
+    fprintf(stderr, "\t-b, --budget            feed each trace in DMA sized chunks and report the\n");
+    fprintf(stderr, "\t                        worst chunk's host cycles and whether a 72MHz MCU\n");
+    fprintf(stderr, "\t                        would keep up.  The MCU estimate needs a build with\n");
+    fprintf(stderr, "\t                        make OP_COUNT=1\n");
+    fprintf(stderr, "\t-c, --chunk <n>         samples per DMA chunk for --budget (default: %d)\n", BUDGET_DEFAULT_CHUNK);
+    exit(1);
+}
+
+static int perf_open(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void counters_open(struct bench_counters *counters)
+{
+    counters->cycles_fd = perf_open(PERF_COUNT_HW_CPU_CYCLES);
+    counters->branch_misses_fd = perf_open(PERF_COUNT_HW_BRANCH_MISSES);
+
+    if (counters->cycles_fd < 0 || counters->branch_misses_fd < 0)
+    {
+        fprintf(stderr, "WARNING: hardware counters unavailable (%s), reporting time only\n", strerror(errno));
+        if (counters->cycles_fd >= 0)
+            close(counters->cycles_fd);
+        if (counters->branch_misses_fd >= 0)
+            close(counters->branch_misses_fd);
+        counters->cycles_fd = -1;
+        counters->branch_misses_fd = -1;
+    }
+}
+
+static void counters_start(const struct bench_counters *counters)
+{
+    if (counters->cycles_fd < 0)
+        return;
+
+    ioctl(counters->cycles_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counters->branch_misses_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counters->cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+    ioctl(counters->branch_misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void counters_stop(const struct bench_counters *counters, uint64_t *cycles, uint64_t *branch_misses)
+{
+    if (counters->cycles_fd < 0)
+        return;
+
+    ioctl(counters->cycles_fd, PERF_EVENT_IOC_DISABLE, 0);
+    ioctl(counters->branch_misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counters->cycles_fd, cycles, sizeof(*cycles)) != sizeof(*cycles))
+        *cycles = 0;
+    if (read(counters->branch_misses_fd, branch_misses, sizeof(*branch_misses)) != sizeof(*branch_misses))
+        *branch_misses = 0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double lhs = *(const double *)a;
+    double rhs = *(const double *)b;
+    return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+static double percentile(const double *sorted, int count, int pct)
+{
+    int index = (count * pct + 99) / 100 - 1;
+    return sorted[index < 0 ? 0 : index];
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+// Host cycles from the timestamp counter, or nanoseconds where there isn't
+// one.  Cheap enough to bracket a single chunk.
+static inline uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+// read_cycles() counts per second, measured against CLOCK_MONOTONIC.
+static double cycles_hz(void)
+{
+    struct timespec start, end;
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 50000000};
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t cycles_start = read_cycles();
+    nanosleep(&delay, NULL);
+    uint64_t cycles_end = read_cycles();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (double)(cycles_end - cycles_start) * 1e9 / elapsed_ns(&start, &end);
+}
+
+// Times runs decodes of trace, plus one untimed warm up.  Returns -1 if the
+// algorithm rejects its parameters.
+static int bench_one(const char *spec, const struct bench_trace *trace, int runs,
+    const struct bench_counters *counters, struct bc_buffer *bc_out, struct bench_result *result)
+{
+    char *algorithm = strdup(spec);
+    struct kv_pair *params = NULL;
+    struct algorithm *alg = algorithm_lookup(algorithm, &params);
+    if (alg == NULL)
+    {
+        fprintf(stderr, "Unknown algorithm: %s\n", algorithm);
+        free(algorithm);
+        return -1;
+    }
+
+    uint16_t write_bc_ticks = (500*72) / trace->rate_kbps;
+    void *state = calloc(1, alg->state_size);
+
+    double *ns = calloc(runs, sizeof(double));
+    double *cycles = calloc(runs, sizeof(double));
+    double *branch_misses = calloc(runs, sizeof(double));
+    int ret = 0;
+
+    for (int ii = -1; ii < runs; ++ii)
+    {
+        memset(state, 0, alg->state_size);
+        if (alg->init(state, write_bc_ticks, bc_out, params, NULL) < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        struct timespec start, end;
+        uint64_t run_cycles = 0, run_branch_misses = 0;
+
+        counters_start(counters);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        alg->feed(state, trace->samples, trace->count);
+        result->bitcells = alg->finish(state);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        counters_stop(counters, &run_cycles, &run_branch_misses);
+
+        if (ii < 0)
+            continue;
+
+        ns[ii] = elapsed_ns(&start, &end) / trace->count;
+        cycles[ii] = (double)run_cycles / trace->count;
+        branch_misses[ii] = (double)run_branch_misses / trace->count;
+    }
+
+    if (ret == 0)
+    {
+        qsort(ns, runs, sizeof(double), compare_double);
+        qsort(cycles, runs, sizeof(double), compare_double);
+        qsort(branch_misses, runs, sizeof(double), compare_double);
+
+        result->ns_per_flux_min = ns[0];
+        result->ns_per_flux_median = percentile(ns, runs, 50);
+        result->ns_per_flux_p99 = percentile(ns, runs, 99);
+        result->flux_per_s = 1e9 / result->ns_per_flux_median;
+        result->bitcells_per_s = result->flux_per_s * result->bitcells / trace->count;
+        result->cycles_per_flux = counters->cycles_fd < 0 ? -1 : percentile(cycles, runs, 50);
+        result->branch_misses_per_flux = counters->branch_misses_fd < 0 ? -1 : percentile(branch_misses, runs, 50);
+    }
+
+    free(branch_misses);
+    free(cycles);
+    free(ns);
+    free(state);
+    free(params);
+    free(algorithm);
+    return ret;
+}
+
+// Feeds trace to the algorithm a chunk at a time, as FlashFloppy's write DMA
+// loop would, timing every chunk over runs decodes plus one warm up.
+// Preemption and interrupts only ever add time, so each chunk's cost is its
+// fastest run and the worst chunk is the slowest of those.  Returns -1 if the
+// algorithm rejects its parameters.
+static int bench_budget(const char *spec, const struct bench_trace *trace, int runs, size_t chunk,
+    double host_hz, struct bc_buffer *bc_out, struct budget_result *result)
+{
+    char *algorithm = strdup(spec);
+    struct kv_pair *params = NULL;
+    struct algorithm *alg = algorithm_lookup(algorithm, &params);
+    if (alg == NULL)
+    {
+        fprintf(stderr, "Unknown algorithm: %s\n", algorithm);
+        free(algorithm);
+        return -1;
+    }
+
+    uint16_t write_bc_ticks = (500*72) / trace->rate_kbps;
+    void *state = calloc(1, alg->state_size);
+
+    size_t chunks = (trace->count + chunk - 1) / chunk;
+    uint64_t *chunk_ticks = calloc(chunks, sizeof(uint64_t));
+    uint64_t *chunk_cycles = calloc(chunks, sizeof(uint64_t));
+    int ret = 0;
+
+    memset(result, 0, sizeof(*result));
+    result->chunks = chunks;
+    result->min_chunk_ticks = UINT64_MAX;
+
+    // How long each chunk's samples took to arrive.  The first sample has
+    // nothing before it, so the first chunk is a little short.  A partial
+    // last chunk is only flushed when WGATE drops, so it has no deadline and
+    // isn't judged unless it's all there is.
+    size_t judged = chunks > 1 ? trace->count / chunk : 1;
+    for (size_t ii = 0; ii < chunks; ++ii)
+    {
+        size_t end = ii * chunk + chunk < trace->count ? ii * chunk + chunk : trace->count;
+        for (size_t jj = ii * chunk > 0 ? ii * chunk : 1; jj < end; ++jj)
+            chunk_ticks[ii] += (uint16_t)(trace->samples[jj] - trace->samples[jj - 1]);
+        if (chunk_ticks[ii] == 0)
+            chunk_ticks[ii] = 1;
+        if (ii < judged && chunk_ticks[ii] < result->min_chunk_ticks)
+            result->min_chunk_ticks = chunk_ticks[ii];
+        chunk_cycles[ii] = UINT64_MAX;
+    }
+
+    // Count operations in a separate untimed pass.
+    if (OP_COUNT)
+    {
+        struct op_counts total = {{0}};
+        if (alg->init(state, write_bc_ticks, bc_out, params, NULL) < 0)
+            ret = -1;
+        for (size_t ii = 0; ret == 0 && ii < chunks; ++ii)
+        {
+            size_t offset = ii * chunk;
+            size_t count = trace->count - offset < chunk ? trace->count - offset : chunk;
+            struct op_counts counts = {{0}};
+
+            op_count_sink = &counts;
+            alg->feed(state, &trace->samples[offset], count);
+            op_count_sink = NULL;
+
+            uint64_t mcu_cycles = op_count_mcu_cycles(&counts);
+            double load = (double)mcu_cycles / chunk_ticks[ii];
+            if (ii < judged && load > result->mcu_load_worst)
+            {
+                result->mcu_load_worst = load;
+                result->mcu_cycles_worst = mcu_cycles;
+            }
+            for (int kind = 0; kind < OP_KINDS; ++kind)
+                total.ops[kind] += counts.ops[kind];
+        }
+        for (int kind = 0; kind < OP_KINDS; ++kind)
+            result->ops_per_flux[kind] = (double)total.ops[kind] / trace->count;
+    }
+
+    for (int ii = -1; ret == 0 && ii < runs; ++ii)
+    {
+        memset(state, 0, alg->state_size);
+        if (alg->init(state, write_bc_ticks, bc_out, params, NULL) < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        for (size_t jj = 0; jj < chunks; ++jj)
+        {
+            size_t offset = jj * chunk;
+            size_t count = trace->count - offset < chunk ? trace->count - offset : chunk;
+
+            uint64_t start = read_cycles();
+            alg->feed(state, &trace->samples[offset], count);
+            uint64_t cycles = read_cycles() - start;
+
+            if (ii >= 0 && cycles < chunk_cycles[jj])
+                chunk_cycles[jj] = cycles;
+        }
+        alg->finish(state);
+    }
+
+    if (ret == 0)
+    {
+        for (size_t ii = 0; ii < judged; ++ii)
+        {
+            double load = (chunk_cycles[ii] / host_hz) / ((double)chunk_ticks[ii] / SAMPLE_CLOCK_HZ);
+            if (load > result->host_load_worst)
+                result->host_load_worst = load;
+            if (chunk_cycles[ii] > result->host_cycles_worst)
+                result->host_cycles_worst = chunk_cycles[ii];
+        }
+    }
+
+    free(chunk_cycles);
+    free(chunk_ticks);
+    free(state);
+    free(params);
+    free(algorithm);
+    return ret;
+}
+
+static void print_budget(FILE *out, int json, int first, const char *spec, const struct bench_trace *trace, size_t chunk, const struct budget_result *result)
+{
+    if (json)
+    {
+        fprintf(out, "%s\n  {\"algorithm\": \"%s\", \"trace\": \"%s\", \"rate_kbps\": %lu, \"chunk\": %zu, \"chunks\": %zu, "
+            "\"min_chunk_ticks\": %lu, \"host_cycles_worst\": %lu, \"host_load_worst\": %.4f, ",
+            first ? "" : ",", spec, trace->name, trace->rate_kbps, chunk, result->chunks,
+            (unsigned long)result->min_chunk_ticks, (unsigned long)result->host_cycles_worst, result->host_load_worst);
+        if (!OP_COUNT)
+        {
+            fprintf(out, "\"ops_per_flux\": null, \"mcu_cycles_worst\": null, \"mcu_load_worst\": null, \"keeps_up\": null}");
+            return;
+        }
+        fprintf(out, "\"ops_per_flux\": {");
+        for (int kind = 0; kind < OP_KINDS; ++kind)
+            fprintf(out, "%s\"%s\": %.3f", kind > 0 ? ", " : "", op_kind_name(kind), result->ops_per_flux[kind]);
+        fprintf(out, "}, \"mcu_cycles_worst\": %lu, \"mcu_load_worst\": %.4f, \"keeps_up\": %s}",
+            (unsigned long)result->mcu_cycles_worst, result->mcu_load_worst, result->mcu_load_worst <= 1.0 ? "true" : "false");
+        return;
+    }
+
+    fprintf(out, "\"%s\",\"%s\",%lu,%zu,%zu,%lu,%lu,%.4f,",
+        spec, trace->name, trace->rate_kbps, chunk, result->chunks,
+        (unsigned long)result->min_chunk_ticks, (unsigned long)result->host_cycles_worst, result->host_load_worst);
+    if (OP_COUNT)
+    {
+        for (int kind = OP_LOOP; kind < OP_KINDS; ++kind)
+            fprintf(out, "%.3f,", result->ops_per_flux[kind]);
+        fprintf(out, "%lu,%.4f,%s", (unsigned long)result->mcu_cycles_worst, result->mcu_load_worst,
+            result->mcu_load_worst <= 1.0 ? "yes" : "no");
+    }
+    else
+    {
+        // Empty op count columns, so the row still lines up with the header.
+        for (int kind = OP_LOOP; kind < OP_KINDS; ++kind)
+            fprintf(out, ",");
+        fprintf(out, ",,");
+    }
+    fprintf(out, "\n");
+}
+
+static void print_result(FILE *out, int json, int first, const char *spec, const struct bench_trace *trace, int runs, const struct bench_result *result)
+{
+    if (json)
+    {
+        fprintf(out, "%s\n  {\"algorithm\": \"%s\", \"trace\": \"%s\", \"rate_kbps\": %lu, \"flux\": %zu, \"bitcells\": %u, \"runs\": %d, "
+            "\"ns_per_flux_min\": %.3f, \"ns_per_flux_median\": %.3f, \"ns_per_flux_p99\": %.3f, "
+            "\"flux_per_s\": %.0f, \"bitcells_per_s\": %.0f, ",
+            first ? "" : ",", spec, trace->name, trace->rate_kbps, trace->count, result->bitcells, runs,
+            result->ns_per_flux_min, result->ns_per_flux_median, result->ns_per_flux_p99,
+            result->flux_per_s, result->bitcells_per_s);
+        if (result->cycles_per_flux < 0)
+            fprintf(out, "\"cycles_per_flux\": null, \"branch_misses_per_flux\": null}");
+        else
+            fprintf(out, "\"cycles_per_flux\": %.3f, \"branch_misses_per_flux\": %.4f}",
+                result->cycles_per_flux, result->branch_misses_per_flux);
+        return;
+    }
+
+    fprintf(out, "\"%s\",\"%s\",%lu,%zu,%u,%d,%.3f,%.3f,%.3f,%.0f,%.0f,",
+        spec, trace->name, trace->rate_kbps, trace->count, result->bitcells, runs,
+        result->ns_per_flux_min, result->ns_per_flux_median, result->ns_per_flux_p99,
+        result->flux_per_s, result->bitcells_per_s);
+    if (result->cycles_per_flux >= 0)
+        fprintf(out, "%.3f,%.4f", result->cycles_per_flux, result->branch_misses_per_flux);
+    else
+        fprintf(out, ",");
+    fprintf(out, "\n");
+}
+
+int main(int argc, char *const argv[])
+{
+    static const struct option long_options[] = {
+        {"algorithm", required_argument, NULL, 'a'},
+        {"runs", required_argument, NULL, 'r'},
+        {"no-synthetic", no_argument, NULL, 's'},
+        {"json", no_argument, NULL, 'J'},
+        {"budget", no_argument, NULL, 'b'},
+        {"chunk", required_argument, NULL, 'c'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    const char **specs = NULL;
+    int spec_count = 0;
+    int runs = 21;
+    int synthetic = 1;
+    int json = 0;
+    int budget = 0;
+    long chunk = BUDGET_DEFAULT_CHUNK;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:r:sJbc:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+        {
+            char *algorithm = strdup(optarg);
+            struct kv_pair *params = NULL;
+            struct algorithm *alg = algorithm_lookup(algorithm, &params);
+            free(params);
+            free(algorithm);
+            if (alg == NULL)
+            {
+                fprintf(stderr, "Unknown algorithm: %s\n", optarg);
+                return 1;
+            }
+
+            specs = realloc(specs, (spec_count + 1) * sizeof(char *));
+            specs[spec_count++] = optarg;
+            break;
+        }
+        case 'r':
+            runs = strtol(optarg, NULL, 10);
+            if (runs < 1)
+                usage(argv[0]);
+            break;
+        case 's':
+            synthetic = 0;
+            break;
+        case 'J':
+            json = 1;
+            break;
+        case 'b':
+            budget = 1;
+            break;
+        case 'c':
+            chunk = strtol(optarg, NULL, 10);
+            if (chunk < 1)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (spec_count == 0)
+    {
+        for (struct algorithm *const *alg = ALGS; *alg != NULL; ++alg)
+        {
+            const char *spec = (*alg)->name;
+            for (size_t ii = 0; ii < sizeof(default_specs) / sizeof(default_specs[0]); ++ii)
+            {
+                if (strcmp(default_specs[ii].name, spec) == 0)
+                    spec = default_specs[ii].spec;
+            }
+
+            specs = realloc(specs, (spec_count + 1) * sizeof(char *));
+            specs[spec_count++] = spec;
+        }
+    }
+
+    struct bench_trace *traces = NULL;
+    int trace_count = 0;
+
+    if (synthetic)
+    {
+        // DD, HD and ED PC tracks with about +/-2 ticks of jitter.
+        static const struct {
+            unsigned int rate_kbps;
+            unsigned int sectors;
+        } formats[] = {{250, 9}, {500, 18}, {1000, 36}};
+        for (int ii = 0; ii < 3; ++ii)
+        {
+            traces = realloc(traces, (trace_count + 1) * sizeof(struct bench_trace));
+            struct bench_trace *trace = &traces[trace_count++];
+            memset(trace, 0, sizeof(*trace));
+
+            struct mfm_synth_format fmt;
+            mfm_synth_format_default(&fmt);
+            fmt.rate_kbps = formats[ii].rate_kbps;
+            fmt.sectors = formats[ii].sectors;
+            fmt.jitter_ns = 28;
+
+            asprintf(&trace->name, "synthetic_%u", fmt.rate_kbps);
+            trace->rate_kbps = fmt.rate_kbps;
+            if (mfm_synth(&fmt, &trace->synthetic, &trace->count) < 0)
+            {
+                fprintf(stderr, "ERROR: failed to synthesize %s\n", trace->name);
+                return 1;
+            }
+            trace->samples = trace->synthetic;
+        }
+    }
+
+    for (int ii = optind; ii < argc; ++ii)
+    {
+        char *path = strdup(argv[ii]);
+        char *rate = strrchr(path, ':');
+        char *endptr = NULL;
+        unsigned long rate_kbps = rate != NULL ? strtoul(rate + 1, &endptr, 10) : 0;
+        if (rate_kbps == 0 || *endptr != '\0')
+        {
+            fprintf(stderr, "ERROR: recorded traces are given as <ff_samples>:<kbps>: %s\n", argv[ii]);
+            return 1;
+        }
+        *rate = '\0';
+
+        traces = realloc(traces, (trace_count + 1) * sizeof(struct bench_trace));
+        struct bench_trace *trace = &traces[trace_count++];
+        memset(trace, 0, sizeof(*trace));
+
+        trace->name = path;
+        trace->rate_kbps = rate_kbps;
+        if (ff_samples_map(path, &trace->map) < 0)
+        {
+            return 1;
+        }
+        trace->samples = trace->map.samples;
+        trace->count = trace->map.count;
+        if (trace->count == 0)
+        {
+            fprintf(stderr, "ERROR: %s is empty\n", path);
+            return 1;
+        }
+    }
+
+    if (trace_count == 0)
+    {
+        usage(argv[0]);
+    }
+
+    struct bench_counters counters;
+    counters_open(&counters);
+
+    // Committed once for the longest trace so no timed run grows it.
+    struct bc_buffer bc_out;
+    if (bc_buffer_init(&bc_out) < 0)
+    {
+        return 1;
+    }
+    for (int ii = 0; ii < trace_count; ++ii)
+    {
+        bc_buffer_prepare(&bc_out, traces[ii].count);
+    }
+
+    double host_hz = 0;
+    if (budget)
+    {
+        if (!OP_COUNT)
+            fprintf(stderr, "WARNING: built without OP_COUNT=1, reporting host timing only\n");
+        host_hz = cycles_hz();
+    }
+
+    if (json)
+        printf("[");
+    else if (budget)
+        printf("Algorithm,Trace,Rate,Chunk,Chunks,Min chunk ticks,Worst host cycles/chunk,Worst host load,"
+            "Loops/flux,Branches/flux,Muls/flux,Divs/flux,Worst MCU cycles/chunk,Worst MCU load,Keeps up\n");
+    else
+        printf("Algorithm,Trace,Rate,Flux,Bitcells,Runs,Min ns/flux,Median ns/flux,P99 ns/flux,Flux/s,Bitcells/s,Cycles/flux,Branch misses/flux\n");
+
+    int first = 1;
+    for (int ii = 0; ii < spec_count; ++ii)
+    {
+        for (int jj = 0; jj < trace_count; ++jj)
+        {
+            if (budget)
+            {
+                struct budget_result result;
+                if (bench_budget(specs[ii], &traces[jj], runs, chunk, host_hz, &bc_out, &result) < 0)
+                {
+                    fprintf(stderr, "WARNING: skipping %s on %s\n", specs[ii], traces[jj].name);
+                    continue;
+                }
+
+                print_budget(stdout, json, first, specs[ii], &traces[jj], chunk, &result);
+                fflush(stdout);
+                first = 0;
+                continue;
+            }
+
+            struct bench_result result;
+            if (bench_one(specs[ii], &traces[jj], runs, &counters, &bc_out, &result) < 0)
+            {
+                fprintf(stderr, "WARNING: skipping %s on %s\n", specs[ii], traces[jj].name);
+                continue;
+            }
+
+            print_result(stdout, json, first, specs[ii], &traces[jj], runs, &result);
+            fflush(stdout);
+            first = 0;
+        }
+    }
+
+    if (json)
+        printf("\n]\n");
+
+    for (int ii = 0; ii < trace_count; ++ii)
+    {
+        free(traces[ii].synthetic);
+        if (traces[ii].map.samples != NULL)
+            ff_samples_unmap(&traces[ii].map);
+        free(traces[ii].name);
+    }
+    free(traces);
+    bc_buffer_free(&bc_out);
+    free(specs);
+
+    return 0;
+}
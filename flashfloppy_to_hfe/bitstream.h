@@ -0,0 +1,82 @@
+#ifndef BITSTREAM_H_
+#define BITSTREAM_H_
+
+#include <endian.h>
+#include <stdint.h>
+
+#include "bc_buffer.h"
+
+// Bitcell output shared by the algorithms.  Bitcells are packed MSB first
+// into big-endian 32-bit words of a bc_buffer, the layout FlashFloppy's write
+// DMA produces and hfe_encode() consumes.
+//
+// Decoders emit a run of zero bitcells followed by the one for each flux
+// transition.  Appending the whole run is a single shift and or into a
+// 64-bit accumulator with at most one word store, rather than one branchy
+// iteration per bitcell.
+struct bitstream {
+    struct bc_buffer *out;
+
+    // Copies of out's base and committed size for the fast path.
+    uint32_t *buf;
+    size_t words;
+
+    // Total bitcells produced.  The low (prod & 31) bits of dat haven't been
+    // stored yet.
+    uint32_t prod;
+    uint64_t dat;
+};
+
+static inline void bitstream_init(struct bitstream *bs, struct bc_buffer *out) {
+    bs->out = out;
+    bs->buf = out->words;
+    bs->words = out->committed;
+    bs->prod = 0;
+    bs->dat = ~0ULL;
+}
+
+// Makes word index idx writable.  Returns 0 on success or -1 if the buffer
+// couldn't grow, in which case the word is dropped.
+static inline int bitstream_reach(struct bitstream *bs, uint32_t idx) {
+    if (__builtin_expect(idx < bs->words, 1)) {
+        return 0;
+    }
+
+    int ret = bc_buffer_reserve(bs->out, (size_t)idx + 1);
+    bs->words = bs->out->committed;
+    return ret;
+}
+
+// Appends the low count bitcells of bits, count <= 32.
+static inline void bitstream_put(struct bitstream *bs, uint32_t bits, unsigned int count) {
+    unsigned int fill = (bs->prod & 31) + count;
+
+    bs->dat = (bs->dat << count) | bits;
+    bs->prod += count;
+    if (fill >= 32) {
+        uint32_t idx = (bs->prod >> 5) - 1;
+        if (bitstream_reach(bs, idx) == 0) {
+            bs->buf[idx] = htobe32((uint32_t)(bs->dat >> (fill - 32)));
+        }
+    }
+}
+
+// Appends zeros zero bitcells then a one.
+static inline void bitstream_put_run(struct bitstream *bs, uint32_t zeros) {
+    while (__builtin_expect(zeros >= 32, 0)) {
+        bitstream_put(bs, 0, 32);
+        zeros -= 32;
+    }
+    bitstream_put(bs, 1, zeros + 1);
+}
+
+// Stores the final partial word, padded with bitcells already written, and
+// returns the number of bitcells produced.
+static inline uint32_t bitstream_finish(struct bitstream *bs) {
+    if (bitstream_reach(bs, bs->prod / 32) == 0) {
+        bs->buf[bs->prod / 32] = htobe32((uint32_t)bs->dat << (-bs->prod & 31));
+    }
+    return bs->prod;
+}
+
+#endif
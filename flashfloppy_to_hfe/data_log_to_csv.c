@@ -0,0 +1,44 @@
+#include "data_logger.h"
+
+#include <libgen.h>
+#include <stdio.h>
+
+// Exports a binary phase error log as the "Timestamp,Phase Error" CSV.
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <fflog> [<csv>]\n", basename(argv[0]));
+        return 1;
+    }
+
+    struct data_log_header header;
+    struct data_log_reader *reader = data_log_reader_open(argv[1], &header);
+    if (reader == NULL) {
+        fprintf(stderr, "ERROR: %s is not a readable phase error log\n", argv[1]);
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (argc == 3 && (out = fopen(argv[2], "w")) == NULL) {
+        fprintf(stderr, "ERROR: unable to open %s\n", argv[2]);
+        data_log_reader_close(reader);
+        return 1;
+    }
+
+    fprintf(out, "Timestamp,Phase Error\n");
+
+    struct data_log_record record;
+    int ret;
+    while ((ret = data_log_reader_next(reader, &record)) > 0) {
+        data_log_write_csv(out, &header, &record);
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "ERROR: error reading %s\n", argv[1]);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    data_log_reader_close(reader);
+    return ret < 0 ? 1 : 0;
+}
@@ -1,48 +1,243 @@
 #include "data_logger.h"
 
-#include <inttypes.h>
+#include <endian.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Events are collected into blocks.  The decoder fills one block while the
+// writer thread drains full ones; it only waits if the writer falls a whole
+// ring behind.
+#define DATA_LOG_BLOCK_RECORDS 4096
+#define DATA_LOG_BLOCKS 8
+
+struct data_log_block {
+    struct data_log_record records[DATA_LOG_BLOCK_RECORDS];
+    size_t count;
+};
 
 struct data_logger {
     FILE *fd;
-    uint64_t timestamp_freq_hz;
+    enum data_log_format format;
+    struct data_log_header header;
+
+    struct data_log_block *blocks;
+    struct data_log_block *fill;
+
+    // Blocks are handed to the writer in ring order.  produced and consumed
+    // count blocks and are protected by lock.
+    unsigned int produced;
+    unsigned int consumed;
+    int done;
+
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
 };
 
-struct data_logger * data_logger_open(char const *path) {
+void data_log_write_csv(FILE *fd, const struct data_log_header *header, const struct data_log_record *record) {
+    fprintf(fd, "%f,%f\n",
+        (double)record->timestamp / (double)header->timestamp_freq_hz,
+        (double)record->phase_error / (double)(1U << header->phase_fraction_bits));
+}
+
+static void write_block(struct data_logger *logger, struct data_log_block *block) {
+    if (logger->format == DATA_LOG_CSV) {
+        for (size_t ii = 0; ii < block->count; ++ii) {
+            data_log_write_csv(logger->fd, &logger->header, &block->records[ii]);
+        }
+        return;
+    }
+
+    for (size_t ii = 0; ii < block->count; ++ii) {
+        struct data_log_record *record = &block->records[ii];
+        record->timestamp = htole64(record->timestamp);
+        record->phase_error = (int32_t)htole32((uint32_t)record->phase_error);
+    }
+    fwrite(block->records, sizeof(struct data_log_record), block->count, logger->fd);
+}
+
+static void *writer_main(void *ptr) {
+    struct data_logger *logger = ptr;
+
+    pthread_mutex_lock(&logger->lock);
+    for (;;) {
+        while (logger->consumed == logger->produced && !logger->done) {
+            pthread_cond_wait(&logger->cond, &logger->lock);
+        }
+        if (logger->consumed == logger->produced) {
+            break;
+        }
+
+        struct data_log_block *block = &logger->blocks[logger->consumed % DATA_LOG_BLOCKS];
+        pthread_mutex_unlock(&logger->lock);
+
+        write_block(logger, block);
+        block->count = 0;
+
+        pthread_mutex_lock(&logger->lock);
+        logger->consumed++;
+        pthread_cond_broadcast(&logger->cond);
+    }
+    pthread_mutex_unlock(&logger->lock);
+
+    return NULL;
+}
+
+// Hands the block being filled to the writer and moves on to the next one.
+static void submit_block(struct data_logger *logger) {
+    pthread_mutex_lock(&logger->lock);
+    logger->produced++;
+    pthread_cond_broadcast(&logger->cond);
+    while (logger->produced - logger->consumed >= DATA_LOG_BLOCKS) {
+        pthread_cond_wait(&logger->cond, &logger->lock);
+    }
+    logger->fill = &logger->blocks[logger->produced % DATA_LOG_BLOCKS];
+    pthread_mutex_unlock(&logger->lock);
+}
+
+struct data_logger * data_logger_open(char const *path, enum data_log_format format) {
     if (path == NULL) return NULL;
 
-    struct data_logger *ret = malloc(sizeof(struct data_logger));
+    struct data_logger *ret = calloc(1, sizeof(struct data_logger));
     if (ret == NULL) return NULL;
 
+    ret->blocks = calloc(DATA_LOG_BLOCKS, sizeof(struct data_log_block));
+    if (ret->blocks == NULL) {
+        free(ret);
+        return NULL;
+    }
+
     FILE *fd = fopen(path, "w");
     if (fd == NULL) {
+        free(ret->blocks);
         free(ret);
         return NULL;
     }
 
-    fprintf(fd, "Timestamp,Phase Error\n");
+    memcpy(ret->header.magic, DATA_LOG_MAGIC, sizeof(ret->header.magic));
+    ret->header.timestamp_freq_hz = 1;
+    ret->header.phase_fraction_bits = 0;
+
+    if (format == DATA_LOG_CSV) {
+        fprintf(fd, "Timestamp,Phase Error\n");
+    } else {
+        // Placeholder until the algorithm has described its units, rewritten
+        // on close.
+        fwrite(&ret->header, sizeof(ret->header), 1, fd);
+    }
 
-    ret->timestamp_freq_hz = 1;
     ret->fd = fd;
+    ret->format = format;
+    ret->fill = &ret->blocks[0];
+    pthread_mutex_init(&ret->lock, NULL);
+    pthread_cond_init(&ret->cond, NULL);
+
+    if (pthread_create(&ret->writer, NULL, writer_main, ret) != 0) {
+        pthread_cond_destroy(&ret->cond);
+        pthread_mutex_destroy(&ret->lock);
+        fclose(fd);
+        free(ret->blocks);
+        free(ret);
+        return NULL;
+    }
+
     return ret;
 }
 
 void data_logger_set_timestamp_freq(struct data_logger *logger, uint64_t freq_hz) {
-    logger->timestamp_freq_hz = freq_hz;
+    if (logger == NULL) return;
+    logger->header.timestamp_freq_hz = freq_hz;
+}
+
+void data_logger_set_phase_fraction_bits(struct data_logger *logger, unsigned int bits) {
+    decode_stats_set_phase_fraction_bits(bits);
+    if (logger == NULL) return;
+    logger->header.phase_fraction_bits = bits;
 }
 
 void data_logger_close(struct data_logger *logger) {
+    if (logger == NULL) return;
+
+    if (logger->fill->count > 0) {
+        submit_block(logger);
+    }
+
+    pthread_mutex_lock(&logger->lock);
+    logger->done = 1;
+    pthread_cond_broadcast(&logger->cond);
+    pthread_mutex_unlock(&logger->lock);
+
+    pthread_join(logger->writer, NULL);
+    pthread_cond_destroy(&logger->cond);
+    pthread_mutex_destroy(&logger->lock);
+
+    if (logger->format == DATA_LOG_BINARY) {
+        struct data_log_header header = logger->header;
+        header.timestamp_freq_hz = htole64(header.timestamp_freq_hz);
+        header.phase_fraction_bits = htole32(header.phase_fraction_bits);
+
+        rewind(logger->fd);
+        fwrite(&header, sizeof(header), 1, logger->fd);
+    }
+
     fclose(logger->fd);
+    free(logger->blocks);
+    free(logger);
+}
+
+void data_logger_push(struct data_logger *logger, uint64_t timestamp, int32_t phase_error) {
+    struct data_log_block *block = logger->fill;
+    struct data_log_record *record = &block->records[block->count++];
+    record->timestamp = timestamp;
+    record->phase_error = phase_error;
+    record->reserved = 0;
+
+    if (block->count == DATA_LOG_BLOCK_RECORDS) {
+        submit_block(logger);
+    }
 }
 
-void data_logger_event(
-    struct data_logger *logger,
-    uint64_t timestamp,
-    double phase_error
-) {
-    fprintf(logger->fd, "%f,%f\n",
-        (double)timestamp/(double)logger->timestamp_freq_hz,
-        phase_error);
-}
\ No newline at end of file
+struct data_log_reader {
+    FILE *fd;
+};
+
+struct data_log_reader *data_log_reader_open(char const *path, struct data_log_header *header) {
+    FILE *fd = fopen(path, "rb");
+    if (fd == NULL) return NULL;
+
+    if (fread(header, sizeof(*header), 1, fd) != 1
+        || memcmp(header->magic, DATA_LOG_MAGIC, sizeof(header->magic)) != 0) {
+        fclose(fd);
+        return NULL;
+    }
+    header->timestamp_freq_hz = le64toh(header->timestamp_freq_hz);
+    header->phase_fraction_bits = le32toh(header->phase_fraction_bits);
+
+    struct data_log_reader *reader = malloc(sizeof(struct data_log_reader));
+    if (reader == NULL) {
+        fclose(fd);
+        return NULL;
+    }
+
+    reader->fd = fd;
+    return reader;
+}
+
+int data_log_reader_next(struct data_log_reader *reader, struct data_log_record *record) {
+    if (fread(record, sizeof(*record), 1, reader->fd) != 1) {
+        return ferror(reader->fd) ? -1 : 0;
+    }
+
+    record->timestamp = le64toh(record->timestamp);
+    record->phase_error = (int32_t)le32toh((uint32_t)record->phase_error);
+    return 1;
+}
+
+void data_log_reader_close(struct data_log_reader *reader) {
+    if (reader == NULL) return;
+    fclose(reader->fd);
+    free(reader);
+}
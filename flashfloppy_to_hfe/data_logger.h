@@ -2,18 +2,89 @@
 #define DATA_LOGGER_H_
 
 #include <stdint.h>
+#include <stdio.h>
 
+#include "decode_stats.h"
+
+// Phase error log.  Algorithms record one event per flux transition with the
+// raw sample clock timestamp and the phase error as a fixed point number of
+// sample clock ticks.  Events are batched in memory and written out by a
+// background thread, so the decoder never formats or writes anything itself.
+//
+// A NULL logger is accepted everywhere and discards all events.  Checking for
+// it is inlined, so decoding with logging disabled costs one predictable
+// branch per event.  Events also feed decode_stats when it's collecting.
 struct data_logger;
 
-struct data_logger * data_logger_open(char const *path);
+enum data_log_format {
+    // Packed binary records, see below.  Convert with data_log_to_csv.
+    DATA_LOG_BINARY,
+
+    // The "Timestamp,Phase Error" CSV written by earlier versions, with the
+    // timestamp in seconds and phase error in ticks.
+    DATA_LOG_CSV,
+};
+
+// Binary log file layout.  All fields are little-endian.
+//
+//     struct data_log_header   once at the start of the file
+//     struct data_log_record   once per event until the end of the file
+//
+// Timestamps are counts of a clock running at timestamp_freq_hz.  Phase error
+// in ticks is phase_error / 2**phase_fraction_bits.
+#define DATA_LOG_MAGIC "FFPHLOG1"
+
+struct data_log_header {
+    char magic[8];
+    uint64_t timestamp_freq_hz;
+    uint32_t phase_fraction_bits;
+    uint32_t reserved;
+};
+
+struct data_log_record {
+    uint64_t timestamp;
+    int32_t phase_error;
+    uint32_t reserved;
+};
+
+struct data_logger *data_logger_open(char const *path, enum data_log_format format);
+
+// Flushes any buffered events and closes the log.
 void data_logger_close(struct data_logger *logger);
 
 void data_logger_set_timestamp_freq(struct data_logger *logger, uint64_t freq_hz);
 
-void data_logger_event(
+// Number of fractional bits in the phase errors an algorithm logs.  Defaults
+// to 0, i.e. whole ticks.
+void data_logger_set_phase_fraction_bits(struct data_logger *logger, unsigned int bits);
+
+void data_logger_push(struct data_logger *logger, uint64_t timestamp, int32_t phase_error);
+
+static inline void data_logger_event(
     struct data_logger *logger,
     uint64_t timestamp,
-    double phase_error
-);
+    int32_t phase_error
+) {
+    if (DECODE_STATS) {
+        decode_stats_phase(phase_error);
+    }
+    if (logger != NULL) {
+        data_logger_push(logger, timestamp, phase_error);
+    }
+}
+
+// Reader for binary logs.  Returns NULL if path can't be opened or isn't a
+// binary log.
+struct data_log_reader;
+
+struct data_log_reader *data_log_reader_open(char const *path, struct data_log_header *header);
+
+// Returns 1 if a record was read, 0 at the end of the log or -1 on error.
+int data_log_reader_next(struct data_log_reader *reader, struct data_log_record *record);
+
+void data_log_reader_close(struct data_log_reader *reader);
+
+// Writes one record as a line of the CSV export.
+void data_log_write_csv(FILE *fd, const struct data_log_header *header, const struct data_log_record *record);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,172 @@
+#include "decode_stats.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "trace.h"
+
+__thread struct decode_stats *decode_stats_sink;
+
+static const double QUANTILES[] = {0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99};
+static const char *const QUANTILE_NAMES[] = {"p1", "p5", "p25", "p50", "p75", "p95", "p99"};
+#define QUANTILE_COUNT (sizeof(QUANTILES) / sizeof(QUANTILES[0]))
+
+void decode_stats_begin(struct decode_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->phase_min = INT32_MAX;
+    stats->phase_max = INT32_MIN;
+    decode_stats_sink = stats;
+}
+
+void decode_stats_end(void) {
+    decode_stats_sink = NULL;
+}
+
+void decode_stats_set_phase_fraction_bits(unsigned int bits) {
+    if (decode_stats_sink != NULL) {
+        decode_stats_sink->phase_fraction_bits = bits;
+    }
+}
+
+void decode_stats_push_phase(struct decode_stats *stats, int32_t phase_error) {
+    stats->phase_count++;
+    if (phase_error < stats->phase_min) stats->phase_min = phase_error;
+    if (phase_error > stats->phase_max) stats->phase_max = phase_error;
+    stats->phase_sum += phase_error;
+    stats->phase_sum_squares += (double)phase_error * phase_error;
+
+    // Scale to quarter ticks, rounding down so negative errors bin evenly.
+    int64_t bin;
+    if (stats->phase_fraction_bits >= 2) {
+        bin = phase_error >> (stats->phase_fraction_bits - 2);
+    } else {
+        bin = (int64_t)phase_error * (DECODE_STATS_BINS_PER_TICK >> stats->phase_fraction_bits);
+    }
+    bin += DECODE_STATS_BINS / 2;
+
+    if (bin < 0) bin = 0;
+    if (bin >= DECODE_STATS_BINS) bin = DECODE_STATS_BINS - 1;
+    stats->phase_bins[bin]++;
+}
+
+void decode_stats_push_event(struct decode_stats *stats, int event, int32_t a, int32_t b) {
+    switch (event) {
+    case TRACE_RUNT:
+        stats->runts++;
+        break;
+    case TRACE_ZERO_RUN:
+        stats->zero_runs[a < DECODE_STATS_ZERO_RUNS - 1 ? a : DECODE_STATS_ZERO_RUNS - 1]++;
+        break;
+    case TRACE_PHASE_ADJUST:
+        if (b > 0) stats->phase_incs++;
+        if (b < 0) stats->phase_decs++;
+        break;
+    case TRACE_CLAMP:
+        if (b > 0) stats->clamps_max++;
+        else stats->clamps_min++;
+        break;
+    case TRACE_PERIOD_ADJUST:
+        if (a > 0) stats->period_incs++;
+        if (a < 0) stats->period_decs++;
+        break;
+    }
+}
+
+static double to_ticks(const struct decode_stats *stats, double value) {
+    return ldexp(value, -(int)stats->phase_fraction_bits);
+}
+
+double decode_stats_quantile(const struct decode_stats *stats, double q) {
+    if (stats->phase_count == 0) {
+        return 0.0;
+    }
+
+    // Interpolate within the bin holding the target rank, then keep the
+    // estimate inside what was actually seen in case it's an end bin.
+    double target = q * stats->phase_count;
+    double seen = 0;
+    int bin = 0;
+    while (bin < DECODE_STATS_BINS - 1 && seen + stats->phase_bins[bin] < target) {
+        seen += stats->phase_bins[bin++];
+    }
+
+    double within = stats->phase_bins[bin] > 0 ? (target - seen) / stats->phase_bins[bin] : 0.0;
+    double value = (bin - DECODE_STATS_BINS / 2 + within) / DECODE_STATS_BINS_PER_TICK;
+
+    double min = to_ticks(stats, stats->phase_min);
+    double max = to_ticks(stats, stats->phase_max);
+    return value < min ? min : value > max ? max : value;
+}
+
+struct summary {
+    double min;
+    double max;
+    double mean;
+    double stddev;
+};
+
+static struct summary summarize(const struct decode_stats *stats) {
+    struct summary summary = {0};
+    if (stats->phase_count == 0) {
+        return summary;
+    }
+
+    double mean = (double)stats->phase_sum / stats->phase_count;
+    double variance = stats->phase_sum_squares / stats->phase_count - mean * mean;
+
+    summary.min = to_ticks(stats, stats->phase_min);
+    summary.max = to_ticks(stats, stats->phase_max);
+    summary.mean = to_ticks(stats, mean);
+    summary.stddev = to_ticks(stats, sqrt(variance > 0 ? variance : 0));
+    return summary;
+}
+
+void decode_stats_print(const struct decode_stats *stats, FILE *out) {
+    const struct summary summary = summarize(stats);
+
+    fprintf(out, "Edges: %lu\n", (unsigned long)stats->phase_count);
+    if (stats->phase_count > 0) {
+        fprintf(out, "Phase error (ticks): min %.3f, max %.3f, mean %.3f, stddev %.3f\n",
+            summary.min, summary.max, summary.mean, summary.stddev);
+        fprintf(out, "Phase error quantiles (ticks):");
+        for (size_t ii = 0; ii < QUANTILE_COUNT; ++ii) {
+            fprintf(out, " %s %.2f", QUANTILE_NAMES[ii], decode_stats_quantile(stats, QUANTILES[ii]));
+        }
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "Runts: %lu\n", (unsigned long)stats->runts);
+    fprintf(out, "Zero runs:");
+    for (int ii = 0; ii < DECODE_STATS_ZERO_RUNS; ++ii) {
+        fprintf(out, " %d%s: %lu", ii, ii == DECODE_STATS_ZERO_RUNS - 1 ? "+" : "", (unsigned long)stats->zero_runs[ii]);
+    }
+    fprintf(out, "\n");
+    fprintf(out, "Phase adjustments: %lu up, %lu down\n", (unsigned long)stats->phase_incs, (unsigned long)stats->phase_decs);
+    fprintf(out, "Period adjustments: %lu up, %lu down\n", (unsigned long)stats->period_incs, (unsigned long)stats->period_decs);
+    fprintf(out, "Clamps: %lu at max, %lu at min\n", (unsigned long)stats->clamps_max, (unsigned long)stats->clamps_min);
+}
+
+void decode_stats_write_json(const struct decode_stats *stats, FILE *out) {
+    const struct summary summary = summarize(stats);
+
+    fprintf(out, "{\n  \"edges\": %lu,\n  \"phase_error_ticks\": ", (unsigned long)stats->phase_count);
+    if (stats->phase_count > 0) {
+        fprintf(out, "{\"min\": %.3f, \"max\": %.3f, \"mean\": %.4f, \"stddev\": %.4f",
+            summary.min, summary.max, summary.mean, summary.stddev);
+        for (size_t ii = 0; ii < QUANTILE_COUNT; ++ii) {
+            fprintf(out, ", \"%s\": %.2f", QUANTILE_NAMES[ii], decode_stats_quantile(stats, QUANTILES[ii]));
+        }
+        fprintf(out, "},\n");
+    } else {
+        fprintf(out, "null,\n");
+    }
+
+    fprintf(out, "  \"runts\": %lu,\n  \"zero_runs\": [", (unsigned long)stats->runts);
+    for (int ii = 0; ii < DECODE_STATS_ZERO_RUNS; ++ii) {
+        fprintf(out, "%s%lu", ii > 0 ? ", " : "", (unsigned long)stats->zero_runs[ii]);
+    }
+    fprintf(out, "],\n");
+    fprintf(out, "  \"phase_adjusts\": {\"up\": %lu, \"down\": %lu},\n", (unsigned long)stats->phase_incs, (unsigned long)stats->phase_decs);
+    fprintf(out, "  \"period_adjusts\": {\"up\": %lu, \"down\": %lu},\n", (unsigned long)stats->period_incs, (unsigned long)stats->period_decs);
+    fprintf(out, "  \"clamps\": {\"max\": %lu, \"min\": %lu}\n}\n", (unsigned long)stats->clamps_max, (unsigned long)stats->clamps_min);
+}
@@ -0,0 +1,96 @@
+#ifndef DECODE_STATS_H_
+#define DECODE_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Summary statistics of a decode, gathered in process so a run can be
+// characterized without writing and crunching a full phase error log.
+// Nothing is added to the algorithms: every phase error they pass to
+// data_logger_event() and every TRACE() event is also counted here, whether
+// or not a log or trace is being written.
+//
+// Like tracing, statistics are collected for the current thread between
+// decode_stats_begin() and decode_stats_end().  Otherwise each hook costs one
+// predictable branch.
+//
+// The hooks are compiled in with make DECODE_STATS=1.  At the default of 0
+// they compile to nothing, so TRACE() at TRACE_LEVEL 0 and a NULL logger cost
+// nothing either, and --stats is refused.
+#ifndef DECODE_STATS
+#define DECODE_STATS 0
+#endif
+
+enum decode_stats_format {
+    DECODE_STATS_NONE,
+
+    // A readable summary on stdout.
+    DECODE_STATS_TEXT,
+
+    // A JSON object in a .stats.json file beside the image.
+    DECODE_STATS_JSON,
+};
+
+// Zero runs of 0 to DECODE_STATS_ZERO_RUNS - 2 bitcells are counted by
+// length, longer ones together in the last slot.
+#define DECODE_STATS_ZERO_RUNS 8
+
+// Phase error histogram in quarter ticks, centered on zero, from which the
+// quantiles are read.  Errors beyond +-128 ticks land in the end bins.
+#define DECODE_STATS_BINS_PER_TICK 4
+#define DECODE_STATS_BINS (256 * DECODE_STATS_BINS_PER_TICK)
+
+struct decode_stats {
+    // Phase errors are in ticks / 2**phase_fraction_bits, as logged.
+    unsigned int phase_fraction_bits;
+    uint64_t phase_count;
+    int32_t phase_min;
+    int32_t phase_max;
+    int64_t phase_sum;
+    double phase_sum_squares;
+    uint32_t phase_bins[DECODE_STATS_BINS];
+
+    uint64_t runts;
+    uint64_t zero_runs[DECODE_STATS_ZERO_RUNS];
+    uint64_t clamps_max;
+    uint64_t clamps_min;
+    uint64_t phase_incs;
+    uint64_t phase_decs;
+    uint64_t period_incs;
+    uint64_t period_decs;
+};
+
+// Statistics for the current thread, NULL if not being collected.
+extern __thread struct decode_stats *decode_stats_sink;
+
+// Clears stats and collects the current thread's decode into it.
+void decode_stats_begin(struct decode_stats *stats);
+void decode_stats_end(void);
+
+void decode_stats_set_phase_fraction_bits(unsigned int bits);
+
+void decode_stats_push_phase(struct decode_stats *stats, int32_t phase_error);
+
+// event is an enum trace_event with its a and b arguments.
+void decode_stats_push_event(struct decode_stats *stats, int event, int32_t a, int32_t b);
+
+static inline void decode_stats_phase(int32_t phase_error) {
+    if (__builtin_expect(decode_stats_sink != NULL, 0)) {
+        decode_stats_push_phase(decode_stats_sink, phase_error);
+    }
+}
+
+static inline void decode_stats_event(int event, int32_t a, int32_t b) {
+    if (__builtin_expect(decode_stats_sink != NULL, 0)) {
+        decode_stats_push_event(decode_stats_sink, event, a, b);
+    }
+}
+
+// Phase error at quantile q, 0 to 1, in ticks.  Resolution is a bin.
+double decode_stats_quantile(const struct decode_stats *stats, double q);
+
+// Writes stats as a readable summary, or as a JSON object.
+void decode_stats_print(const struct decode_stats *stats, FILE *out);
+void decode_stats_write_json(const struct decode_stats *stats, FILE *out);
+
+#endif
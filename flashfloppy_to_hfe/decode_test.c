@@ -0,0 +1,318 @@
+#include "algorithm.h"
+#include "bc_buffer.h"
+#include "mfm_synth.h"
+
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Specialized decode loops promise exactly the bitcells of the loop they
+// stand in for.  Each pair here is decoded from the same synthesized tracks
+// and the bitcells compared.
+struct decode_pair {
+    const char *fast;
+    const char *reference;
+};
+
+static const struct decode_pair PAIRS[] = {
+    // Power-of-two gains with shifts against the generic divides, including
+    // the gains a sweep reaches at either end.
+    {"bitcell_width_pi_v1[p_mul=1,p_div=4,i_mul=1,i_div=16]",
+     "bitcell_width_pi_v1[p_mul=1,p_div=4,i_mul=1,i_div=16,kernel=generic]"},
+    {"bitcell_width_pi_v1[p_mul=1,p_div=16,i_mul=1,i_div=1024]",
+     "bitcell_width_pi_v1[p_mul=1,p_div=16,i_mul=1,i_div=1024,kernel=generic]"},
+    {"bitcell_width_pi_v1[p_mul=1,p_div=131072,i_mul=1,i_div=524288]",
+     "bitcell_width_pi_v1[p_mul=1,p_div=131072,i_mul=1,i_div=524288,kernel=generic]"},
+    {"bitcell_width_pi_v2[p_mul=1,p_div=4,i_mul=1,i_div=16]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=4,i_mul=1,i_div=16,kernel=generic]"},
+    {"bitcell_width_pi_v2[p_mul=1,p_div=16,i_mul=1,i_div=1024]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=16,i_mul=1,i_div=1024,kernel=generic]"},
+    {"bitcell_width_pi_v2[p_mul=1,p_div=131072,i_mul=1,i_div=524288]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=131072,i_mul=1,i_div=524288,kernel=generic]"},
+
+    // Interval lookup tables against the zero run loop.
+    {"flashfloppy_v341", "flashfloppy_v341[kernel=loop]"},
+    {"flashfloppy_master", "flashfloppy_master[kernel=loop]"},
+};
+
+// Lanes decoded in one pass by algorithm_decode_batch(), each compared with
+// a decode of its spec on its own.  A NULL spec ends a batch short of the
+// full lanes.
+static const char *const BATCHES[][ALGORITHM_MAX_BATCH_LANES] = {
+    // Gains at either end of a sweep alongside ordinary ones, including gains
+    // that run the bitcell width away to 0.
+    {"bitcell_width_pi_v2[p_mul=1,p_div=1,i_mul=1,i_div=1]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=4,i_mul=1,i_div=16]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=131072,i_mul=1,i_div=524288]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=16,i_mul=1,i_div=1024]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=8,i_mul=1,i_div=256]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=1,i_mul=1,i_div=1]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=32,i_mul=1,i_div=4096]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=64,i_mul=1,i_div=65536]"},
+
+    // A batch with lanes to spare.
+    {"bitcell_width_pi_v2[p_mul=1,p_div=8,i_mul=1,i_div=64]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=1,i_mul=1,i_div=1]",
+     "bitcell_width_pi_v2[p_mul=1,p_div=16,i_mul=1,i_div=2048]"},
+};
+
+// A track at each data rate, written a little off speed and with jitter so
+// the PLLs have something to correct.  A NULL spec is a ramp through every
+// interval instead, which lands on each bitcell boundary exactly.
+struct decode_track {
+    unsigned int rate_kbps;
+    const char *spec;
+};
+
+static const struct decode_track TRACKS[] = {
+    {250, "synth[secs=9,rate=250,offset=-3000,jitter=150,seed=2]"},
+    {500, "synth[rate=500,offset=2000,jitter=100,seed=3]"},
+    {1000, "synth[rate=1000,rpm=600,offset=1000,jitter=50,seed=4]"},
+    {250, NULL},
+    {500, NULL},
+    {1000, NULL},
+};
+
+// Longest interval in the ramp, in ticks.  Twice the lookup tables, so the
+// loop fallback is covered too.
+#define DECODE_RAMP_MAX 4096
+
+// Samples one tick further apart each time, from 1 tick to DECODE_RAMP_MAX,
+// with a 2 bitcell interval after each to bring the PLLs back towards the
+// nominal bitcell.
+static uint16_t *interval_ramp(uint16_t write_bc_ticks, size_t *count) {
+    uint16_t *samples = malloc(2 * DECODE_RAMP_MAX * sizeof(uint16_t));
+    if (samples == NULL) {
+        return NULL;
+    }
+
+    uint16_t tick = 0;
+    for (unsigned int interval = 1; interval <= DECODE_RAMP_MAX; ++interval) {
+        samples[2 * (interval - 1)] = tick += interval;
+        samples[2 * (interval - 1) + 1] = tick += 2 * write_bc_ticks;
+    }
+    *count = 2 * DECODE_RAMP_MAX;
+    return samples;
+}
+
+// Decodes samples with the algorithm spec names into out.  Returns the
+// number of bitcells, or 0 if the spec is invalid or bitcells were dropped.
+static uint32_t decode(const char *spec, uint16_t write_bc_ticks, const uint16_t *samples, size_t count, struct bc_buffer *out) {
+    char *algorithm = strdup(spec);
+    struct kv_pair *params = NULL;
+    const struct algorithm *alg = algorithm_lookup(algorithm, &params);
+
+    uint32_t bc_prod = 0;
+    if (alg == NULL) {
+        fprintf(stderr, "ERROR: unknown algorithm %s\n", spec);
+    } else {
+        bc_prod = algorithm_decode(alg, write_bc_ticks, samples, count, out, params, NULL);
+        if (out->failed) {
+            bc_prod = 0;
+        }
+    }
+
+    free(params);
+    free(algorithm);
+    return bc_prod;
+}
+
+// Decodes samples with every lane of batch at once into outs, setting
+// bc_prods[lane] to the lane's bitcells, or 0 if bitcells were dropped.
+// Returns the number of lanes, or 0 if a spec is invalid or can't be batched.
+static unsigned int decode_batch(const char *const *batch, uint16_t write_bc_ticks, const uint16_t *samples, size_t count, struct bc_buffer *outs, uint32_t *bc_prods) {
+    char *algorithms[ALGORITHM_MAX_BATCH_LANES] = {NULL};
+    struct kv_pair *params[ALGORITHM_MAX_BATCH_LANES] = {NULL};
+    const struct algorithm *alg = NULL;
+
+    unsigned int lanes = 0;
+    for (; lanes < ALGORITHM_MAX_BATCH_LANES && batch[lanes] != NULL; ++lanes) {
+        algorithms[lanes] = strdup(batch[lanes]);
+        const struct algorithm *lane_alg = algorithm_lookup(algorithms[lanes], &params[lanes]);
+        if (lane_alg == NULL || (alg != NULL && lane_alg != alg) || !algorithm_batchable(lane_alg, params[lanes])) {
+            fprintf(stderr, "ERROR: %s can't be batched\n", batch[lanes]);
+            alg = NULL;
+            ++lanes;
+            break;
+        }
+        alg = lane_alg;
+    }
+
+    if (alg != NULL) {
+        algorithm_decode_batch(alg, write_bc_ticks, samples, count, outs, params, lanes, bc_prods);
+        for (unsigned int lane = 0; lane < lanes; ++lane) {
+            if (outs[lane].failed) {
+                bc_prods[lane] = 0;
+            }
+        }
+    }
+
+    for (unsigned int lane = 0; lane < lanes; ++lane) {
+        free(params[lane]);
+        free(algorithms[lane]);
+    }
+    return alg != NULL ? lanes : 0;
+}
+
+// Returns the first bitcell at which a and b differ, or -1 if they're the
+// same.
+static int64_t first_difference(const struct bc_buffer *a, uint32_t a_prod, const struct bc_buffer *b, uint32_t b_prod) {
+    uint32_t prod = a_prod < b_prod ? a_prod : b_prod;
+
+    for (uint32_t word = 0; word < (prod + 31) / 32; ++word) {
+        if (a->words[word] != b->words[word]) {
+            uint32_t diff = be32toh(a->words[word] ^ b->words[word]);
+            int64_t bit = (int64_t)word * 32 + __builtin_clz(diff);
+            if (bit < prod) {
+                return bit;
+            }
+        }
+    }
+    return a_prod == b_prod ? -1 : (int64_t)prod;
+}
+
+// Samples whose second edge lands right on the left edge of the bitcell after
+// the first, then a steady 2 bitcell interval.  That drives the bitcell width
+// of p_div=1,i_div=1 to exactly 0, after which a decode on its own would never
+// finish, so a batch has to stop that lane and carry on with the others.
+#define ZERO_WIDTH_SAMPLES 1000
+
+static int check_zero_width(struct bc_buffer *batch_out, struct bc_buffer *reference_out) {
+    static const char *const batch[ALGORITHM_MAX_BATCH_LANES] = {
+        "bitcell_width_pi_v2[p_mul=1,p_div=1,i_mul=1,i_div=1]",
+        "bitcell_width_pi_v2[p_mul=1,p_div=4,i_mul=1,i_div=16]",
+    };
+    const uint16_t write_bc_ticks = (500*72) / 500;
+
+    uint16_t samples[ZERO_WIDTH_SAMPLES];
+    samples[0] = 1000;
+    samples[1] = samples[0] + write_bc_ticks / 2;
+    for (size_t ii = 2; ii < ZERO_WIDTH_SAMPLES; ++ii) {
+        samples[ii] = samples[ii - 1] + 2 * write_bc_ticks;
+    }
+
+    uint32_t batch_prods[ALGORITHM_MAX_BATCH_LANES];
+    if (decode_batch(batch, write_bc_ticks, samples, ZERO_WIDTH_SAMPLES, batch_out, batch_prods) == 0) {
+        printf("FAIL zero width: not batched\n");
+        return 1;
+    }
+
+    // Just the one bitcell for each edge before the width ran out.
+    int failures = 0;
+    if (batch_prods[0] != 2) {
+        printf("FAIL zero width %s: %u bitcells, not 2\n", batch[0], batch_prods[0]);
+        ++failures;
+    }
+
+    uint32_t reference_prod = decode(batch[1], write_bc_ticks, samples, ZERO_WIDTH_SAMPLES, reference_out);
+    int64_t diff = first_difference(&batch_out[1], batch_prods[1], reference_out, reference_prod);
+    if (diff >= 0) {
+        printf("FAIL zero width %s: %u bitcells, alone: %u, first difference at bitcell %ld\n",
+            batch[1], batch_prods[1], reference_prod, (long)diff);
+        ++failures;
+    }
+
+    if (failures == 0) {
+        printf("ok   zero width\n");
+    }
+    return failures;
+}
+
+int main(void) {
+    struct bc_buffer fast_out, reference_out, batch_out[ALGORITHM_MAX_BATCH_LANES];
+    if (bc_buffer_init(&fast_out) < 0 || bc_buffer_init(&reference_out) < 0) {
+        fprintf(stderr, "ERROR: failed to reserve bitcell buffers\n");
+        return 1;
+    }
+    for (int ii = 0; ii < ALGORITHM_MAX_BATCH_LANES; ++ii) {
+        if (bc_buffer_init(&batch_out[ii]) < 0) {
+            fprintf(stderr, "ERROR: failed to reserve bitcell buffers\n");
+            return 1;
+        }
+    }
+
+    int failures = 0;
+    size_t decodes = 0;
+    for (size_t tt = 0; tt < sizeof(TRACKS) / sizeof(TRACKS[0]); ++tt) {
+        const struct decode_track *track = &TRACKS[tt];
+        uint16_t write_bc_ticks = (500*72) / track->rate_kbps;
+
+        uint16_t *samples;
+        size_t count;
+        if (track->spec == NULL) {
+            if ((samples = interval_ramp(write_bc_ticks, &count)) == NULL) {
+                return 1;
+            }
+        } else if (mfm_synth_spec(track->spec, &samples, &count) < 0) {
+            return 1;
+        }
+        const char *track_name = track->spec != NULL ? "" : " ramp";
+
+        for (size_t pp = 0; pp < sizeof(PAIRS) / sizeof(PAIRS[0]); ++pp) {
+            const struct decode_pair *pair = &PAIRS[pp];
+
+            uint32_t fast_prod = decode(pair->fast, write_bc_ticks, samples, count, &fast_out);
+            uint32_t reference_prod = decode(pair->reference, write_bc_ticks, samples, count, &reference_out);
+            int64_t diff = first_difference(&fast_out, fast_prod, &reference_out, reference_prod);
+
+            if (fast_prod == 0 || reference_prod == 0) {
+                printf("FAIL %ukbps%s %s: no bitcells\n", track->rate_kbps, track_name, pair->fast);
+                ++failures;
+            } else if (diff >= 0) {
+                printf("FAIL %ukbps%s %s: %u bitcells, %s: %u, first difference at bitcell %ld\n",
+                    track->rate_kbps, track_name, pair->fast, fast_prod, pair->reference, reference_prod, (long)diff);
+                ++failures;
+            } else {
+                printf("ok   %ukbps%s %s\n", track->rate_kbps, track_name, pair->fast);
+            }
+            ++decodes;
+        }
+
+        for (size_t bb = 0; bb < sizeof(BATCHES) / sizeof(BATCHES[0]); ++bb) {
+            uint32_t batch_prods[ALGORITHM_MAX_BATCH_LANES];
+            unsigned int lanes = decode_batch(BATCHES[bb], write_bc_ticks, samples, count, batch_out, batch_prods);
+            if (lanes == 0) {
+                printf("FAIL %ukbps%s batch %zu: not batched\n", track->rate_kbps, track_name, bb);
+                ++failures;
+                ++decodes;
+                continue;
+            }
+
+            for (unsigned int lane = 0; lane < lanes; ++lane) {
+                const char *spec = BATCHES[bb][lane];
+                uint32_t reference_prod = decode(spec, write_bc_ticks, samples, count, &reference_out);
+                int64_t diff = first_difference(&batch_out[lane], batch_prods[lane], &reference_out, reference_prod);
+
+                if (batch_prods[lane] == 0 || reference_prod == 0) {
+                    printf("FAIL %ukbps%s batch %zu lane %u %s: no bitcells\n", track->rate_kbps, track_name, bb, lane, spec);
+                    ++failures;
+                } else if (diff >= 0) {
+                    printf("FAIL %ukbps%s batch %zu lane %u %s: %u bitcells, alone: %u, first difference at bitcell %ld\n",
+                        track->rate_kbps, track_name, bb, lane, spec, batch_prods[lane], reference_prod, (long)diff);
+                    ++failures;
+                } else {
+                    printf("ok   %ukbps%s batch %zu lane %u %s\n", track->rate_kbps, track_name, bb, lane, spec);
+                }
+                ++decodes;
+            }
+        }
+
+        free(samples);
+    }
+
+    failures += check_zero_width(batch_out, &reference_out);
+    ++decodes;
+
+    bc_buffer_free(&fast_out);
+    bc_buffer_free(&reference_out);
+    for (int ii = 0; ii < ALGORITHM_MAX_BATCH_LANES; ++ii) {
+        bc_buffer_free(&batch_out[ii]);
+    }
+
+    if (failures > 0) {
+        printf("%d of %zu decodes differ\n", failures, decodes);
+        return 1;
+    }
+    return 0;
+}
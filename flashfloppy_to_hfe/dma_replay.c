@@ -0,0 +1,118 @@
+#include "dma_replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "op_count.h"
+
+// Samples arrive on FlashFloppy's 72MHz clock, the same as the MCU's.
+#define TICKS_PER_US 72
+
+int dma_replay(const struct algorithm *alg, void *state, const uint16_t *samples, size_t count,
+    const struct dma_replay_config *config, struct dma_replay_result *result) {
+    if (!OP_COUNT) {
+        fprintf(stderr, "ERROR: DMA replay needs operation counts, rebuild with make OP_COUNT=1\n");
+        return -1;
+    }
+
+    const size_t ring = config->ring_samples;
+    const size_t half = ring / 2;
+    if (half == 0) {
+        fprintf(stderr, "ERROR: DMA ring must hold at least 2 samples\n");
+        return -1;
+    }
+
+    // When each sample lands in the ring, in ticks since the first.
+    uint64_t *arrival = malloc(count * sizeof(uint64_t));
+    if (arrival == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for %zu sample times\n", count);
+        return -1;
+    }
+    if (count > 0) arrival[0] = 0;
+    for (size_t ii = 1; ii < count; ++ii) {
+        arrival[ii] = arrival[ii - 1] + (uint16_t)(samples[ii] - samples[ii - 1]);
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->min_headroom_ticks = INT64_MAX;
+
+    size_t next = 0;
+    size_t written = 0;
+    uint64_t cpu_free = 0;
+
+    for (size_t irq = half; irq <= count; irq += half) {
+        // The interrupt fires as the half fills, or once the previous one
+        // returns, and decodes whatever the DMA has written by then.
+        uint64_t start = arrival[irq - 1] > cpu_free ? arrival[irq - 1] : cpu_free;
+        if (written < irq) written = irq;
+        while (written < count && arrival[written] <= start) ++written;
+
+        // Past a full ring the reader is laps behind rather than further back.
+        result->interrupts++;
+        size_t backlog = written - next < ring ? written - next : ring;
+        if (backlog > result->max_backlog) result->max_backlog = backlog;
+
+        struct op_counts counts = {{0}};
+        uint64_t cycles = op_count_mcu_cycles(&counts);
+
+        while (next < written && cycles < config->isr_cycles) {
+            // By now later samples may have been written over this one.
+            uint64_t now = start + cycles;
+            size_t slot = next;
+            while (slot + ring < count && arrival[slot + ring] <= now) slot += ring;
+
+            if (slot != next && result->overruns++ == 0) {
+                result->first_overrun = next;
+                result->first_overrun_ticks = arrival[next + ring];
+            }
+
+            op_count_sink = &counts;
+            alg->feed(state, &samples[slot], 1);
+            op_count_sink = NULL;
+            cycles = op_count_mcu_cycles(&counts);
+
+            uint64_t decoded = start + cycles;
+            if (decoded - arrival[next] > result->max_latency_ticks) {
+                result->max_latency_ticks = decoded - arrival[next];
+            }
+            if (next + ring < count && (int64_t)(arrival[next + ring] - decoded) < result->min_headroom_ticks) {
+                result->min_headroom_ticks = (int64_t)(arrival[next + ring] - decoded);
+            }
+            ++next;
+        }
+
+        if (cycles > result->busiest_isr_cycles) result->busiest_isr_cycles = cycles;
+        cpu_free = start + cycles;
+    }
+
+    if (next < count) {
+        alg->feed(state, &samples[next], count - next);
+    }
+
+    free(arrival);
+    return 0;
+}
+
+void dma_replay_print(const struct dma_replay_config *config, const struct dma_replay_result *result, FILE *out) {
+    fprintf(out, "Replayed through a %zu sample DMA ring: %zu interrupts, busiest %lu cycles",
+        config->ring_samples, result->interrupts, (unsigned long)result->busiest_isr_cycles);
+    if (config->isr_cycles != UINT64_MAX) {
+        fprintf(out, " of %lu", (unsigned long)config->isr_cycles);
+    }
+    fprintf(out, "\n");
+
+    fprintf(out, "Worst backlog %zu samples, worst latency %.1fus", result->max_backlog,
+        (double)result->max_latency_ticks / TICKS_PER_US);
+    if (result->min_headroom_ticks != INT64_MAX) {
+        fprintf(out, ", least headroom %.1fus", (double)result->min_headroom_ticks / TICKS_PER_US);
+    }
+    fprintf(out, "\n");
+
+    if (result->overruns == 0) {
+        fprintf(out, "No DMA overruns\n");
+    } else {
+        fprintf(out, "DMA overruns: %zu samples overwritten, first sample %zu at %.1fus\n",
+            result->overruns, result->first_overrun, (double)result->first_overrun_ticks / TICKS_PER_US);
+    }
+}
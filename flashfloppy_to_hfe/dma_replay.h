@@ -0,0 +1,56 @@
+#ifndef DMA_REPLAY_H_
+#define DMA_REPLAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "algorithm.h"
+
+// Replays a capture through a model of FlashFloppy's write DMA ring instead
+// of handing the algorithm the whole capture at once.  Samples land in a ring
+// of ring_samples slots at their own timestamps, and each half-transfer and
+// transfer-complete interrupt decodes what has arrived so far, spending at
+// most isr_cycles of 72MHz MCU time as estimated by op_count.  Samples left
+// over wait for the next interrupt.  If one isn't decoded before the DMA
+// comes round and overwrites its slot, that's an overrun and the algorithm is
+// fed the newer sample, as the firmware would be.
+//
+// MCU cycles come from the OPS() counts, so this needs a build with
+// make OP_COUNT=1.
+
+struct dma_replay_config {
+    size_t ring_samples;
+
+    // Cycles each interrupt may spend decoding, UINT64_MAX for no limit.
+    uint64_t isr_cycles;
+};
+
+struct dma_replay_result {
+    size_t interrupts;
+    uint64_t busiest_isr_cycles;
+
+    // Most samples waiting in the ring when an interrupt started, at most
+    // ring_samples.
+    size_t max_backlog;
+
+    // Longest a sample waited between arriving and being decoded, and the
+    // least time to spare before a sample's slot was overwritten.  In 72MHz
+    // ticks; headroom is negative if there were overruns.
+    uint64_t max_latency_ticks;
+    int64_t min_headroom_ticks;
+
+    size_t overruns;
+    size_t first_overrun;
+    uint64_t first_overrun_ticks;
+};
+
+// Feeds count samples to state, which alg->init() has set up.  The samples
+// that arrive after the last interrupt are fed when WGATE drops, without a
+// budget.  Returns 0 on success or -1 on error.
+int dma_replay(const struct algorithm *alg, void *state, const uint16_t *samples, size_t count,
+    const struct dma_replay_config *config, struct dma_replay_result *result);
+
+void dma_replay_print(const struct dma_replay_config *config, const struct dma_replay_result *result, FILE *out);
+
+#endif
@@ -0,0 +1,265 @@
+#include "ff_samples.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct ff_samples_stream {
+    FILE *fd;
+    pthread_t reader;
+
+    // Double buffer: the reader fills one chunk while the caller decodes the
+    // other.  full[] and lengths[] are protected by lock.
+    uint16_t *chunks[2];
+    size_t lengths[2];
+    int full[2];
+
+    // Chunk handed out by the last call to ff_samples_stream_next(), or -1.
+    int current;
+    int next;
+
+    int done;
+    int error;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static FILE *open_input(const char *path) {
+    if (strcmp(path, "-") == 0) {
+        return stdin;
+    }
+
+    FILE *fd = fopen(path, "rb");
+    if (fd == NULL) {
+        fprintf(stderr, "ERROR: Unable to open ff samples file: %s: %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+static void close_input(FILE *fd) {
+    if (fd != stdin) {
+        fclose(fd);
+    }
+}
+
+static void *reader_main(void *ptr) {
+    struct ff_samples_stream *stream = ptr;
+    int chunk = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->full[chunk] && !stream->done) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        int done = stream->done;
+        pthread_mutex_unlock(&stream->lock);
+
+        // Closed early by the caller.
+        if (done) {
+            break;
+        }
+
+        // fread() blocks until a whole chunk arrives or the input ends, so
+        // pipes deliver full chunks too.  A trailing odd byte is dropped.
+        size_t length = fread(stream->chunks[chunk], sizeof(uint16_t), FF_SAMPLES_CHUNK_COUNT, stream->fd);
+        int error = ferror(stream->fd);
+        if (error) {
+            fprintf(stderr, "ERROR: error reading samples: %s\n", strerror(errno));
+        }
+
+        pthread_mutex_lock(&stream->lock);
+        stream->lengths[chunk] = length;
+        stream->full[chunk] = 1;
+        if (length < FF_SAMPLES_CHUNK_COUNT) {
+            stream->done = 1;
+            stream->error = error;
+        }
+        pthread_cond_broadcast(&stream->cond);
+        done = stream->done;
+        pthread_mutex_unlock(&stream->lock);
+
+        if (done) {
+            break;
+        }
+        chunk ^= 1;
+    }
+
+    return NULL;
+}
+
+struct ff_samples_stream *ff_samples_stream_open(const char *path) {
+    struct ff_samples_stream *stream = calloc(1, sizeof(struct ff_samples_stream));
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    stream->chunks[0] = malloc(FF_SAMPLES_CHUNK_COUNT * sizeof(uint16_t));
+    stream->chunks[1] = malloc(FF_SAMPLES_CHUNK_COUNT * sizeof(uint16_t));
+    if (stream->chunks[0] == NULL || stream->chunks[1] == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate sample buffers\n");
+        goto fail;
+    }
+
+    stream->fd = open_input(path);
+    if (stream->fd == NULL) {
+        goto fail;
+    }
+
+    stream->current = -1;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+
+    int ret = pthread_create(&stream->reader, NULL, reader_main, stream);
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: failed to start sample reader thread: %s\n", strerror(ret));
+        pthread_cond_destroy(&stream->cond);
+        pthread_mutex_destroy(&stream->lock);
+        close_input(stream->fd);
+        goto fail;
+    }
+
+    return stream;
+
+fail:
+    free(stream->chunks[0]);
+    free(stream->chunks[1]);
+    free(stream);
+    return NULL;
+}
+
+ssize_t ff_samples_stream_next(struct ff_samples_stream *stream, const uint16_t **samples) {
+    pthread_mutex_lock(&stream->lock);
+
+    // Hand the previous chunk back to the reader.
+    if (stream->current >= 0) {
+        stream->full[stream->current] = 0;
+        stream->current = -1;
+        pthread_cond_broadcast(&stream->cond);
+    }
+
+    int chunk = stream->next;
+    while (!stream->full[chunk] && !stream->done) {
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+
+    ssize_t length;
+    if (stream->full[chunk] && stream->lengths[chunk] > 0) {
+        length = stream->lengths[chunk];
+        stream->current = chunk;
+        stream->next = chunk ^ 1;
+        *samples = stream->chunks[chunk];
+    } else {
+        length = stream->error ? -1 : 0;
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+    return length;
+}
+
+void ff_samples_stream_close(struct ff_samples_stream *stream) {
+    if (stream == NULL) return;
+
+    // Stop the reader if the caller gave up before the end of the input.
+    pthread_mutex_lock(&stream->lock);
+    stream->done = 1;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    pthread_join(stream->reader, NULL);
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->lock);
+
+    close_input(stream->fd);
+    free(stream->chunks[0]);
+    free(stream->chunks[1]);
+    free(stream);
+}
+
+static uint16_t *read_samples(FILE *fd, size_t *count_out) {
+    uint16_t *samples = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    // Grow as we go rather than trusting the file size so pipes work too.
+    for (;;) {
+        if (count == capacity) {
+            size_t new_capacity = capacity > 0 ? capacity * 2 : FF_SAMPLES_CHUNK_COUNT;
+            uint16_t *grown = realloc(samples, new_capacity * sizeof(uint16_t));
+            if (grown == NULL) {
+                fprintf(stderr, "ERROR: failed to allocate memory for %zu samples\n", new_capacity);
+                goto fail;
+            }
+            samples = grown;
+            capacity = new_capacity;
+        }
+
+        size_t length = fread(&samples[count], sizeof(uint16_t), capacity - count, fd);
+        count += length;
+        if (ferror(fd)) {
+            fprintf(stderr, "ERROR: error reading samples from file: %s\n", strerror(errno));
+            goto fail;
+        }
+        if (feof(fd)) {
+            break;
+        }
+    }
+
+    *count_out = count;
+    return samples;
+
+fail:
+    free(samples);
+    return NULL;
+}
+
+int ff_samples_map(const char *path, struct ff_samples_map *map) {
+    memset(map, 0, sizeof(*map));
+
+    FILE *fd = open_input(path);
+    if (fd == NULL) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fileno(fd), &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= (off_t)sizeof(uint16_t)) {
+        void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(fd), 0);
+        if (addr != MAP_FAILED) {
+            // Decoders walk the samples front to back exactly once per run.
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            madvise(addr, st.st_size, MADV_WILLNEED);
+
+            close_input(fd);
+            map->addr = addr;
+            map->length = st.st_size;
+            map->mapped = 1;
+            map->samples = addr;
+            map->count = st.st_size / sizeof(uint16_t);
+            return 0;
+        }
+        // Fall back to reading, e.g. on filesystems that can't be mapped.
+    }
+
+    uint16_t *samples = read_samples(fd, &map->count);
+    close_input(fd);
+    if (samples == NULL) {
+        return -1;
+    }
+
+    map->addr = samples;
+    map->samples = samples;
+    return 0;
+}
+
+void ff_samples_unmap(struct ff_samples_map *map) {
+    if (map->mapped) {
+        munmap(map->addr, map->length);
+    } else {
+        free(map->addr);
+    }
+    memset(map, 0, sizeof(*map));
+}
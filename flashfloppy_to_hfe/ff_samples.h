@@ -0,0 +1,46 @@
+#ifndef FF_SAMPLES_H_
+#define FF_SAMPLES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Samples are handed out in chunks of this many, a little over one revolution
+// of a 500kbps MFM track.
+#define FF_SAMPLES_CHUNK_COUNT (64 * 1024)
+
+// Reads a .ff_samples capture in fixed size chunks on a background thread so
+// decoding the current chunk overlaps with reading the next one.  Memory use
+// is bounded by two chunks regardless of the capture's length.
+struct ff_samples_stream;
+
+// Opens path for streaming.  A path of "-" reads from stdin, so captures can
+// be piped in.  Returns NULL on error.
+struct ff_samples_stream *ff_samples_stream_open(const char *path);
+
+// Points *samples at the next chunk and returns its length in samples.  The
+// chunk stays valid until the next call.  Returns 0 at the end of the capture
+// or -1 on a read error.
+ssize_t ff_samples_stream_next(struct ff_samples_stream *stream, const uint16_t **samples);
+
+void ff_samples_stream_close(struct ff_samples_stream *stream);
+
+// A whole capture held in memory for modes that run several decodes over the
+// same samples.  Regular files are mapped read-only so every decoder in the
+// process shares the page cache copy; pipes and stdin are read into the heap.
+struct ff_samples_map {
+    const uint16_t *samples;
+    size_t count;
+
+    void *addr;
+    size_t length;
+    int mapped;
+};
+
+// Loads path, which may be "-" for stdin.  Returns 0 on success or -1 on
+// error.
+int ff_samples_map(const char *path, struct ff_samples_map *map);
+
+void ff_samples_unmap(struct ff_samples_map *map);
+
+#endif
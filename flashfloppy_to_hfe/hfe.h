@@ -0,0 +1,43 @@
+#ifndef HFE_H_
+#define HFE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One side of one cylinder, as big-endian bitcell words produced by
+// an algorithm.  A track with bc_prod == 0 is left blank.
+struct hfe_track {
+    const uint32_t *bc_buf;
+    uint32_t bc_prod;
+};
+
+struct hfe_image {
+    unsigned int bit_rate_kbps;
+    unsigned int rpm;
+    unsigned int cylinders;
+    unsigned int sides;
+
+    // cylinders * sides tracks, indexed by [cylinder * sides + side].
+    const struct hfe_track *tracks;
+};
+
+// Growable output buffer so repeated encodes (e.g. in a sweep) can reuse the
+// same allocation.
+struct hfe_buffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+};
+
+// Lays out a complete HFE (v1) image in memory in a single pass: header,
+// track list and the 512-byte blocks that interleave 256 bytes of side 0 with
+// 256 bytes of side 1.  Returns 0 on success or -1 if a track is too long for
+// the format or memory could not be allocated.
+int hfe_encode(const struct hfe_image *image, struct hfe_buffer *out);
+
+// Writes an encoded image to path with a single write.
+int hfe_buffer_write(const struct hfe_buffer *buf, const char *path);
+
+void hfe_buffer_free(struct hfe_buffer *buf);
+
+#endif
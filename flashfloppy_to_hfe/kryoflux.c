@@ -0,0 +1,178 @@
+#include "kryoflux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Stream block headers.  0x00-0x07 start a Flux2 block and 0x0e-0xff are
+// Flux1 blocks holding the interval itself.
+#define KF_FLUX2_MAX 0x07
+#define KF_NOP1 0x08
+#define KF_NOP2 0x09
+#define KF_NOP3 0x0a
+#define KF_OVL16 0x0b
+#define KF_FLUX3 0x0c
+#define KF_OOB 0x0d
+
+#define KF_OOB_STREAM_INFO 0x01
+#define KF_OOB_INDEX 0x02
+#define KF_OOB_STREAM_END 0x03
+#define KF_OOB_KF_INFO 0x04
+#define KF_OOB_EOF 0x0d
+
+// Sample clocks to 72MHz FlashFloppy ticks, derived in kryoflux_to_flashfloppy.
+// Each interval is truncated on its own, as that tool does, so both paths
+// produce identical samples.
+#define KF_TICKS_MUL (125 * 7)
+#define KF_TICKS_DIV (4 * 73)
+
+// kryoflux_to_flashfloppy's arbitrary starting timestamp.
+#define KF_TICK_COUNTER_START 0x4321
+
+int kryoflux_is_stream(const char *path) {
+    size_t len = strlen(path);
+    return len > 4 && strcmp(&path[len - 4], ".raw") == 0;
+}
+
+static int push_sample(struct ff_samples_map *map, size_t *capacity, uint16_t sample) {
+    if (map->count == *capacity) {
+        size_t new_capacity = *capacity > 0 ? *capacity * 2 : FF_SAMPLES_CHUNK_COUNT;
+        uint16_t *grown = realloc(map->addr, new_capacity * sizeof(uint16_t));
+        if (grown == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory for %zu samples\n", new_capacity);
+            return -1;
+        }
+        map->addr = grown;
+        *capacity = new_capacity;
+    }
+
+    ((uint16_t *)map->addr)[map->count++] = sample;
+    return 0;
+}
+
+// Walks the stream up to the end of the wanted revolution, converting just
+// its intervals.
+static int parse_stream(const char *path, const uint8_t *data, size_t length, unsigned int revolution, struct ff_samples_map *map) {
+    size_t capacity = 0;
+    size_t pos = 0;
+    size_t block = 0;
+    unsigned int rev = 0;
+    uint32_t overflow = 0;
+    uint16_t tick_counter = KF_TICK_COUNTER_START;
+
+    while (pos < length && rev <= revolution) {
+        block = pos;
+        uint8_t header = data[pos++];
+        uint32_t interval;
+
+        if (header > KF_OOB) {
+            interval = header;
+        } else if (header <= KF_FLUX2_MAX) {
+            if (length - pos < 1)
+                goto truncated;
+            interval = ((uint32_t)header << 8) | data[pos];
+            pos += 1;
+        } else if (header == KF_FLUX3) {
+            if (length - pos < 2)
+                goto truncated;
+            interval = ((uint32_t)data[pos] << 8) | data[pos + 1];
+            pos += 2;
+        } else if (header == KF_OVL16) {
+            overflow += 0x10000;
+            continue;
+        } else if (header == KF_OOB) {
+            if (length - pos < 3)
+                goto truncated;
+            uint8_t type = data[pos];
+            size_t size = data[pos + 1] | (data[pos + 2] << 8);
+            pos += 3;
+
+            if (type == KF_OOB_STREAM_END || type == KF_OOB_EOF)
+                break;
+            if (type != KF_OOB_STREAM_INFO && type != KF_OOB_INDEX && type != KF_OOB_KF_INFO) {
+                fprintf(stderr, "ERROR: %s: invalid OOB block type %u at offset %zu\n", path, type, block);
+                return -1;
+            }
+            if (length - pos < size)
+                goto truncated;
+            pos += size;
+
+            if (type == KF_OOB_INDEX)
+                ++rev;
+            continue;
+        } else {
+            // Nop1 to Nop3 skip 0 to 2 bytes.
+            size_t skip = header - KF_NOP1;
+            if (length - pos < skip)
+                goto truncated;
+            pos += skip;
+            continue;
+        }
+
+        interval += overflow;
+        overflow = 0;
+
+        if (rev == revolution) {
+            tick_counter += (uint16_t)((uint64_t)interval * KF_TICKS_MUL / KF_TICKS_DIV);
+            if (push_sample(map, &capacity, tick_counter) < 0)
+                return -1;
+        }
+    }
+
+    if (rev < revolution) {
+        fprintf(stderr, "ERROR: %s has no revolution %u, only 0 to %u\n", path, revolution, rev);
+        return -1;
+    }
+    if (map->count == 0) {
+        fprintf(stderr, "ERROR: %s has no flux in revolution %u\n", path, revolution);
+        return -1;
+    }
+    return 0;
+
+truncated:
+    fprintf(stderr, "ERROR: %s: stream truncated in block at offset %zu\n", path, block);
+    return -1;
+}
+
+int kryoflux_load(const char *path, unsigned int revolution, struct ff_samples_map *map) {
+    memset(map, 0, sizeof(*map));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Unable to open KryoFlux stream: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        fprintf(stderr, "ERROR: %s is not a KryoFlux stream file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // The stream is only read once, front to back.
+    const uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: unable to map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    int ret = parse_stream(path, data, st.st_size, revolution, map);
+    munmap((void *)data, st.st_size);
+
+    if (ret < 0) {
+        free(map->addr);
+        memset(map, 0, sizeof(*map));
+        return -1;
+    }
+
+    map->samples = map->addr;
+    return 0;
+}
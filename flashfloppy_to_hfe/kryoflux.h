@@ -0,0 +1,18 @@
+#ifndef KRYOFLUX_H_
+#define KRYOFLUX_H_
+
+#include "ff_samples.h"
+
+// Reads KryoFlux .raw stream files directly, converting one revolution to
+// .ff_samples timestamps exactly as kryoflux_to_flashfloppy does with no
+// write precomp.  Revolutions are numbered as that tool names its outputs:
+// revolution 0 is the flux before the first index pulse.
+
+// Returns non-zero if path names a KryoFlux stream, i.e. ends in ".raw".
+int kryoflux_is_stream(const char *path);
+
+// Loads revolution of the stream in path into map, to be released with
+// ff_samples_unmap().  Returns 0 on success or -1 on error.
+int kryoflux_load(const char *path, unsigned int revolution, struct ff_samples_map *map);
+
+#endif
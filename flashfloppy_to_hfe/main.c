@@ -1,42 +1,193 @@
-#include <endian.h>
+#include <dirent.h>
 #include <errno.h>
+#include <getopt.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define BC_BUF_SIZE_BYTES (2 * 1024 * 1024)
+#include <sys/stat.h>
 
 #include "algorithm.h"
+#include "decode_stats.h"
+#include "dma_replay.h"
+#include "ff_samples.h"
+#include "hfe.h"
+#include "kryoflux.h"
 #include "kv_pair.h"
+#include "mfm_synth.h"
+#include "mfm_verify.h"
+#include "precomp.h"
+#include "result_cache.h"
+#include "sweep.h"
+#include "trace.h"
+#include "tune.h"
+#include "worker_pool.h"
+
+struct run_config
+{
+    const char *out_dir;
+    const char *file_prefix;
+    unsigned long hfe_bit_rate_kbps;
+    uint16_t write_bc_ticks;
+
+    // Single runs stream the capture from ff_sample_path; sweeps map it once
+    // into ff_samples and share it between workers.  Synthesized tracks and
+    // KryoFlux streams are always held in ff_samples.
+    const char *ff_sample_path;
+    const uint16_t *ff_samples;
+    size_t ff_sample_count;
+
+    // Revolution decoded from KryoFlux streams.
+    int revolution;
+
+    // Write precomp in ns applied to the samples as they're loaded, or -1
+    // for none.  Sweeps hold one config per precomp value, each with its
+    // own adjusted copy of the samples.
+    int precomp_ns;
+
+    // Write an HFE image for each run.
+    int write_hfe;
+
+    // Verify the decoded bitcells as IBM MFM and require this many good
+    // sectors.  -1 disables verification.
+    int verify_sectors;
+
+    // Phase error log written by single runs.
+    int write_log;
+    enum data_log_format log_format;
+
+    // Algorithm trace level for single runs, 0 to disable.
+    int trace_level;
+
+    // Decode statistics reported by single runs.
+    enum decode_stats_format stats_format;
+
+    // Replay single runs through a DMA ring rather than feeding the whole
+    // capture at once.  A ring of 0 samples disables replay.
+    struct dma_replay_config replay;
+
+    // Decode consecutive sweep runs of an algorithm that supports it in
+    // lockstep batches.
+    int batch;
+
+    // Stop each sweep run as soon as verification passes or fails rather
+    // than decoding the whole capture.
+    int early;
+
+    // Results of earlier runs, keyed on samples_hash, the hash of
+    // ff_samples.  NULL if not caching.
+    struct result_cache *cache;
+    uint64_t samples_hash;
+};
 
-#include "algorithm_bitcell_width_pi_v1.h"
-#include "algorithm_bitcell_width_pi_v2.h"
-#include "algorithm_fdc9216.h"
-#include "algorithm_flashfloppy_v341.h"
-#include "algorithm_flashfloppy_master.h"
-#include "algorithm_greaseweazle_default_pll.h"
-#include "algorithm_greaseweazle_fallback_pll.h"
-
-static struct algorithm *ALGS[] = {
-    &algorithm_bitcell_width_pi_v1,
-    &algorithm_bitcell_width_pi_v2,
-    &algorithm_fdc9216,
-    &algorithm_flashfloppy_v341,
-    &algorithm_flashfloppy_master,
-    &algorithm_greaseweazle_default_pll,
-    &algorithm_greaseweazle_fallback_pll,
-    NULL
+// Sweep runs decoded together, specs[first] to specs[first + count - 1].
+struct sweep_batch
+{
+    int first;
+    unsigned int count;
+};
+
+// Every batch is run against every config, one job each.
+struct sweep
+{
+    const struct run_config *configs;
+    size_t config_count;
+    char **specs;
+    struct sweep_batch *batches;
+    size_t batch_count;
+    FILE *results;
+    pthread_mutex_t results_lock;
+    int cached;
+};
+
+struct disk_track
+{
+    char *path;
+    unsigned int cylinder;
+    unsigned int head;
+
+    // Decoded bitcells, trimmed to size once the track has been processed.
+    uint32_t *bc_buf;
+    uint32_t bc_prod;
+    int sectors_good;
+};
+
+struct disk
+{
+    const struct run_config *config;
+    const char *algorithm_spec;
+    struct disk_track *tracks;
+    size_t track_count;
+    int failed;
 };
 
 void usage(const char *const progname)
 {
-    fprintf(stderr, "Usage: %s <ff_samples> <out-dir> <hfe-bit-rate-kbps> <algorithm>\n", progname);
+    fprintf(stderr, "Usage: %s [options] <ff_samples> <out-dir> <hfe-bit-rate-kbps> <algorithm>...\n", progname);
+    fprintf(stderr, "       %s --disk [options] <ff_samples-dir | ff_samples...> <out-dir> <hfe-bit-rate-kbps> <algorithm>\n", progname);
+    fprintf(stderr, "       %s --tune --verify <sectors> [options] <ff_samples...> <hfe-bit-rate-kbps> <algorithm>\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "\t-j, --jobs <n>          worker threads for sweeps (default: one per CPU)\n");
+    fprintf(stderr, "\t-o, --results <file>    write sweep results to <file> instead of stdout\n");
+    fprintf(stderr, "\t-v, --verify <sectors>  decode the bitcells as IBM MFM and pass if at least\n");
+    fprintf(stderr, "\t                        <sectors> sectors have good header and data CRCs\n");
+    fprintf(stderr, "\t-n, --no-hfe            don't write HFE images\n");
+    fprintf(stderr, "\t-d, --disk              decode one .ff_samples file per track, named\n");
+    fprintf(stderr, "\t                        <cyl>.<head>.revolution<n>.ff_samples, or KryoFlux\n");
+    fprintf(stderr, "\t                        stream <cyl>.<head>.raw, in parallel into a single\n");
+    fprintf(stderr, "\t                        multi-track HFE\n");
+    fprintf(stderr, "\t-r, --revolution <n>    revolution to use from an input directory or KryoFlux\n");
+    fprintf(stderr, "\t                        stream (default: 1)\n");
+    fprintf(stderr, "\t-P, --precomp <ns>      apply write precomp to the capture before decoding, as\n");
+    fprintf(stderr, "\t                        kryoflux_to_flashfloppy would.  Sweeps take a range,\n");
+    fprintf(stderr, "\t                        e.g. 0..400:+50, and run every algorithm at each value\n");
+    fprintf(stderr, "\t-l, --log <format>      phase error log for single runs: none, binary (.fflog,\n");
+    fprintf(stderr, "\t                        convert with data_log_to_csv) or csv (default: binary)\n");
+    fprintf(stderr, "\t-S, --stats <format>    phase error distribution and PLL event counts for\n");
+    fprintf(stderr, "\t                        single runs: none, text (on stdout) or json\n");
+    fprintf(stderr, "\t                        (.stats.json) (default: none).  Requires building with\n");
+    fprintf(stderr, "\t                        DECODE_STATS=1\n");
+    fprintf(stderr, "\t-R, --replay <samples>  decode single runs a half at a time through a DMA ring\n");
+    fprintf(stderr, "\t                        of <samples>, paced by the capture, and report overruns.\n");
+    fprintf(stderr, "\t                        Requires building with OP_COUNT=1\n");
+    fprintf(stderr, "\t-I, --isr-cycles <n>    with --replay, MCU cycles each interrupt may spend\n");
+    fprintf(stderr, "\t                        decoding (default: no limit)\n");
+    fprintf(stderr, "\t-t, --trace <level>     record algorithm events up to <level> (1: runts and\n");
+    fprintf(stderr, "\t                        clamps, 2: every adjustment) to a .fftrace file for\n");
+    fprintf(stderr, "\t                        trace_dump.  Requires building with TRACE_LEVEL=<level>\n");
+    fprintf(stderr, "\t-B, --no-batch          decode sweep runs one at a time rather than in lockstep\n");
+    fprintf(stderr, "\t                        batches\n");
+    fprintf(stderr, "\t-e, --early             with --verify, stop each sweep or tune decode at the\n");
+    fprintf(stderr, "\t                        first bad CRC or missing sync mark, or once enough good\n");
+    fprintf(stderr, "\t                        sectors are found.  Implies --no-hfe\n");
+    fprintf(stderr, "\t-c, --cache <dir>       look sweep and tune runs up in the result cache in <dir>\n");
+    fprintf(stderr, "\t                        and add new results to it.  Delete it after changing\n");
+    fprintf(stderr, "\t                        an algorithm\n");
+    fprintf(stderr, "\t-T, --tune              search for the parameters passing the most of the given\n");
+    fprintf(stderr, "\t                        captures, coarse to fine, instead of sweeping a grid.\n");
+    fprintf(stderr, "\t                        Parameters left out of <algorithm> are tuned\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Algorithm parameters may be given as ranges to sweep over, e.g.\n");
+    fprintf(stderr, "\tbitcell_width_pi_v2[p_mul=1,p_div=2..65536:x2,i_mul=1,i_div=16..1M:x2]\n");
+    fprintf(stderr, "Ranges are start..end[:xN|:+N] and numbers accept a k/M/G suffix.  When more\n");
+    fprintf(stderr, "than one run is requested, the sample file is loaded once and the runs are\n");
+    fprintf(stderr, "spread across a thread pool.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "<ff_samples> may also be a KryoFlux .raw stream, converted as it's loaded\n");
+    fprintf(stderr, "exactly as kryoflux_to_flashfloppy would with no write precomp.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Instead of a capture, <ff_samples> may be synth[key=value,...] to decode one\n");
+    fprintf(stderr, "synthesized IBM MFM track, e.g. synth[secs=9,rate=250,offset=-20000,precomp=100]:\n");
+    for (const struct parameter *param = mfm_synth_params; param->name != NULL; param++) {
+        fprintf(stderr, "\t%-8s  %s\n", param->name, param->description);
+    }
     fprintf(stderr, "\n");
     fprintf(stderr, "Algorithms:\n");
 
-    for (struct algorithm **alg = ALGS; *alg != NULL; ++alg)
+    for (struct algorithm *const *alg = ALGS; *alg != NULL; ++alg)
     {
         fprintf(stderr, "\t* %s\n", (*alg)->name);
         for (const struct parameter* param = (*alg)->params; param != NULL && param->name != NULL; param++) {
@@ -48,211 +199,1380 @@ void usage(const char *const progname)
     exit(1);
 }
 
-int main(int argc, const char *const argv[])
+static int write_hfe(const char *hfe_path, unsigned long hfe_bit_rate_kbps, const uint32_t *bc_buf, uint32_t bc_prod, struct hfe_buffer *hfe_buf)
 {
-    if (argc < 4)
+    const struct hfe_track track = {
+        .bc_buf = bc_buf,
+        .bc_prod = bc_prod,
+    };
+    const struct hfe_image image = {
+        .bit_rate_kbps = hfe_bit_rate_kbps,
+        .rpm = 0,
+        .cylinders = 1,
+        .sides = 1,
+        .tracks = &track,
+    };
+
+    if (hfe_encode(&image, hfe_buf) < 0)
     {
-        usage(argv[0]);
+        fprintf(stderr, "ERROR: unable to encode HFE image %s\n", hfe_path);
+        return -1;
     }
 
-    const char *const ff_sample_path = argv[1];
-    const char *const out_dir = argv[2];
-    char *endptr = NULL;
-    unsigned long hfe_bit_rate_kbps = strtoul(argv[3], &endptr, 10);
-    char * algorithm = strdup(argv[4]);
+    return hfe_buffer_write(hfe_buf, hfe_path);
+}
 
-    char * file_prefix = basename(strdup(ff_sample_path));
-    char * suffix = strrchr(file_prefix, '.');
-    if (suffix != NULL && strcmp(suffix, ".ff_samples") == 0) {
-        *suffix = '\0';
+// Returns a malloc'd copy of samples with precomp_ns of write precomp
+// applied, or NULL on allocation failure.
+static uint16_t *precomp_copy(const uint16_t *samples, size_t count, uint16_t bc_ticks, int precomp_ns)
+{
+    uint16_t *copy = malloc(count * sizeof(uint16_t));
+    if (copy == NULL)
+    {
+        fprintf(stderr, "ERROR: failed to allocate memory for %zu samples\n", count);
+        return NULL;
+    }
+
+    memcpy(copy, samples, count * sizeof(uint16_t));
+    precomp_apply(copy, count, bc_ticks, precomp_ns);
+    return copy;
+}
+
+static int load_samples_raw(const char *path, int revolution, struct ff_samples_map *map)
+{
+    if (mfm_synth_is_spec(path))
+    {
+        uint16_t *synth_samples;
+        size_t synth_count;
+        if (mfm_synth_spec(path, &synth_samples, &synth_count) < 0)
+        {
+            return -1;
+        }
+
+        memset(map, 0, sizeof(*map));
+        map->samples = synth_samples;
+        map->count = synth_count;
+        map->addr = synth_samples;
+        map->length = synth_count * sizeof(uint16_t);
+        return 0;
+    }
+
+    if (kryoflux_is_stream(path))
+    {
+        return kryoflux_load(path, revolution, map);
+    }
+
+    return ff_samples_map(path, map);
+}
+
+// Loads a synthesized track, KryoFlux stream or .ff_samples capture whole,
+// with config's write precomp applied.
+static int load_samples(const struct run_config *config, const char *path, struct ff_samples_map *map)
+{
+    if (load_samples_raw(path, config->revolution, map) < 0)
+    {
+        return -1;
+    }
+
+    if (config->precomp_ns > 0)
+    {
+        uint16_t *adjusted = precomp_copy(map->samples, map->count, config->write_bc_ticks, config->precomp_ns);
+        size_t count = map->count;
+        ff_samples_unmap(map);
+        if (adjusted == NULL)
+        {
+            return -1;
+        }
+
+        map->samples = adjusted;
+        map->count = count;
+        map->addr = adjusted;
+        map->length = count * sizeof(uint16_t);
     }
 
+    return 0;
+}
+
+static int run_single(const struct run_config *config, const char *algorithm_spec)
+{
+    char *algorithm = strdup(algorithm_spec);
+
     char *hfe_path;
-    asprintf(&hfe_path, "%s/%s.%ld_%s.hfe", out_dir, file_prefix, hfe_bit_rate_kbps, algorithm);
+    asprintf(&hfe_path, "%s/%s.%ld_%s.hfe", config->out_dir, config->file_prefix, config->hfe_bit_rate_kbps, algorithm);
 
     char *data_log_path;
-    asprintf(&data_log_path, "%s/%s.%ld_%s.csv", out_dir, file_prefix, hfe_bit_rate_kbps, algorithm);
+    asprintf(&data_log_path, "%s/%s.%ld_%s.%s", config->out_dir, config->file_prefix, config->hfe_bit_rate_kbps, algorithm,
+        config->log_format == DATA_LOG_CSV ? "csv" : "fflog");
 
-    if (*endptr != '\0') {
-        fprintf(stderr, "ERROR: hfe-bit-rate-kbps must be a positive integer\n");
+    char *trace_path;
+    asprintf(&trace_path, "%s/%s.%ld_%s.fftrace", config->out_dir, config->file_prefix, config->hfe_bit_rate_kbps, algorithm);
+
+    char *stats_path;
+    asprintf(&stats_path, "%s/%s.%ld_%s.stats.json", config->out_dir, config->file_prefix, config->hfe_bit_rate_kbps, algorithm);
+
+    /* Process the flux timings into the raw bitcell buffer. */
+
+    printf("Starting to process flux to bitcells\n");
+
+    struct bc_buffer bc_out;
+    uint32_t bc_prod;
+
+    struct kv_pair *algorithm_params = NULL;
+    struct algorithm *alg = algorithm_lookup(algorithm, &algorithm_params);
+    if (alg == NULL)
+    {
+        fprintf(stderr, "Unknown algorithm: %s\n", algorithm);
         return 1;
     }
 
-    // Open sample input file
-    FILE *ff_sample_fd = fopen(ff_sample_path, "rb");
-    if (ff_sample_fd == NULL)
+    if (config->trace_level > 0 && trace_open(trace_path, config->trace_level) < 0)
     {
-        fprintf(stderr, "ERROR: Unable to open ff samples file: %s\n", ff_sample_path);
+        fprintf(stderr, "ERROR: unable to open trace \"%s\"\n", trace_path);
         return 1;
     }
 
-    // Figure out how big the sample file is.
-    if (fseek(ff_sample_fd, 0, SEEK_END) < 0)
+    struct data_logger *logger = NULL;
+    if (config->write_log) {
+        logger = data_logger_open(data_log_path, config->log_format);
+        if (logger == NULL) {
+            fprintf(stderr, "Failed to open data log \"%s\"", data_log_path);
+            return 1;
+        }
+    }
+
+    struct ff_samples_stream *stream = NULL;
+    if (config->ff_samples == NULL && (stream = ff_samples_stream_open(config->ff_sample_path)) == NULL)
     {
-        fprintf(stderr, "ERROR: failed to seek to end of ff sample file: %s\n", strerror(errno));
         return 1;
     }
-    long ff_sample_size = ftell(ff_sample_fd);
-    if (ff_sample_size < 0)
+
+    // A streamed capture's length isn't known, so start with room for a chunk
+    // and let the buffer grow.
+    if (bc_buffer_init(&bc_out) < 0)
     {
-        fprintf(stderr, "ERROR: unable to read current ff sample file position: %s\n", strerror(errno));
         return 1;
     }
-    rewind(ff_sample_fd);
+    bc_buffer_prepare(&bc_out, stream == NULL ? config->ff_sample_count : FF_SAMPLES_CHUNK_COUNT);
+
+    // Collected from the logger and trace hooks for the whole decode.
+    struct decode_stats stats;
+    if (config->stats_format != DECODE_STATS_NONE)
+    {
+        decode_stats_begin(&stats);
+    }
 
-    // Allocate memory for samples
-    size_t ff_sample_count = ff_sample_size / sizeof(uint16_t);
-    uint16_t *ff_samples = calloc(ff_sample_count, sizeof(uint16_t));
-    if (ff_samples == NULL)
+    void *state = calloc(1, alg->state_size);
+    if (state == NULL || alg->init(state, config->write_bc_ticks, &bc_out, algorithm_params, logger) < 0)
     {
-        fprintf(stderr, "ERROR: failed to allocate memory for %lu samples\n", ff_sample_count);
         return 1;
     }
 
-    // Read samples into buffer
+    // Decode each chunk as it arrives while the next one is read.
+    printf("Running %s with write_bc_ticks=%hu\n", alg->name, config->write_bc_ticks);
+    // The samples are hashed as they go by so the result can be cached.
+    const uint16_t *ff_samples;
+    ssize_t ff_sample_count = 0;
+    size_t ff_sample_total = config->ff_sample_count;
+    uint64_t samples_hash = RESULT_CACHE_HASH_INIT;
+    struct dma_replay_result replay;
+    if (config->replay.ring_samples > 0)
     {
-        int res = fread(ff_samples, sizeof(uint16_t), ff_sample_count, ff_sample_fd);
-        if (res < 0)
+        if (dma_replay(alg, state, config->ff_samples, config->ff_sample_count, &config->replay, &replay) < 0)
         {
-            fprintf(stderr, "ERROR: error reading samples from file: %s\n", strerror(errno));
             return 1;
         }
-        else if (res != ff_sample_count)
+    }
+    else if (stream == NULL)
+    {
+        alg->feed(state, config->ff_samples, config->ff_sample_count);
+        if (config->cache != NULL)
+            samples_hash = result_cache_hash_samples(samples_hash, config->ff_samples, config->ff_sample_count);
+    }
+    else
+    {
+        ff_sample_total = 0;
+        while ((ff_sample_count = ff_samples_stream_next(stream, &ff_samples)) > 0)
         {
-            fprintf(stderr, "ERROR: only read %d samples of %lu expected\n", res, ff_sample_count);
-            return 1;
+            alg->feed(state, ff_samples, ff_sample_count);
+            if (config->cache != NULL)
+                samples_hash = result_cache_hash_samples(samples_hash, ff_samples, ff_sample_count);
+            ff_sample_total += ff_sample_count;
         }
-        fclose(ff_sample_fd);
+        ff_samples_stream_close(stream);
     }
+    bc_prod = alg->finish(state);
 
-    /* Process the flux timings into the raw bitcell buffer. */
-
-    printf("Starting to process flux to bitcells\n");
+    free(state);
+    data_logger_close(logger);
+    logger = NULL;
+    trace_close();
+    decode_stats_end();
 
-    uint32_t *bc_buf = malloc(BC_BUF_SIZE_BYTES);
-    uint32_t bc_bufmask = (BC_BUF_SIZE_BYTES / 4) - 1;
-    uint16_t write_bc_ticks = (500*72) / hfe_bit_rate_kbps;
-    uint32_t bc_prod;
+    if (ff_sample_count < 0)
+    {
+        return 1;
+    }
 
-    struct kv_pair *algorithm_params = NULL;
+    printf("Decoded %u bitcells\n", bc_prod);
 
-    char *param_start = strchr(algorithm, '[');
-    char *param_end = strrchr(algorithm, ']');
-    if (param_start != NULL && param_end != NULL) {
-        *param_start = '\0';
-        *param_end = '\0';
+    if (config->replay.ring_samples > 0)
+    {
+        dma_replay_print(&config->replay, &replay, stdout);
+    }
 
-        param_start++;
+    if (config->stats_format == DECODE_STATS_TEXT)
+    {
+        decode_stats_print(&stats, stdout);
+    }
+    else if (config->stats_format == DECODE_STATS_JSON)
+    {
+        FILE *stats_file = fopen(stats_path, "w");
+        if (stats_file == NULL)
+        {
+            fprintf(stderr, "ERROR: unable to write \"%s\": %s\n", stats_path, strerror(errno));
+            return 1;
+        }
+        decode_stats_write_json(&stats, stats_file);
+        fclose(stats_file);
+    }
 
-        algorithm_params = kv_pair_list_from_string(param_start);
+    if (bc_out.failed)
+    {
+        return 1;
     }
 
-    struct algorithm **alg = NULL;
-    for (alg = ALGS; *alg != NULL; ++alg) {
-        if (strcmp(algorithm, (*alg)->name) == 0)
-            break;
+    const uint32_t *bc_buf = bc_out.words;
+
+    // Nothing decoded leaves no track to write.
+    if (config->write_hfe && bc_prod > 0)
+    {
+        struct hfe_buffer hfe_buf = {0};
+        int ret = write_hfe(hfe_path, config->hfe_bit_rate_kbps, bc_buf, bc_prod, &hfe_buf);
+        hfe_buffer_free(&hfe_buf);
+        if (ret < 0)
+        {
+            return 1;
+        }
     }
 
-    if (*alg == NULL)
+    struct mfm_verify_result verify = {.first_failure_offset = -1};
+    if (config->verify_sectors >= 0 && mfm_verify(bc_buf, bc_prod, &verify) < 0)
     {
-        fprintf(stderr, "Unknown algorithm: %s\n", algorithm);
+        fprintf(stderr, "ERROR: failed to allocate memory for sector verification\n");
         return 1;
     }
 
-    struct data_logger *logger = data_logger_open(data_log_path);
-    if (logger == NULL) {
-        fprintf(stderr, "Failed to open data log \"%s\"", data_log_path);
+    // Single runs always decode, for the images and logs they write, but
+    // leave their result for later sweeps.
+    int pass = verify.sectors_good >= config->verify_sectors;
+    int overrun = config->replay.ring_samples > 0 && replay.overruns > 0;
+    if (config->cache != NULL && config->replay.ring_samples == 0)
+    {
+        const struct result_cache_key key = {
+            .samples_hash = samples_hash,
+            .write_bc_ticks = config->write_bc_ticks,
+            .verify_sectors = config->verify_sectors,
+            .spec = algorithm_spec,
+        };
+        const struct result_cache_entry result = {
+            .bc_prod = bc_prod,
+            .sector_count = verify.sector_count,
+            .sectors_good = verify.sectors_good,
+            .pass = pass,
+            .first_failure_offset = verify.first_failure_offset,
+            .samples = ff_sample_total,
+        };
+        result_cache_store(config->cache, &key, &result);
+    }
+
+    if (config->verify_sectors < 0)
+    {
+        return overrun ? 2 : 0;
+    }
+
+    if (bc_prod == 0 && config->verify_sectors > 0)
+    {
+        fprintf(stderr, "ERROR: no bitcells decoded to find %d sectors in\n", config->verify_sectors);
+        mfm_verify_result_free(&verify);
         return 1;
     }
 
-    printf("Running %s with write_bc_ticks=%hu\n", (*alg)->name, write_bc_ticks);
-    bc_prod = (*alg)->func((uint16_t)write_bc_ticks, ff_samples, ff_sample_count, bc_buf, bc_bufmask, algorithm_params, logger);
+    for (int ii = 0; ii < verify.sector_count; ++ii)
+    {
+        const struct mfm_sector *sector = &verify.sectors[ii];
+        printf("Sector C=%hhu H=%hhu R=%hhu N=%hhu at bitcell %u: header %s, data %s\n",
+            sector->c, sector->h, sector->r, sector->n, sector->idam_offset,
+            sector->header_ok ? "ok" : "BAD CRC",
+            !sector->has_data ? "missing" : sector->data_ok ? "ok" : "BAD CRC");
+    }
 
-    data_logger_close(logger);
-    logger = NULL;
+    printf("Found %d good sectors of %d: %s\n", verify.sectors_good, config->verify_sectors, pass ? "pass" : "fail");
+    if (verify.first_failure_offset >= 0)
+    {
+        printf("First failure at bitcell %ld\n", (long)verify.first_failure_offset);
+    }
 
-    printf("Decoded %u bitcells\n", bc_prod);
+    mfm_verify_result_free(&verify);
+    return pass && !overrun ? 0 : 2;
+}
 
-    if (bc_prod == 0) {
-        return 0;
+// Samples decoded between checks when stopping early, about one sector at
+// 500kbps.
+#define SWEEP_EARLY_CHUNK_COUNT 4096
+
+// Each worker decodes and encodes into its own buffers, reused across runs.
+// Batches decode into one bc_out per lane.
+struct sweep_worker
+{
+    struct bc_buffer bc_out[ALGORITHM_MAX_BATCH_LANES];
+    struct hfe_buffer hfe_buf;
+};
+
+static void *sweep_worker_init(void *arg)
+{
+    struct sweep_worker *worker = calloc(1, sizeof(struct sweep_worker));
+    if (worker == NULL)
+    {
+        return NULL;
     }
 
-    if (bc_prod / 4 >= BC_BUF_SIZE_BYTES)
+    for (int ii = 0; ii < ALGORITHM_MAX_BATCH_LANES; ++ii)
     {
-        fprintf(stderr, "ERROR: decoded more bitcells than buffer space\n");
-        return 1;
+        if (bc_buffer_init(&worker->bc_out[ii]) < 0)
+        {
+            while (--ii >= 0)
+            {
+                bc_buffer_free(&worker->bc_out[ii]);
+            }
+            free(worker);
+            return NULL;
+        }
     }
 
-    /* Round up to next byte and word in case last byte is partial */
-    size_t bc_bytes = (bc_prod + 7) / 8;
-    size_t bc_words = bc_bytes / 4;
+    return worker;
+}
+
+static void sweep_worker_fini(void *ptr, void *arg)
+{
+    struct sweep_worker *worker = ptr;
 
-    /* Write HFE */
-    FILE *hfe_fd = fopen(hfe_path, "w");
-    if (hfe_fd == NULL)
+    hfe_buffer_free(&worker->hfe_buf);
+    for (int ii = 0; ii < ALGORITHM_MAX_BATCH_LANES; ++ii)
     {
-        fprintf(stderr, "ERROR: unable to open output HFE file: %s\n", strerror(errno));
-        return 1;
+        bc_buffer_free(&worker->bc_out[ii]);
+    }
+    free(worker);
+}
+
+static void sweep_print(struct sweep *sweep, const struct run_config *config, const char *spec, const struct result_cache_entry *result)
+{
+    pthread_mutex_lock(&sweep->results_lock);
+    if (config->precomp_ns >= 0)
+    {
+        fprintf(sweep->results, "%d,", config->precomp_ns);
+    }
+    fprintf(sweep->results, "\"%s\",%u", spec, result->bc_prod);
+    if (config->verify_sectors >= 0)
+    {
+        fprintf(sweep->results, ",%d,%d,%d,%ld",
+            result->sector_count, result->sectors_good, result->pass,
+            (long)result->first_failure_offset);
     }
+    if (config->early)
+    {
+        fprintf(sweep->results, ",%zu", result->samples);
+    }
+    fprintf(sweep->results, "\n");
+    fflush(sweep->results);
+    pthread_mutex_unlock(&sweep->results_lock);
+}
 
-    const uint8_t header[] = {
-        'H',
-        'X',
-        'C',
-        'P',
-        'I',
-        'C',
-        'F',
-        'E',
-        /* Revision */ 0x0,
-        /* Number of tracks */ 0x1,
-        /* Number of sides */ 0x1,
-        /* Track encoding */ 0xFF /* Unknown */,
-        /* Bitrate (kbps) */ hfe_bit_rate_kbps & 0xFF,
-        (hfe_bit_rate_kbps >> 8) & 0xFF,
-        /* RPM */ 0x00,
-        0x00,
-        /* Interface mode */ 0x07 /* GENERIC_SHUGGART_DD_FLOPPYMODE */,
-        /* Reserved */ 0,
-        /* Track list offset */ 0x01,
-        0x00,
+static struct result_cache_key sweep_cache_key(const struct run_config *config, const char *spec)
+{
+    return (struct result_cache_key){
+        .samples_hash = config->samples_hash,
+        .write_bc_ticks = config->write_bc_ticks,
+        .verify_sectors = config->verify_sectors,
+        .early = config->early,
+        .spec = spec,
     };
-    fwrite(header, sizeof(header), 1, hfe_fd);
-
-    // Track list
-    size_t track_data_length_bytes = bc_bytes * 2;
-    const uint8_t track_list[] = {
-        /* Track data offset */ 0x02,
-        0x00,
-        /* Track data length */ (track_data_length_bytes & 0xFF),
-        (track_data_length_bytes >> 8) & 0xFF,
+}
+
+// Writes, verifies, reports and caches one decoded sweep run.  Runs stopped
+// early pass in the stream that already verified them and the samples
+// decoded.
+static void sweep_report(struct sweep_worker *worker, struct sweep *sweep, const struct run_config *config, const char *spec,
+    const struct bc_buffer *bc_out, uint32_t bc_prod, const struct mfm_verify_stream *early, size_t samples_fed)
+{
+    const uint32_t *bc_buf = bc_out->words;
+    int cacheable = !bc_out->failed;
+
+    if (bc_out->failed)
+    {
+        fprintf(stderr, "ERROR: %s decoded more bitcells than could be stored\n", spec);
+        bc_prod = 0;
+    }
+
+    if (bc_prod != 0 && config->write_hfe)
+    {
+        char *hfe_path;
+        asprintf(&hfe_path, "%s/%s.%ld_%s.hfe", config->out_dir, config->file_prefix, config->hfe_bit_rate_kbps, spec);
+        write_hfe(hfe_path, config->hfe_bit_rate_kbps, bc_buf, bc_prod, &worker->hfe_buf);
+        free(hfe_path);
+    }
+
+    struct mfm_verify_result verify = {.first_failure_offset = -1};
+    int pass = 0;
+    if (early != NULL)
+    {
+        verify = early->result;
+        pass = bc_prod != 0 && early->status == MFM_VERIFY_PASSED;
+    }
+    else if (bc_prod != 0 && config->verify_sectors >= 0 && mfm_verify(bc_buf, bc_prod, &verify) < 0)
+    {
+        fprintf(stderr, "ERROR: %s: failed to allocate memory for sector verification\n", spec);
+        cacheable = 0;
+    }
+    else
+    {
+        pass = verify.sectors_good >= config->verify_sectors;
+    }
+
+    const struct result_cache_entry result = {
+        .bc_prod = bc_prod,
+        .sector_count = verify.sector_count,
+        .sectors_good = verify.sectors_good,
+        .pass = pass,
+        .first_failure_offset = verify.first_failure_offset,
+        .samples = early != NULL ? samples_fed : config->ff_sample_count,
     };
-    fseek(hfe_fd, 0x200, SEEK_SET);
-    fwrite(track_list, sizeof(track_list), 1, hfe_fd);
+    sweep_print(sweep, config, spec, &result);
+
+    if (config->cache != NULL && cacheable)
+    {
+        const struct result_cache_key key = sweep_cache_key(config, spec);
+        result_cache_store(config->cache, &key, &result);
+    }
+
+    if (early == NULL)
+    {
+        mfm_verify_result_free(&verify);
+    }
+}
 
-    // Track data
-    for (int ii = 0; ii < bc_words; ++ii)
+static void sweep_job(void *ptr, size_t job_index, void *arg)
+{
+    struct sweep_worker *worker = ptr;
+    struct sweep *sweep = arg;
+    const struct run_config *config = &sweep->configs[job_index / sweep->batch_count];
+    const struct sweep_batch *batch = &sweep->batches[job_index % sweep->batch_count];
+
+    char *algorithms[ALGORITHM_MAX_BATCH_LANES];
+    struct kv_pair *algorithm_params[ALGORITHM_MAX_BATCH_LANES] = {NULL};
+    uint32_t bc_prods[ALGORITHM_MAX_BATCH_LANES] = {0};
+    size_t samples_fed[ALGORITHM_MAX_BATCH_LANES] = {0};
+    struct mfm_verify_stream streams[ALGORITHM_MAX_BATCH_LANES];
+    struct algorithm *alg = NULL;
+
+    // Runs already in the cache are reported straight away and the rest are
+    // decoded together.  HFE images aren't cached, so runs are only looked
+    // up when none are being written.
+    char *specs[ALGORITHM_MAX_BATCH_LANES];
+    unsigned int lanes = 0;
+    for (unsigned int ii = 0; ii < batch->count; ++ii)
+    {
+        char *spec = sweep->specs[batch->first + ii];
+        const struct result_cache_key key = sweep_cache_key(config, spec);
+        struct result_cache_entry cached;
+
+        if (config->cache != NULL && !config->write_hfe && result_cache_lookup(config->cache, &key, &cached))
+        {
+            sweep_print(sweep, config, spec, &cached);
+            __atomic_add_fetch(&sweep->cached, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        specs[lanes++] = spec;
+    }
+
+    if (lanes == 0)
+    {
+        return;
+    }
+
+    // Batches only ever hold runs of the same algorithm, and sweep_plan()
+    // has already rejected unknown ones.
+    for (unsigned int lane = 0; lane < lanes; ++lane)
+    {
+        algorithms[lane] = strdup(specs[lane]);
+        alg = algorithm_lookup(algorithms[lane], &algorithm_params[lane]);
+    }
+
+    if (config->early)
+    {
+        const struct algorithm_check check = {
+            .chunk = SWEEP_EARLY_CHUNK_COUNT,
+            .check = mfm_verify_check,
+            .arg = streams,
+        };
+        for (unsigned int lane = 0; lane < lanes; ++lane)
+        {
+            mfm_verify_stream_init(&streams[lane], config->verify_sectors);
+        }
+        algorithm_decode_checked(alg, config->write_bc_ticks, config->ff_samples, config->ff_sample_count, worker->bc_out, algorithm_params, lanes, &check, bc_prods, samples_fed);
+    }
+    else if (lanes == 1)
+    {
+        bc_prods[0] = algorithm_decode(alg, config->write_bc_ticks, config->ff_samples, config->ff_sample_count, &worker->bc_out[0], algorithm_params[0], NULL);
+    }
+    else
+    {
+        algorithm_decode_batch(alg, config->write_bc_ticks, config->ff_samples, config->ff_sample_count, worker->bc_out, algorithm_params, lanes, bc_prods);
+    }
+
+    for (unsigned int lane = 0; lane < lanes; ++lane)
+    {
+        const struct mfm_verify_stream *early = config->early ? &streams[lane] : NULL;
+        sweep_report(worker, sweep, config, specs[lane], &worker->bc_out[lane], bc_prods[lane], early, samples_fed[lane]);
+        if (early != NULL)
+        {
+            mfm_verify_result_free(&streams[lane].result);
+        }
+        free(algorithm_params[lane]);
+        free(algorithms[lane]);
+    }
+}
+
+// Splits the runs into batches, grouping consecutive runs that the
+// algorithm accepts as batch lanes.  Others are a batch of one each, so they
+// still spread across the workers.  Returns the number of batches, or 0 if a
+// run names an unknown algorithm.
+static size_t sweep_plan(struct sweep *sweep, int spec_count)
+{
+    size_t batch_count = 0;
+    const struct algorithm *batch_alg = NULL;
+
+    for (int ii = 0; ii < spec_count; ++ii)
     {
-        uint32_t bits_left_to_right = be32toh(bc_buf[ii]);
-        uint8_t bits_out[4];
+        char *algorithm = strdup(sweep->specs[ii]);
+        struct kv_pair *algorithm_params = NULL;
+        const struct algorithm *alg = algorithm_lookup(algorithm, &algorithm_params);
+        int batchable = alg != NULL && sweep->configs[0].batch && algorithm_batchable(alg, algorithm_params);
+        free(algorithm_params);
+        free(algorithm);
 
-        for (int jj = 31; jj >= 0; --jj, bits_left_to_right >>= 1)
+        if (alg == NULL)
         {
-            int bit = bits_left_to_right & 1;
+            fprintf(stderr, "Unknown algorithm: %s\n", sweep->specs[ii]);
+            return 0;
+        }
 
-            int byte_idx = jj / 8;
-            bits_out[byte_idx] = bits_out[byte_idx] << 1 | bit;
+        struct sweep_batch *prev = batch_count > 0 ? &sweep->batches[batch_count - 1] : NULL;
+        if (batchable && prev != NULL && alg == batch_alg && prev->count < alg->batch_lanes)
+        {
+            prev->count++;
+            continue;
         }
 
-        long byte_number = ii * 4;
-        long block_number = byte_number / 256;
-        long offset = 0x400 + (block_number * 512) + (byte_number % 256);
-        //printf("Writing word %d (data: 0x%x, 0x%x 0x%x 0x%x 0x%x) to offset 0x%lx\n", ii, be32toh(bc_buf[ii]), bits_out[0], bits_out[1], bits_out[2], bits_out[3], offset);
-        fseek(hfe_fd, offset, SEEK_SET);
-        fwrite(bits_out, 4, 1, hfe_fd);
+        sweep->batches[batch_count++] = (struct sweep_batch){.first = ii, .count = 1};
+        batch_alg = batchable ? alg : NULL;
+    }
+
+    return batch_count;
+}
+
+static int run_sweep(const struct run_config *configs, size_t config_count, char **specs, int spec_count, unsigned int jobs, FILE *results)
+{
+    const struct run_config *config = &configs[0];
+    struct sweep sweep = {
+        .configs = configs,
+        .config_count = config_count,
+        .specs = specs,
+        .batches = calloc(spec_count, sizeof(struct sweep_batch)),
+        .results = results,
+    };
+    if (sweep.batches == NULL)
+    {
+        return 1;
+    }
+    sweep.batch_count = sweep_plan(&sweep, spec_count);
+    if (sweep.batch_count == 0)
+    {
+        free(sweep.batches);
+        return 1;
+    }
+    pthread_mutex_init(&sweep.results_lock, NULL);
+
+    const struct worker_pool_ops ops = {
+        .worker_init = sweep_worker_init,
+        .job = sweep_job,
+        .worker_fini = sweep_worker_fini,
+    };
+
+    size_t run_count = config_count * spec_count;
+    size_t job_count = config_count * sweep.batch_count;
+    fprintf(stderr, "Sweeping %zu runs in %zu batches across %u threads\n", run_count, job_count, jobs);
+    fprintf(results, "%sAlgorithm,Bitcells%s%s\n",
+        config->precomp_ns >= 0 ? "Precomp," : "",
+        config->verify_sectors >= 0 ? ",Sectors,Good,Pass,First Failure" : "",
+        config->early ? ",Samples" : "");
+
+    int ret = worker_pool_run(jobs, job_count, &ops, &sweep);
+    if (config->cache != NULL)
+    {
+        fprintf(stderr, "%d of %zu runs were cached\n", sweep.cached, run_count);
     }
 
-    fclose(hfe_fd);
+    pthread_mutex_destroy(&sweep.results_lock);
+    free(sweep.batches);
+    return ret < 0 ? 1 : 0;
+}
+
+static int compare_disk_tracks(const void *a, const void *b)
+{
+    const struct disk_track *lhs = a;
+    const struct disk_track *rhs = b;
 
+    if (lhs->cylinder != rhs->cylinder)
+        return lhs->cylinder < rhs->cylinder ? -1 : 1;
+    if (lhs->head != rhs->head)
+        return lhs->head < rhs->head ? -1 : 1;
     return 0;
 }
+
+// Adds the track held in path if its file name identifies one.  Files found by
+// scanning a directory must also be of the requested revolution.
+static int add_disk_track(struct disk *disk, const char *path, int from_dir, int revolution)
+{
+    char *path_copy = strdup(path);
+    const char *name = basename(path_copy);
+
+    unsigned int cylinder, head, file_revolution;
+    int matched = sscanf(name, "%u.%u.revolution%u.ff_samples", &cylinder, &head, &file_revolution);
+
+    int from_dir_match = (matched == 3 && file_revolution == revolution && strstr(name, ".ff_samples") != NULL)
+        || (matched == 2 && kryoflux_is_stream(name));
+    free(path_copy);
+
+    if (matched < 2)
+    {
+        // Only complain about files named explicitly on the command line.
+        if (!from_dir)
+        {
+            fprintf(stderr, "ERROR: can't determine track from file name: %s\n", path);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (from_dir && !from_dir_match)
+    {
+        return 0;
+    }
+
+    if (head > 1)
+    {
+        fprintf(stderr, "ERROR: head %u out of range in %s\n", head, path);
+        return -1;
+    }
+
+    struct disk_track *tracks = realloc(disk->tracks, (disk->track_count + 1) * sizeof(struct disk_track));
+    if (tracks == NULL)
+    {
+        return -1;
+    }
+    disk->tracks = tracks;
+
+    struct disk_track *track = &tracks[disk->track_count++];
+    memset(track, 0, sizeof(*track));
+    track->cylinder = cylinder;
+    track->head = head;
+    track->sectors_good = -1;
+    track->path = strdup(path);
+
+    return 0;
+}
+
+static int find_disk_tracks(struct disk *disk, char *const inputs[], int input_count, int revolution)
+{
+    for (int ii = 0; ii < input_count; ++ii)
+    {
+        struct stat st;
+        if (stat(inputs[ii], &st) < 0)
+        {
+            fprintf(stderr, "ERROR: unable to access %s: %s\n", inputs[ii], strerror(errno));
+            return -1;
+        }
+
+        if (!S_ISDIR(st.st_mode))
+        {
+            if (add_disk_track(disk, inputs[ii], 0, revolution) < 0)
+                return -1;
+            continue;
+        }
+
+        DIR *dir = opendir(inputs[ii]);
+        if (dir == NULL)
+        {
+            fprintf(stderr, "ERROR: unable to open directory %s: %s\n", inputs[ii], strerror(errno));
+            return -1;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            char *path;
+            asprintf(&path, "%s/%s", inputs[ii], entry->d_name);
+            int ret = add_disk_track(disk, path, 1, revolution);
+            free(path);
+
+            if (ret < 0)
+            {
+                closedir(dir);
+                return -1;
+            }
+        }
+        closedir(dir);
+    }
+
+    if (disk->track_count == 0)
+    {
+        fprintf(stderr, "ERROR: no tracks found\n");
+        return -1;
+    }
+
+    qsort(disk->tracks, disk->track_count, sizeof(struct disk_track), compare_disk_tracks);
+
+    for (size_t ii = 1; ii < disk->track_count; ++ii)
+    {
+        if (compare_disk_tracks(&disk->tracks[ii - 1], &disk->tracks[ii]) == 0)
+        {
+            fprintf(stderr, "ERROR: track %u.%u given more than once (%s, %s)\n",
+                disk->tracks[ii].cylinder, disk->tracks[ii].head,
+                disk->tracks[ii - 1].path, disk->tracks[ii].path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void disk_job(void *ptr, size_t job_index, void *arg)
+{
+    struct sweep_worker *worker = ptr;
+    struct disk *disk = arg;
+    struct disk_track *track = &disk->tracks[job_index];
+    const struct run_config *config = disk->config;
+    struct bc_buffer *bc_out = &worker->bc_out[0];
+
+    struct ff_samples_map samples;
+    if (load_samples(config, track->path, &samples) < 0)
+    {
+        __atomic_store_n(&disk->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    char *algorithm = strdup(disk->algorithm_spec);
+    struct kv_pair *algorithm_params = NULL;
+    struct algorithm *alg = algorithm_lookup(algorithm, &algorithm_params);
+
+    uint32_t bc_prod = algorithm_decode(alg, config->write_bc_ticks, samples.samples, samples.count, bc_out, algorithm_params, NULL);
+
+    free(algorithm_params);
+    free(algorithm);
+    ff_samples_unmap(&samples);
+
+    if (bc_out->failed)
+    {
+        fprintf(stderr, "ERROR: track %u.%u decoded more bitcells than could be stored\n", track->cylinder, track->head);
+        __atomic_store_n(&disk->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // Keep just the decoded words so the worker's buffer can be reused.
+    size_t bc_bytes = ((bc_prod + 31) / 32) * 4;
+    track->bc_buf = malloc(bc_bytes > 0 ? bc_bytes : 4);
+    if (track->bc_buf == NULL)
+    {
+        __atomic_store_n(&disk->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    memcpy(track->bc_buf, bc_out->words, bc_bytes);
+    track->bc_prod = bc_prod;
+
+    if (config->verify_sectors >= 0)
+    {
+        struct mfm_verify_result verify;
+        if (mfm_verify(track->bc_buf, track->bc_prod, &verify) == 0)
+        {
+            track->sectors_good = verify.sectors_good;
+            mfm_verify_result_free(&verify);
+        }
+    }
+}
+
+static int run_disk(const struct run_config *config, const char *algorithm_spec, char *const inputs[], int input_count, int revolution, unsigned int jobs)
+{
+    struct disk disk = {
+        .config = config,
+        .algorithm_spec = algorithm_spec,
+    };
+
+    char *algorithm = strdup(algorithm_spec);
+    struct kv_pair *algorithm_params = NULL;
+    if (algorithm_lookup(algorithm, &algorithm_params) == NULL)
+    {
+        fprintf(stderr, "Unknown algorithm: %s\n", algorithm);
+        return 1;
+    }
+    free(algorithm_params);
+    free(algorithm);
+
+    if (find_disk_tracks(&disk, inputs, input_count, revolution) < 0)
+    {
+        return 1;
+    }
+
+    const struct worker_pool_ops ops = {
+        .worker_init = sweep_worker_init,
+        .job = disk_job,
+        .worker_fini = sweep_worker_fini,
+    };
+
+    printf("Decoding %zu tracks with %s across %u threads\n", disk.track_count, algorithm_spec, jobs);
+    if (worker_pool_run(jobs, disk.track_count, &ops, &disk) < 0 || disk.failed)
+    {
+        return 1;
+    }
+
+    unsigned int cylinders = disk.tracks[disk.track_count - 1].cylinder + 1;
+    unsigned int sides = 1;
+    int all_pass = 1;
+    for (size_t ii = 0; ii < disk.track_count; ++ii)
+    {
+        const struct disk_track *track = &disk.tracks[ii];
+        if (track->head > 0)
+            sides = 2;
+
+        printf("Track %02u.%u: %u bitcells", track->cylinder, track->head, track->bc_prod);
+        if (config->verify_sectors >= 0)
+        {
+            int pass = track->sectors_good >= config->verify_sectors;
+            printf(", %d good sectors: %s", track->sectors_good, pass ? "pass" : "fail");
+            all_pass &= pass;
+        }
+        printf("\n");
+    }
+
+    // Lay the tracks out as [cylinder][side], leaving missing ones blank.
+    struct hfe_track *hfe_tracks = calloc(cylinders * sides, sizeof(struct hfe_track));
+    for (size_t ii = 0; ii < disk.track_count; ++ii)
+    {
+        const struct disk_track *track = &disk.tracks[ii];
+        hfe_tracks[track->cylinder * sides + track->head].bc_buf = track->bc_buf;
+        hfe_tracks[track->cylinder * sides + track->head].bc_prod = track->bc_prod;
+    }
+
+    for (unsigned int ii = 0; ii < cylinders * sides; ++ii)
+    {
+        if (hfe_tracks[ii].bc_prod == 0)
+            fprintf(stderr, "WARNING: track %02u.%u is missing or empty\n", ii / sides, ii % sides);
+    }
+
+    int ret = 0;
+    if (config->write_hfe)
+    {
+        const struct hfe_image image = {
+            .bit_rate_kbps = config->hfe_bit_rate_kbps,
+            .rpm = 0,
+            .cylinders = cylinders,
+            .sides = sides,
+            .tracks = hfe_tracks,
+        };
+
+        char *hfe_path;
+        asprintf(&hfe_path, "%s/%s.%ld_%s.hfe", config->out_dir, config->file_prefix, config->hfe_bit_rate_kbps, algorithm_spec);
+
+        struct hfe_buffer hfe_buf = {0};
+        if (hfe_encode(&image, &hfe_buf) < 0 || hfe_buffer_write(&hfe_buf, hfe_path) < 0)
+        {
+            ret = 1;
+        }
+        else
+        {
+            printf("Wrote %u cylinders, %u sides to %s\n", cylinders, sides, hfe_path);
+        }
+
+        hfe_buffer_free(&hfe_buf);
+        free(hfe_path);
+    }
+
+    for (size_t ii = 0; ii < disk.track_count; ++ii)
+    {
+        free(disk.tracks[ii].bc_buf);
+        free(disk.tracks[ii].path);
+    }
+    free(disk.tracks);
+    free(hfe_tracks);
+
+    if (ret == 0 && !all_pass)
+        ret = 2;
+    return ret;
+}
+
+static int run_tune(const struct run_config *config, const char *algorithm_spec, char *const inputs[], int input_count, unsigned int jobs, FILE *results)
+{
+    char *algorithm = strdup(algorithm_spec);
+    struct kv_pair *algorithm_params = NULL;
+    struct algorithm *alg = algorithm_lookup(algorithm, &algorithm_params);
+    if (alg == NULL)
+    {
+        fprintf(stderr, "Unknown algorithm: %s\n", algorithm);
+        return 1;
+    }
+
+    struct ff_samples_map *maps = calloc(input_count, sizeof(struct ff_samples_map));
+    struct tune_trace *traces = calloc(input_count, sizeof(struct tune_trace));
+    int ret = 1;
+
+    for (int ii = 0; ii < input_count; ++ii)
+    {
+        if (load_samples(config, inputs[ii], &maps[ii]) < 0)
+        {
+            goto out;
+        }
+
+        traces[ii].samples = maps[ii].samples;
+        traces[ii].count = maps[ii].count;
+        traces[ii].samples_hash = result_cache_hash_samples(RESULT_CACHE_HASH_INIT, maps[ii].samples, maps[ii].count);
+    }
+
+    const struct tune_config tune_config = {
+        .alg = alg,
+        .fixed = algorithm_params,
+        .write_bc_ticks = config->write_bc_ticks,
+        .traces = traces,
+        .trace_count = input_count,
+        .verify_sectors = config->verify_sectors,
+        .early = config->early,
+        .jobs = jobs,
+        .cache = config->cache,
+        .results = results,
+    };
+
+    fprintf(stderr, "Tuning %s over %d captures across %u threads\n", alg->name, input_count, jobs);
+
+    struct tune_result result;
+    if (tune_run(&tune_config, &result) < 0)
+    {
+        goto out;
+    }
+
+    printf("Best: %s passes %zu of %d captures\n", result.spec, result.traces_passed, input_count);
+    printf("Tried %zu points in %zu decodes\n", result.points, result.decodes);
+    ret = result.traces_passed == (size_t)input_count ? 0 : 2;
+    tune_result_free(&result);
+
+out:
+    for (int ii = 0; ii < input_count; ++ii)
+    {
+        ff_samples_unmap(&maps[ii]);
+    }
+    free(maps);
+    free(traces);
+    free(algorithm_params);
+    free(algorithm);
+    return ret;
+}
+
+int main(int argc, char *const argv[])
+{
+    static const struct option long_options[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"results", required_argument, NULL, 'o'},
+        {"verify", required_argument, NULL, 'v'},
+        {"no-hfe", no_argument, NULL, 'n'},
+        {"disk", no_argument, NULL, 'd'},
+        {"revolution", required_argument, NULL, 'r'},
+        {"precomp", required_argument, NULL, 'P'},
+        {"log", required_argument, NULL, 'l'},
+        {"stats", required_argument, NULL, 'S'},
+        {"replay", required_argument, NULL, 'R'},
+        {"isr-cycles", required_argument, NULL, 'I'},
+        {"trace", required_argument, NULL, 't'},
+        {"no-batch", no_argument, NULL, 'B'},
+        {"early", no_argument, NULL, 'e'},
+        {"cache", required_argument, NULL, 'c'},
+        {"tune", no_argument, NULL, 'T'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    unsigned int jobs = worker_pool_default_threads();
+    const char *results_path = NULL;
+    int write_hfe = 1;
+    int verify_sectors = -1;
+    int disk_mode = 0;
+    int revolution = 1;
+    int write_log = 1;
+    enum data_log_format log_format = DATA_LOG_BINARY;
+    int trace_level = 0;
+    enum decode_stats_format stats_format = DECODE_STATS_NONE;
+    struct dma_replay_config replay = {.ring_samples = 0, .isr_cycles = UINT64_MAX};
+    int batch = 1;
+    int tune_mode = 0;
+    int early = 0;
+    const char *cache_dir = NULL;
+    long *precomps = NULL;
+    int precomp_count = 0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+j:o:v:ndr:P:l:S:R:I:t:Bec:Th", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            jobs = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            results_path = optarg;
+            break;
+        case 'v':
+            verify_sectors = strtol(optarg, NULL, 10);
+            if (verify_sectors < 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'n':
+            write_hfe = 0;
+            break;
+        case 'd':
+            disk_mode = 1;
+            break;
+        case 'r':
+            revolution = strtol(optarg, NULL, 10);
+            if (revolution < 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'P':
+            free(precomps);
+            precomp_count = sweep_expand_values(optarg, &precomps);
+            if (precomp_count < 0 || precomps[0] < 0 || precomps[precomp_count - 1] > 65535)
+            {
+                fprintf(stderr, "ERROR: invalid precomp: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            if (strcmp(optarg, "none") == 0)
+                write_log = 0;
+            else if (strcmp(optarg, "binary") == 0)
+                log_format = DATA_LOG_BINARY;
+            else if (strcmp(optarg, "csv") == 0)
+                log_format = DATA_LOG_CSV;
+            else
+                usage(argv[0]);
+            break;
+        case 'S':
+            if (strcmp(optarg, "none") == 0)
+                stats_format = DECODE_STATS_NONE;
+            else if (strcmp(optarg, "text") == 0)
+                stats_format = DECODE_STATS_TEXT;
+            else if (strcmp(optarg, "json") == 0)
+                stats_format = DECODE_STATS_JSON;
+            else
+                usage(argv[0]);
+            break;
+        case 'R':
+            replay.ring_samples = strtoul(optarg, NULL, 10);
+            if (replay.ring_samples < 2)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'I':
+            replay.isr_cycles = strtoull(optarg, NULL, 10);
+            if (replay.isr_cycles == 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            trace_level = strtol(optarg, NULL, 10);
+            break;
+        case 'B':
+            batch = 0;
+            break;
+        case 'e':
+            early = 1;
+            write_hfe = 0;
+            break;
+        case 'c':
+            cache_dir = optarg;
+            break;
+        case 'T':
+            tune_mode = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind < (tune_mode ? 3 : 4))
+    {
+        usage(argv[0]);
+    }
+
+    if (early && verify_sectors < 0)
+    {
+        fprintf(stderr, "ERROR: --early needs --verify to know when to stop\n");
+        return 1;
+    }
+
+    if (stats_format != DECODE_STATS_NONE && !DECODE_STATS)
+    {
+        fprintf(stderr, "ERROR: --stats needs decode statistics compiled in, rebuild with make DECODE_STATS=1\n");
+        return 1;
+    }
+
+    if ((tune_mode || disk_mode) && precomp_count > 1)
+    {
+        fprintf(stderr, "ERROR: --%s takes a single --precomp value\n", tune_mode ? "tune" : "disk");
+        return 1;
+    }
+    int precomp_ns = precomp_count > 0 ? precomps[0] : -1;
+
+    struct result_cache *cache = NULL;
+    if (cache_dir != NULL && (cache = result_cache_open(cache_dir)) == NULL)
+    {
+        return 1;
+    }
+
+    if (tune_mode)
+    {
+        // Inputs come first, as in disk mode, but nothing is written to an
+        // output directory.
+        char *endptr = NULL;
+        unsigned long hfe_bit_rate_kbps = strtoul(argv[argc - 2], &endptr, 10);
+        if (*endptr != '\0' || hfe_bit_rate_kbps == 0) {
+            fprintf(stderr, "ERROR: hfe-bit-rate-kbps must be a positive integer\n");
+            return 1;
+        }
+
+        if (verify_sectors < 0)
+        {
+            fprintf(stderr, "ERROR: --tune needs --verify to tell which decodes pass\n");
+            return 1;
+        }
+
+        const struct run_config config = {
+            .hfe_bit_rate_kbps = hfe_bit_rate_kbps,
+            .write_bc_ticks = (500*72) / hfe_bit_rate_kbps,
+            .revolution = revolution,
+            .precomp_ns = precomp_ns,
+            .verify_sectors = verify_sectors,
+            .early = early,
+            .cache = cache,
+        };
+
+        FILE *results = NULL;
+        if (results_path != NULL && (results = fopen(results_path, "w")) == NULL)
+        {
+            fprintf(stderr, "ERROR: unable to open results file %s: %s\n", results_path, strerror(errno));
+            return 1;
+        }
+
+        int ret = run_tune(&config, argv[argc - 1], &argv[optind], argc - optind - 2, jobs, results);
+        if (results != NULL)
+        {
+            fclose(results);
+        }
+        result_cache_close(cache);
+        return ret;
+    }
+
+    if (disk_mode)
+    {
+        // Inputs come first and may be any number of files or directories.
+        char *endptr = NULL;
+        unsigned long hfe_bit_rate_kbps = strtoul(argv[argc - 2], &endptr, 10);
+        if (*endptr != '\0' || hfe_bit_rate_kbps == 0) {
+            fprintf(stderr, "ERROR: hfe-bit-rate-kbps must be a positive integer\n");
+            return 1;
+        }
+
+        int input_count = argc - optind - 3;
+        struct stat st;
+        const char *file_prefix = "disk";
+        if (input_count == 1 && stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode))
+            file_prefix = basename(strdup(argv[optind]));
+        if (precomp_ns >= 0)
+        {
+            char *precomp_prefix;
+            asprintf(&precomp_prefix, "%s.precomp%d", file_prefix, precomp_ns);
+            file_prefix = precomp_prefix;
+        }
+
+        const struct run_config config = {
+            .out_dir = argv[argc - 3],
+            .file_prefix = file_prefix,
+            .hfe_bit_rate_kbps = hfe_bit_rate_kbps,
+            .write_bc_ticks = (500*72) / hfe_bit_rate_kbps,
+            .revolution = revolution,
+            .precomp_ns = precomp_ns,
+            .write_hfe = write_hfe,
+            .verify_sectors = verify_sectors,
+        };
+
+        return run_disk(&config, argv[argc - 1], &argv[optind], input_count, revolution, jobs);
+    }
+
+    const char *const ff_sample_path = argv[optind];
+    const char *const out_dir = argv[optind + 1];
+    char *endptr = NULL;
+    unsigned long hfe_bit_rate_kbps = strtoul(argv[optind + 2], &endptr, 10);
+
+    if (*endptr != '\0' || hfe_bit_rate_kbps == 0) {
+        fprintf(stderr, "ERROR: hfe-bit-rate-kbps must be a positive integer\n");
+        return 1;
+    }
+
+    char * file_prefix = strcmp(ff_sample_path, "-") == 0 ? "stdin"
+        : mfm_synth_is_spec(ff_sample_path) ? "synth" : basename(strdup(ff_sample_path));
+    char * suffix = strrchr(file_prefix, '.');
+    if (suffix != NULL && strcmp(suffix, ".ff_samples") == 0) {
+        *suffix = '\0';
+    }
+    else if (kryoflux_is_stream(ff_sample_path)) {
+        // Name outputs as if kryoflux_to_flashfloppy had converted it first.
+        *suffix = '\0';
+        asprintf(&file_prefix, "%s.revolution%d", file_prefix, revolution);
+    }
+
+    // Expand any parameter ranges into the full list of runs.
+    char **specs = NULL;
+    int spec_count = 0;
+    for (int ii = optind + 3; ii < argc; ++ii)
+    {
+        char **expanded = NULL;
+        int expanded_count = sweep_expand(argv[ii], &expanded);
+        if (expanded_count < 0)
+        {
+            fprintf(stderr, "ERROR: invalid algorithm spec: %s\n", argv[ii]);
+            return 1;
+        }
+
+        specs = realloc(specs, (spec_count + expanded_count) * sizeof(char *));
+        memcpy(&specs[spec_count], expanded, expanded_count * sizeof(char *));
+        spec_count += expanded_count;
+        free(expanded);
+    }
+
+    struct run_config config = {
+        .out_dir = out_dir,
+        .file_prefix = file_prefix,
+        .hfe_bit_rate_kbps = hfe_bit_rate_kbps,
+        .write_bc_ticks = (500*72) / hfe_bit_rate_kbps,
+        .ff_sample_path = ff_sample_path,
+        .revolution = revolution,
+        .precomp_ns = -1,
+        .write_hfe = write_hfe,
+        .verify_sectors = verify_sectors,
+        .write_log = write_log,
+        .log_format = log_format,
+        .trace_level = trace_level,
+        .stats_format = stats_format,
+        .replay = replay,
+        .batch = batch,
+        .early = early,
+        .cache = cache,
+    };
+
+    // Sweeps share one copy of the capture between workers.  Single runs
+    // stream it unless it's synthesized, a KryoFlux stream, has to be
+    // adjusted for precomp or is replayed, none of which can be streamed.
+    int single = spec_count == 1 && precomp_count <= 1 && results_path == NULL;
+    struct ff_samples_map samples = {0};
+    if (!single || precomp_count > 0 || mfm_synth_is_spec(ff_sample_path) || kryoflux_is_stream(ff_sample_path)
+        || replay.ring_samples > 0)
+    {
+        if (load_samples(&config, ff_sample_path, &samples) < 0)
+        {
+            return 1;
+        }
+        config.ff_samples = samples.samples;
+        config.ff_sample_count = samples.count;
+    }
+
+    // One config per precomp value, each with the capture adjusted once up
+    // front and then shared by all of that value's runs.
+    size_t config_count = precomp_count > 0 ? precomp_count : 1;
+    struct run_config *configs = calloc(config_count, sizeof(struct run_config));
+    if (configs == NULL)
+    {
+        return 1;
+    }
+
+    for (size_t ii = 0; ii < config_count; ++ii)
+    {
+        configs[ii] = config;
+        if (precomp_count > 0)
+        {
+            configs[ii].precomp_ns = precomps[ii];
+            configs[ii].ff_samples = precomp_copy(samples.samples, samples.count, config.write_bc_ticks, precomps[ii]);
+            if (configs[ii].ff_samples == NULL)
+            {
+                return 1;
+            }
+
+            char *precomp_prefix;
+            asprintf(&precomp_prefix, "%s.precomp%ld", file_prefix, precomps[ii]);
+            configs[ii].file_prefix = precomp_prefix;
+        }
+
+        if (cache != NULL && !single)
+        {
+            configs[ii].samples_hash = result_cache_hash_samples(RESULT_CACHE_HASH_INIT, configs[ii].ff_samples, configs[ii].ff_sample_count);
+        }
+    }
+
+    int ret;
+    if (single)
+    {
+        ret = run_single(&configs[0], specs[0]);
+    }
+    else
+    {
+        FILE *results = stdout;
+        if (results_path != NULL && (results = fopen(results_path, "w")) == NULL)
+        {
+            fprintf(stderr, "ERROR: unable to open results file %s: %s\n", results_path, strerror(errno));
+            return 1;
+        }
+
+        ret = run_sweep(configs, config_count, specs, spec_count, jobs, results);
+
+        if (results != stdout)
+        {
+            fclose(results);
+        }
+    }
+
+    if (precomp_count > 0)
+    {
+        for (size_t ii = 0; ii < config_count; ++ii)
+        {
+            free((uint16_t *)configs[ii].ff_samples);
+            free((char *)configs[ii].file_prefix);
+        }
+    }
+    free(configs);
+    free(precomps);
+    sweep_free(specs, spec_count);
+    ff_samples_unmap(&samples);
+    result_cache_close(cache);
+
+    return ret;
+}
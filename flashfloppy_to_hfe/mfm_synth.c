@@ -0,0 +1,376 @@
+#include "mfm_synth.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mfm_verify.h"
+
+#define FF_TICK_HZ 72000000.0
+
+// Sample counter value at the index pulse.  Arbitrary, but the same as
+// kryoflux_to_flashfloppy so the counter wraps at the same places.
+#define MFM_SYNTH_FIRST_TICK 0x4321
+
+// ibm.mfm defaults, in bytes.
+#define MFM_SYNTH_GAP4A 80
+#define MFM_SYNTH_GAP1 50
+#define MFM_SYNTH_GAP2 22
+#define MFM_SYNTH_SYNC 12
+
+#define MFM_GAP_BYTE 0x4E
+
+// A1 and C2 with a missing clock bit, as raw MFM bitcells.
+#define MFM_SYNC_A1 0x4489
+#define MFM_SYNC_C2 0x5224
+
+#define MFM_MARK_IAM 0xFC
+#define MFM_MARK_IDAM 0xFE
+#define MFM_MARK_DAM 0xFB
+
+const struct parameter mfm_synth_params[] = {
+    {.name = "cyl", .description = "cylinder in the sector IDs (default: 0)"},
+    {.name = "head", .description = "head in the sector IDs (default: 0)"},
+    {.name = "secs", .description = "sectors per track (default: 18)"},
+    {.name = "bps", .description = "bytes per sector, 128 to 16384 (default: 512)"},
+    {.name = "gap3", .description = "gap3 length in bytes (default: 84)"},
+    {.name = "rate", .description = "nominal data rate in kbps (default: 500)"},
+    {.name = "rpm", .description = "revolutions per minute (default: 300)"},
+    {.name = "offset", .description = "write data rate error in ppm, may be negative (default: 0)"},
+    {.name = "precomp", .description = "write precompensation in ns (default: 0)"},
+    {.name = "jitter", .description = "peak uniform jitter per transition in ns (default: 0)"},
+    {.name = "image", .description = "raw sector image to take the track's data from"},
+    {.name = "heads", .description = "sides in image (default: 2)"},
+    {.name = "seed", .description = "seed for random sector data and jitter (default: 1)"},
+    {.name = NULL, .description = NULL}};
+
+// Raw bitcells of the track being built, one per byte.
+struct synth_track {
+    uint8_t *cells;
+    size_t length;
+    size_t pos;
+    int prev_data;
+    int overflow;
+};
+
+// splitmix64, so output depends only on the seed and not on the C library.
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void emit_cell(struct synth_track *track, int cell) {
+    if (track->pos >= track->length) {
+        track->overflow = 1;
+        return;
+    }
+    track->cells[track->pos++] = cell;
+}
+
+static void emit_byte(struct synth_track *track, uint8_t byte) {
+    for (int ii = 7; ii >= 0; --ii) {
+        int data = (byte >> ii) & 1;
+        emit_cell(track, !track->prev_data && !data);
+        emit_cell(track, data);
+        track->prev_data = data;
+    }
+}
+
+static void emit_bytes(struct synth_track *track, uint8_t byte, unsigned int count) {
+    while (count--) {
+        emit_byte(track, byte);
+    }
+}
+
+static void emit_raw(struct synth_track *track, uint16_t raw) {
+    for (int ii = 15; ii >= 0; --ii) {
+        emit_cell(track, (raw >> ii) & 1);
+    }
+    track->prev_data = raw & 1;
+}
+
+// Sync, three A1 marks, mark, data and the CRC over all of them.
+static void emit_record(struct synth_track *track, uint8_t mark, const uint8_t *data, size_t len) {
+    static const uint8_t sync[] = {0xA1, 0xA1, 0xA1};
+
+    uint16_t crc = mfm_crc16(0xFFFF, sync, sizeof(sync));
+    crc = mfm_crc16(crc, &mark, 1);
+    crc = mfm_crc16(crc, data, len);
+
+    emit_bytes(track, 0x00, MFM_SYNTH_SYNC);
+    for (size_t ii = 0; ii < sizeof(sync); ++ii) {
+        emit_raw(track, MFM_SYNC_A1);
+    }
+    emit_byte(track, mark);
+    for (size_t ii = 0; ii < len; ++ii) {
+        emit_byte(track, data[ii]);
+    }
+    emit_byte(track, crc >> 8);
+    emit_byte(track, crc & 0xFF);
+}
+
+static int sector_size_code(unsigned int sector_bytes) {
+    for (int n = 0; n <= 7; ++n) {
+        if ((128U << n) == sector_bytes) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+static int read_image(const struct mfm_synth_format *fmt, uint8_t *data, size_t len) {
+    FILE *fd = fopen(fmt->image, "rb");
+    if (fd == NULL) {
+        fprintf(stderr, "ERROR: unable to open image %s: %s\n", fmt->image, strerror(errno));
+        return -1;
+    }
+
+    long offset = ((long)fmt->cylinder * fmt->heads + fmt->head) * (long)len;
+    int ret = 0;
+    if (fseek(fd, offset, SEEK_SET) < 0 || fread(data, 1, len, fd) != len) {
+        fprintf(stderr, "ERROR: image %s has no data for track %u.%u\n", fmt->image, fmt->cylinder, fmt->head);
+        ret = -1;
+    }
+
+    fclose(fd);
+    return ret;
+}
+
+void mfm_synth_format_default(struct mfm_synth_format *fmt) {
+    memset(fmt, 0, sizeof(*fmt));
+    fmt->sectors = 18;
+    fmt->sector_bytes = 512;
+    fmt->gap3 = 84;
+    fmt->rate_kbps = 500;
+    fmt->rpm = 300;
+    fmt->heads = 2;
+    fmt->seed = 1;
+}
+
+static int parse_unsigned(const struct kv_pair *param, unsigned int *dst) {
+    char *endptr = NULL;
+    long value = strtol(param->value, &endptr, 10);
+    if (*param->value == '\0' || *endptr != '\0' || value < 0 || value > 0xFFFFFFFFL) {
+        fprintf(stderr, "ERROR: synth parameter %s must be a non-negative integer\n", param->key);
+        return -1;
+    }
+    *dst = value;
+    return 0;
+}
+
+int mfm_synth_format_from_params(struct mfm_synth_format *fmt, const struct kv_pair *params) {
+    for (const struct kv_pair *param = params; param != NULL && param->key != NULL; ++param) {
+        int ret = 0;
+        char *endptr = NULL;
+
+        if (strcmp(param->key, "cyl") == 0) {
+            ret = parse_unsigned(param, &fmt->cylinder);
+        } else if (strcmp(param->key, "head") == 0) {
+            ret = parse_unsigned(param, &fmt->head);
+        } else if (strcmp(param->key, "secs") == 0) {
+            ret = parse_unsigned(param, &fmt->sectors);
+        } else if (strcmp(param->key, "bps") == 0) {
+            ret = parse_unsigned(param, &fmt->sector_bytes);
+        } else if (strcmp(param->key, "gap3") == 0) {
+            ret = parse_unsigned(param, &fmt->gap3);
+        } else if (strcmp(param->key, "rate") == 0) {
+            ret = parse_unsigned(param, &fmt->rate_kbps);
+        } else if (strcmp(param->key, "rpm") == 0) {
+            ret = parse_unsigned(param, &fmt->rpm);
+        } else if (strcmp(param->key, "offset") == 0) {
+            long value = strtol(param->value, &endptr, 10);
+            if (*param->value == '\0' || *endptr != '\0' || value <= -1000000 || value > 1000000) {
+                fprintf(stderr, "ERROR: synth parameter offset must be an integer number of ppm\n");
+                ret = -1;
+            }
+            fmt->rate_offset_ppm = value;
+        } else if (strcmp(param->key, "precomp") == 0) {
+            ret = parse_unsigned(param, &fmt->precomp_ns);
+        } else if (strcmp(param->key, "jitter") == 0) {
+            ret = parse_unsigned(param, &fmt->jitter_ns);
+        } else if (strcmp(param->key, "image") == 0) {
+            fmt->image = param->value;
+        } else if (strcmp(param->key, "heads") == 0) {
+            ret = parse_unsigned(param, &fmt->heads);
+        } else if (strcmp(param->key, "seed") == 0) {
+            fmt->seed = strtoull(param->value, &endptr, 0);
+            if (*param->value == '\0' || *endptr != '\0') {
+                fprintf(stderr, "ERROR: synth parameter seed must be an integer\n");
+                ret = -1;
+            }
+        } else {
+            fprintf(stderr, "ERROR: unknown synth parameter %s\n", param->key);
+            ret = -1;
+        }
+
+        if (ret < 0) {
+            return -1;
+        }
+    }
+
+    if (fmt->rate_kbps == 0 || fmt->rpm == 0) {
+        fprintf(stderr, "ERROR: synth rate and rpm must be positive\n");
+        return -1;
+    }
+    if (sector_size_code(fmt->sector_bytes) < 0) {
+        fprintf(stderr, "ERROR: synth bps must be 128 << n for n from 0 to 7\n");
+        return -1;
+    }
+    if (fmt->head >= fmt->heads) {
+        fprintf(stderr, "ERROR: synth head %u out of range for %u heads\n", fmt->head, fmt->heads);
+        return -1;
+    }
+
+    return 0;
+}
+
+int mfm_synth(const struct mfm_synth_format *fmt, uint16_t **samples_out, size_t *count_out) {
+    size_t data_len = (size_t)fmt->sectors * fmt->sector_bytes;
+    uint8_t *data = malloc(data_len > 0 ? data_len : 1);
+    if (data == NULL) {
+        return -1;
+    }
+
+    uint64_t data_rng = fmt->seed;
+    if (fmt->image != NULL) {
+        if (read_image(fmt, data, data_len) < 0) {
+            free(data);
+            return -1;
+        }
+    } else {
+        for (size_t ii = 0; ii < data_len; ++ii) {
+            data[ii] = next_random(&data_rng);
+        }
+    }
+
+    // Lay the track out as raw bitcells, two per data bit.
+    struct synth_track track = {
+        .length = (size_t)fmt->rate_kbps * 2000 * 60 / fmt->rpm,
+    };
+    track.cells = calloc(track.length, 1);
+    if (track.cells == NULL) {
+        free(data);
+        return -1;
+    }
+
+    emit_bytes(&track, MFM_GAP_BYTE, MFM_SYNTH_GAP4A);
+    emit_bytes(&track, 0x00, MFM_SYNTH_SYNC);
+    for (int ii = 0; ii < 3; ++ii) {
+        emit_raw(&track, MFM_SYNC_C2);
+    }
+    emit_byte(&track, MFM_MARK_IAM);
+    emit_bytes(&track, MFM_GAP_BYTE, MFM_SYNTH_GAP1);
+
+    for (unsigned int ii = 0; ii < fmt->sectors; ++ii) {
+        const uint8_t id[] = {fmt->cylinder, fmt->head, ii + 1, sector_size_code(fmt->sector_bytes)};
+        emit_record(&track, MFM_MARK_IDAM, id, sizeof(id));
+        emit_bytes(&track, MFM_GAP_BYTE, MFM_SYNTH_GAP2);
+        emit_record(&track, MFM_MARK_DAM, &data[(size_t)ii * fmt->sector_bytes], fmt->sector_bytes);
+        emit_bytes(&track, MFM_GAP_BYTE, fmt->gap3);
+    }
+
+    free(data);
+
+    if (track.overflow) {
+        fprintf(stderr, "ERROR: %u sectors of %u bytes with gap3 %u don't fit a %ukbps track at %urpm\n",
+            fmt->sectors, fmt->sector_bytes, fmt->gap3, fmt->rate_kbps, fmt->rpm);
+        free(track.cells);
+        return -1;
+    }
+
+    // gap4 up to the index, in whole bytes.
+    while (track.pos + 16 <= track.length) {
+        emit_byte(&track, MFM_GAP_BYTE);
+    }
+
+    // Time each transition.  Precompensation follows kryoflux_to_flashfloppy:
+    // a transition after a 2 bitcell interval and before a longer one is
+    // written early, and one after a longer interval and before a 2 bitcell
+    // one is written late.
+    double cell_ticks = FF_TICK_HZ / (fmt->rate_kbps * 2000.0) / (1.0 + fmt->rate_offset_ppm / 1e6);
+    double precomp_ticks = fmt->precomp_ns * FF_TICK_HZ / 1e9;
+    double jitter_ticks = fmt->jitter_ns * FF_TICK_HZ / 1e9;
+    uint64_t jitter_rng = fmt->seed ^ 0x6A09E667F3BCC909ULL;
+
+    uint16_t *samples = malloc((track.length / 2 + 1) * sizeof(uint16_t));
+    if (samples == NULL) {
+        free(track.cells);
+        return -1;
+    }
+
+    size_t count = 0;
+    size_t prev = 0;
+    int have_prev = 0;
+    for (size_t pos = 0; pos < track.length; ++pos) {
+        if (!track.cells[pos]) {
+            continue;
+        }
+
+        size_t next = pos + 1;
+        while (next < track.length && !track.cells[next]) {
+            ++next;
+        }
+
+        double ticks = (pos + 1) * cell_ticks;
+        if (have_prev && next < track.length) {
+            size_t before = pos - prev;
+            size_t after = next - pos;
+            if (before == 2 && after >= 3) {
+                ticks -= precomp_ticks;
+            } else if (before >= 3 && after == 2) {
+                ticks += precomp_ticks;
+            }
+        }
+        if (jitter_ticks > 0) {
+            double unit = (next_random(&jitter_rng) >> 11) * (1.0 / 9007199254740992.0);
+            ticks += (unit * 2.0 - 1.0) * jitter_ticks;
+        }
+
+        samples[count++] = (uint16_t)(MFM_SYNTH_FIRST_TICK + (int64_t)(ticks + 0.5));
+        prev = pos;
+        have_prev = 1;
+    }
+
+    free(track.cells);
+
+    *samples_out = samples;
+    *count_out = count;
+    return 0;
+}
+
+int mfm_synth_is_spec(const char *spec) {
+    return strncmp(spec, "synth", 5) == 0 && (spec[5] == '\0' || spec[5] == '[');
+}
+
+int mfm_synth_spec(const char *spec, uint16_t **samples_out, size_t *count_out) {
+
+    char *copy = strdup(spec);
+    struct kv_pair *params = NULL;
+
+    char *param_start = strchr(copy, '[');
+    char *param_end = strrchr(copy, ']');
+    if (param_start != NULL) {
+        if (param_end == NULL || param_end[1] != '\0') {
+            fprintf(stderr, "ERROR: invalid synth spec: %s\n", spec);
+            free(copy);
+            return -1;
+        }
+        *param_end = '\0';
+        params = kv_pair_list_from_string(param_start + 1);
+    }
+
+    struct mfm_synth_format fmt;
+    mfm_synth_format_default(&fmt);
+
+    int ret = mfm_synth_format_from_params(&fmt, params);
+    if (ret == 0) {
+        ret = mfm_synth(&fmt, samples_out, count_out);
+    }
+
+    free(params);
+    free(copy);
+    return ret;
+}
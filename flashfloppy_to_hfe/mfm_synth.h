@@ -0,0 +1,65 @@
+#ifndef MFM_SYNTH_H_
+#define MFM_SYNTH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "algorithm.h"
+#include "kv_pair.h"
+
+// Synthesizes the flux a drive would record writing one IBM MFM track, as
+// .ff_samples timestamps, so decoders can be exercised without capturing or
+// converting anything.  The layout matches Greaseweazle's ibm.mfm track
+// type: gap4a, IAM, gap1, then per sector sync, IDAM, gap2, sync, DAM and
+// gap3, with gap4 filling the rest of the revolution.
+struct mfm_synth_format {
+    unsigned int cylinder;
+    unsigned int head;
+    unsigned int sectors;
+    unsigned int sector_bytes;
+    unsigned int gap3;
+    unsigned int rate_kbps;
+    unsigned int rpm;
+
+    // Error in the writing drive's data rate, in parts per million.  The
+    // layout is always that of rate_kbps.
+    int rate_offset_ppm;
+
+    // Write precompensation: transitions between a 2 bitcell and a longer
+    // interval are pushed this far towards the longer one.
+    unsigned int precomp_ns;
+
+    // Peak uniform jitter added to each transition.
+    unsigned int jitter_ns;
+
+    // Sector data is read from image, laid out cylinder, head, sector with
+    // heads sides, or generated from seed if image is NULL.  Jitter also
+    // comes from seed.
+    const char *image;
+    unsigned int heads;
+    uint64_t seed;
+};
+
+// Sets fmt to a 1.44MB PC track: cylinder 0 head 0, 18 x 512 byte sectors,
+// gap3 84, 500kbps, 300rpm, random data from seed 1.
+void mfm_synth_format_default(struct mfm_synth_format *fmt);
+
+// Applies params, as documented by mfm_synth_params, on top of fmt.  Returns
+// 0 on success or -1 if a parameter is invalid.
+int mfm_synth_format_from_params(struct mfm_synth_format *fmt, const struct kv_pair *params);
+
+extern const struct parameter mfm_synth_params[];
+
+// Synthesizes one revolution.  On success *samples_out points to a malloc'd
+// array of *count_out samples and 0 is returned.  Returns -1 if the format
+// doesn't fit the track or the image can't be read.
+int mfm_synth(const struct mfm_synth_format *fmt, uint16_t **samples_out, size_t *count_out);
+
+// Returns non-zero if spec is a synth spec rather than a path.
+int mfm_synth_is_spec(const char *spec);
+
+// Synthesizes the track described by an input spec of the form
+// "synth[key=value,...]".  Returns as mfm_synth().
+int mfm_synth_spec(const char *spec, uint16_t **samples_out, size_t *count_out);
+
+#endif
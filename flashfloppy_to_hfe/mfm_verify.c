@@ -0,0 +1,296 @@
+#include "mfm_verify.h"
+
+#include <endian.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Three A1 bytes with a missing clock bit, as raw MFM bitcells.
+#define MFM_SYNC_PATTERN    0x448944894489ULL
+#define MFM_SYNC_MASK       0xFFFFFFFFFFFFULL
+
+#define MFM_MARK_IDAM       0xFE
+#define MFM_MARK_DAM        0xFB
+#define MFM_MARK_DDAM       0xF8
+
+// CRC16-CCITT of the three A1 sync bytes.
+#define MFM_CRC_AFTER_SYNC  0xCDB4
+
+// How far past an IDAM its DAM may start, in decoded bytes.  IBM layouts
+// place it ~44 bytes after the IDAM (record + gap2 + sync).
+#define MFM_DAM_WINDOW_BYTES 64
+
+// How far into the stream the first IDAM may start, and how far past the end
+// of a data record the next one may, when stopping early.  The first follows
+// gap4a, the IAM and gap1 (~160 bytes); later ones follow gap3, which is at
+// most 255 bytes, and its sync.
+#define MFM_FIRST_IDAM_WINDOW_BYTES 512
+#define MFM_NEXT_IDAM_WINDOW_BYTES 320
+
+static const uint16_t crc16_ccitt_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+uint16_t mfm_crc16(uint16_t crc, const uint8_t *data, size_t len) {
+    while (len--) {
+        crc = (crc << 8) ^ crc16_ccitt_table[(crc >> 8) ^ *data++];
+    }
+    return crc;
+}
+
+// Returns count (<= 32) raw bitcells starting at bitcell pos, first bitcell in
+// the most-significant position.
+static uint32_t get_bits(const uint32_t *bc_buf, uint32_t pos, int count) {
+    uint64_t window = (uint64_t)be32toh(bc_buf[pos / 32]) << 32;
+    if ((pos % 32) + count > 32) {
+        window |= be32toh(bc_buf[pos / 32 + 1]);
+    }
+    return (uint32_t)((window << (pos % 32)) >> (64 - count));
+}
+
+// Extracts the data bits (every second bitcell) from 16 raw MFM bitcells.
+static uint8_t mfm_decode_byte(uint32_t raw) {
+    uint8_t byte = 0;
+    for (int ii = 7; ii >= 0; --ii) {
+        byte = (byte << 1) | ((raw >> (2 * ii)) & 1);
+    }
+    return byte;
+}
+
+// Decodes len bytes starting at bitcell pos.  Returns -1 if the stream ends
+// first.
+static int mfm_decode_bytes(const uint32_t *bc_buf, uint32_t bc_prod, uint32_t pos, uint8_t *dst, size_t len) {
+    if ((uint64_t)pos + (uint64_t)len * 16 > bc_prod) {
+        return -1;
+    }
+
+    for (size_t ii = 0; ii < len; ++ii, pos += 16) {
+        dst[ii] = mfm_decode_byte(get_bits(bc_buf, pos, 16));
+    }
+    return 0;
+}
+
+static struct mfm_sector *push_sector(struct mfm_verify_result *result) {
+    struct mfm_sector *sectors = realloc(result->sectors, (result->sector_count + 1) * sizeof(struct mfm_sector));
+    if (sectors == NULL) {
+        return NULL;
+    }
+
+    result->sectors = sectors;
+    struct mfm_sector *sector = &sectors[result->sector_count++];
+    memset(sector, 0, sizeof(*sector));
+    return sector;
+}
+
+static void record_failure(struct mfm_verify_stream *stream, uint32_t offset) {
+    if (stream->result.first_failure_offset < 0) {
+        stream->result.first_failure_offset = offset;
+    }
+    if (stream->sectors_wanted >= 0) {
+        stream->status = MFM_VERIFY_FAILED;
+    }
+}
+
+// Counts sector if it's good and its ID hasn't been seen good before, e.g.
+// on an earlier revolution.
+static void count_good_sector(struct mfm_verify_stream *stream, const struct mfm_sector *sector) {
+    struct mfm_verify_result *result = &stream->result;
+
+    for (const struct mfm_sector *prev = result->sectors; prev < sector; ++prev) {
+        if (prev->data_ok
+            && prev->c == sector->c && prev->h == sector->h
+            && prev->r == sector->r && prev->n == sector->n) {
+            return;
+        }
+    }
+
+    ++result->sectors_good;
+    if (stream->sectors_wanted >= 0 && result->sectors_good >= stream->sectors_wanted) {
+        stream->status = MFM_VERIFY_PASSED;
+    }
+}
+
+// Expects the next sync mark to start within window_bytes of offset.
+static void expect_sync(struct mfm_verify_stream *stream, uint32_t offset, uint32_t window_bytes) {
+    if (stream->sectors_wanted >= 0) {
+        stream->sync_deadline = offset + window_bytes * 16 + 48;
+    }
+}
+
+void mfm_verify_stream_init(struct mfm_verify_stream *stream, int sectors_wanted) {
+    memset(stream, 0, sizeof(*stream));
+    stream->result.first_failure_offset = -1;
+    stream->sectors_wanted = sectors_wanted;
+    stream->status = sectors_wanted == 0 ? MFM_VERIFY_PASSED : MFM_VERIFY_RUNNING;
+    stream->pending = -1;
+    stream->sync_deadline = UINT32_MAX;
+    expect_sync(stream, 0, MFM_FIRST_IDAM_WINDOW_BYTES);
+}
+
+int mfm_verify_stream_scan(
+    struct mfm_verify_stream *stream,
+    const uint32_t *bc_buf,
+    uint32_t bc_prod,
+    int final
+) {
+    struct mfm_verify_result *result = &stream->result;
+
+    // Data buffer large enough for the biggest record (N=7) plus mark and CRC.
+    uint8_t record[1 + (128 << 7) + 2];
+
+    uint64_t shift_reg = stream->shift_reg;
+    uint32_t pos = stream->pos;
+
+    while (pos < bc_prod && stream->status == MFM_VERIFY_RUNNING) {
+        shift_reg = (shift_reg << 1) | ((be32toh(bc_buf[pos / 32]) >> (31 - (pos % 32))) & 1);
+        ++pos;
+
+        if ((shift_reg & MFM_SYNC_MASK) != MFM_SYNC_PATTERN) {
+            if (pos > stream->sync_deadline) {
+                record_failure(stream, pos);
+            }
+            continue;
+        }
+
+        uint32_t sync_offset = pos - 48;
+        size_t len = 1;
+        struct mfm_sector *sector = NULL;
+
+        if (mfm_decode_bytes(bc_buf, bc_prod, pos, record, 1) < 0) {
+            goto incomplete;
+        }
+
+        if (record[0] == MFM_MARK_IDAM) {
+            len = 7;
+        } else if (record[0] == MFM_MARK_DAM || record[0] == MFM_MARK_DDAM) {
+            // Only data records that follow a good header identify a sector.
+            sector = stream->pending >= 0 ? &result->sectors[stream->pending] : NULL;
+            if (sector == NULL || sync_offset - sector->idam_offset > MFM_DAM_WINDOW_BYTES * 16) {
+                stream->pending = -1;
+                continue;
+            }
+            len = 1 + (128 << (sector->n & 7)) + 2;
+        } else {
+            continue;
+        }
+
+        if (mfm_decode_bytes(bc_buf, bc_prod, pos, record, len) < 0) {
+            goto incomplete;
+        }
+
+        if (sector == NULL) {
+            sector = push_sector(result);
+            if (sector == NULL) {
+                return -1;
+            }
+
+            sector->c = record[1];
+            sector->h = record[2];
+            sector->r = record[3];
+            sector->n = record[4];
+            sector->idam_offset = sync_offset;
+            sector->header_ok = mfm_crc16(MFM_CRC_AFTER_SYNC, record, 7) == 0;
+
+            if (sector->header_ok) {
+                stream->pending = result->sector_count - 1;
+                expect_sync(stream, sync_offset, MFM_DAM_WINDOW_BYTES);
+            } else {
+                stream->pending = -1;
+                record_failure(stream, sync_offset);
+            }
+        } else {
+            stream->pending = -1;
+            sector->has_data = 1;
+            sector->dam_offset = sync_offset;
+            sector->data_ok = mfm_crc16(MFM_CRC_AFTER_SYNC, record, len) == 0;
+            if (sector->data_ok) {
+                count_good_sector(stream, sector);
+            } else {
+                record_failure(stream, sync_offset);
+            }
+            expect_sync(stream, pos + len * 16, MFM_NEXT_IDAM_WINDOW_BYTES);
+        }
+
+        pos += len * 16;
+        shift_reg = 0;
+        continue;
+
+    incomplete:
+        // Rescan the sync mark once the rest of the record has arrived.
+        if (!final) {
+            pos = sync_offset;
+            shift_reg = 0;
+        }
+        break;
+    }
+
+    stream->shift_reg = shift_reg;
+    stream->pos = pos;
+
+    if (final && stream->status == MFM_VERIFY_RUNNING && stream->sectors_wanted >= 0) {
+        stream->status = MFM_VERIFY_FAILED;
+    }
+    return 0;
+}
+
+int mfm_verify_check(void *arg, unsigned int lane, const uint32_t *bc_buf, uint32_t bc_prod, int final) {
+    struct mfm_verify_stream *stream = &((struct mfm_verify_stream *)arg)[lane];
+
+    if (mfm_verify_stream_scan(stream, bc_buf, bc_prod, final) < 0) {
+        return 1;
+    }
+    return stream->status != MFM_VERIFY_RUNNING;
+}
+
+int mfm_verify(
+    const uint32_t *bc_buf,
+    uint32_t bc_prod,
+    struct mfm_verify_result *result
+) {
+    struct mfm_verify_stream stream;
+    mfm_verify_stream_init(&stream, -1);
+
+    int ret = mfm_verify_stream_scan(&stream, bc_buf, bc_prod, 1);
+    *result = stream.result;
+    if (ret < 0) {
+        mfm_verify_result_free(result);
+    }
+    return ret;
+}
+
+void mfm_verify_result_free(struct mfm_verify_result *result) {
+    free(result->sectors);
+    result->sectors = NULL;
+    result->sector_count = 0;
+}
@@ -0,0 +1,92 @@
+#ifndef MFM_VERIFY_H_
+#define MFM_VERIFY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A sector found in an IBM MFM bitcell stream.  Offsets are bitcell positions
+// of the first sync mark of the record within the decoded stream.
+struct mfm_sector {
+    uint8_t c, h, r, n;
+    uint8_t header_ok;
+    uint8_t has_data;
+    uint8_t data_ok;
+    uint32_t idam_offset;
+    uint32_t dam_offset;
+};
+
+struct mfm_verify_result {
+    struct mfm_sector *sectors;
+    int sector_count;
+
+    // Number of distinct sector IDs whose header and data CRCs both passed.
+    int sectors_good;
+
+    // Bitcell offset of the first record that failed its CRC, or of the
+    // point an early check gave up waiting for a sync mark.  -1 if neither
+    // happened.
+    int64_t first_failure_offset;
+};
+
+enum mfm_verify_status {
+    MFM_VERIFY_RUNNING,
+    MFM_VERIFY_PASSED,
+    MFM_VERIFY_FAILED,
+};
+
+// Verifies a bitcell stream as a decoder produces it.  With sectors_wanted
+// set, scanning stops as soon as the outcome is known: it passes once that
+// many good sectors are found, and fails at the first bad header or data
+// CRC, or if a sync mark doesn't turn up where the IBM layout puts the next
+// record.  That assumes one revolution written from the index, so a bad
+// sector that a later revolution would make up for still fails.
+struct mfm_verify_stream {
+    struct mfm_verify_result result;
+
+    // Good sectors needed to pass, or -1 to scan the whole stream without
+    // stopping, as mfm_verify() does.
+    int sectors_wanted;
+    enum mfm_verify_status status;
+
+    uint64_t shift_reg;
+    uint32_t pos;
+    int pending;
+
+    // Scanning past this bitcell without finding a sync mark fails.
+    uint32_t sync_deadline;
+};
+
+void mfm_verify_stream_init(struct mfm_verify_stream *stream, int sectors_wanted);
+
+// Scans the bitcells of bc_buf up to bc_prod that haven't been scanned yet.
+// bc_prod may only grow between calls.  A record running past bc_prod is
+// left for the next call, unless final is set to say the stream ends there.
+// Returns 0 on success, -1 on allocation failure.
+int mfm_verify_stream_scan(
+    struct mfm_verify_stream *stream,
+    const uint32_t *bc_buf,
+    uint32_t bc_prod,
+    int final
+);
+
+// An algorithm_check callback verifying lane with the lane'th stream of the
+// array arg points to.  Returns non-zero once that stream's outcome is known
+// or it ran out of memory, leaving it MFM_VERIFY_RUNNING.
+int mfm_verify_check(void *arg, unsigned int lane, const uint32_t *bc_buf, uint32_t bc_prod, int final);
+
+// Scans bc_prod bitcells of bc_buf (as filled by an algorithm) for
+// A1/0x4489 sync marks, decodes the IDAM and DAM records that follow and
+// checks their CRC16.  Returns 0 on success, -1 on allocation failure.
+int mfm_verify(
+    const uint32_t *bc_buf,
+    uint32_t bc_prod,
+    struct mfm_verify_result *result
+);
+
+void mfm_verify_result_free(struct mfm_verify_result *result);
+
+// CRC16-CCITT (polynomial 0x1021) of len bytes continuing from crc.  IBM
+// records start from 0xFFFF and include their sync and mark bytes.
+uint16_t mfm_crc16(uint16_t crc, const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,37 @@
+#include "op_count.h"
+
+__thread struct op_counts *op_count_sink;
+
+// Cycles per operation on a Cortex-M3, erring high: every branch is taken and
+// refills the pipeline, and divides take UDIV's worst case.  OP_FLUX covers
+// the loop's load, subtract, state spills and a typical bitstream_put_run().
+static const unsigned int OP_CYCLES[OP_KINDS] = {
+    [OP_FLUX] = 12,
+    [OP_LOOP] = 3,
+    [OP_BRANCH] = 3,
+    [OP_MUL] = 2,
+    [OP_DIV] = 12,
+};
+
+// Taking the DMA interrupt and loading and saving the decoder state.
+#define CHUNK_CYCLES 60
+
+const char *op_kind_name(enum op_kind kind) {
+    switch (kind) {
+    case OP_FLUX: return "flux";
+    case OP_LOOP: return "loop";
+    case OP_BRANCH: return "branch";
+    case OP_MUL: return "mul";
+    case OP_DIV: return "div";
+    case OP_KINDS: break;
+    }
+    return "unknown";
+}
+
+uint64_t op_count_mcu_cycles(const struct op_counts *counts) {
+    uint64_t cycles = CHUNK_CYCLES;
+    for (int kind = 0; kind < OP_KINDS; ++kind) {
+        cycles += counts->ops[kind] * OP_CYCLES[kind];
+    }
+    return cycles;
+}
@@ -0,0 +1,64 @@
+#ifndef OP_COUNT_H_
+#define OP_COUNT_H_
+
+#include <stdint.h>
+
+// Operation counts for the real-time budget model in bench_algorithms
+// --budget.  FlashFloppy runs these loops on a 72MHz Cortex-M, where each
+// write DMA chunk has to be decoded before the next one fills, so what
+// matters is how much work the worst chunk takes rather than host speed.
+// Algorithms annotate their feed loop with OPS() as written in C, counting
+// only the path actually taken.
+//
+// Counting is compiled in with make OP_COUNT=1.  At the default of 0 every
+// OPS() compiles to nothing.
+#ifndef OP_COUNT
+#define OP_COUNT 0
+#endif
+
+enum op_kind {
+    // Iterations of the feed loop, one per sample.  Covers the load, the
+    // interval subtraction and bitstream_put_run().
+    OP_FLUX,
+
+    // Iterations of the zero run loop, one per zero bitcell.
+    OP_LOOP,
+
+    // Conditional branches evaluated, including loop tests.
+    OP_BRANCH,
+
+    // Multiplies.  Divides by a constant that isn't a power of two count here
+    // too, as the compiler turns them into a multiply by the reciprocal.
+    OP_MUL,
+
+    // Divides by a value only known at run time, which need UDIV or SDIV.
+    OP_DIV,
+
+    OP_KINDS,
+};
+
+struct op_counts {
+    uint64_t ops[OP_KINDS];
+};
+
+// Counts for the current thread, NULL if not counting.
+extern __thread struct op_counts *op_count_sink;
+
+#if OP_COUNT
+#define OPS(kind, n) \
+    do { \
+        if (op_count_sink != NULL) \
+            op_count_sink->ops[(kind)] += (n); \
+    } while (0)
+#else
+#define OPS(kind, n) do { } while (0)
+#endif
+
+const char *op_kind_name(enum op_kind kind);
+
+// Estimated Cortex-M3 cycles to decode one DMA chunk that took counts.
+// Samples arrive on a 72MHz clock, the same as the MCU's, so a chunk keeps up
+// if this is no more than the ticks its samples span.
+uint64_t op_count_mcu_cycles(const struct op_counts *counts);
+
+#endif
@@ -0,0 +1,34 @@
+#include "precomp.h"
+
+#define FF_TICKS_PER_US 72
+
+// Interval in whole bitcells, rounded to nearest.
+static unsigned int bitcells(uint16_t ticks, uint16_t bc_ticks) {
+    return (ticks + bc_ticks / 2) / bc_ticks;
+}
+
+void precomp_apply(uint16_t *samples, size_t count, uint16_t bc_ticks, unsigned int precomp_ns) {
+    uint16_t precomp_ticks = (precomp_ns * FF_TICKS_PER_US + 500) / 1000;
+    if (count < 3 || precomp_ticks == 0) {
+        return;
+    }
+
+    // samples[ii - 1] may be moved, so its original value is carried in cur
+    // to classify the next interval.
+    uint16_t cur = samples[1];
+    unsigned int before = bitcells(cur - samples[0], bc_ticks);
+
+    for (size_t ii = 2; ii < count; ++ii) {
+        uint16_t next = samples[ii];
+        unsigned int after = bitcells(next - cur, bc_ticks);
+
+        if (before == 2 && after >= 3) {
+            samples[ii - 1] = cur - precomp_ticks;
+        } else if (before >= 3 && after == 2) {
+            samples[ii - 1] = cur + precomp_ticks;
+        }
+
+        cur = next;
+        before = after;
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef PRECOMP_H_
+#define PRECOMP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Write precompensation applied to a capture in memory, so each point of a
+// precomp sweep is a pass over the samples rather than a reconverted file.
+// It follows kryoflux_to_flashfloppy and mfm_synth: a transition between a
+// 2 bitcell interval and a longer one is moved precomp_ns into the 2 bitcell
+// interval.  Intervals are classified from the original timestamps in
+// bitcells of bc_ticks, so the adjustments don't feed back into each other.
+//
+// Adjusts count .ff_samples timestamps in place.
+void precomp_apply(uint16_t *samples, size_t count, uint16_t bc_ticks, unsigned int precomp_ns);
+
+#endif
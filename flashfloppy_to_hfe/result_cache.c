@@ -0,0 +1,219 @@
+#include "result_cache.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define RESULT_CACHE_LOG "results.log"
+#define RESULT_CACHE_BUCKETS 4096
+
+#define FNV_PRIME 0x100000001b3ULL
+
+struct result_cache_node {
+    struct result_cache_node *next;
+    uint64_t hash;
+    struct result_cache_key key;
+    struct result_cache_entry entry;
+};
+
+struct result_cache {
+    FILE *log;
+    struct result_cache_node *buckets[RESULT_CACHE_BUCKETS];
+    pthread_mutex_t lock;
+};
+
+uint64_t result_cache_hash_samples(uint64_t hash, const uint16_t *samples, size_t count) {
+    for (size_t ii = 0; ii < count; ++ii) {
+        hash = (hash ^ samples[ii]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t hash_key(const struct result_cache_key *key) {
+    uint64_t hash = key->samples_hash;
+
+    hash = (hash ^ key->write_bc_ticks) * FNV_PRIME;
+    hash = (hash ^ (uint32_t)key->verify_sectors) * FNV_PRIME;
+    hash = (hash ^ (uint32_t)key->early) * FNV_PRIME;
+    for (const char *p = key->spec; *p != '\0'; ++p) {
+        hash = (hash ^ (uint8_t)*p) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static int key_equal(const struct result_cache_key *lhs, const struct result_cache_key *rhs) {
+    return lhs->samples_hash == rhs->samples_hash
+        && lhs->write_bc_ticks == rhs->write_bc_ticks
+        && lhs->verify_sectors == rhs->verify_sectors
+        && lhs->early == rhs->early
+        && strcmp(lhs->spec, rhs->spec) == 0;
+}
+
+static struct result_cache_node *find_node(struct result_cache *cache, const struct result_cache_key *key, uint64_t hash) {
+    for (struct result_cache_node *node = cache->buckets[hash % RESULT_CACHE_BUCKETS]; node != NULL; node = node->next) {
+        if (node->hash == hash && key_equal(&node->key, key)) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// Adds or replaces key in the table.  Returns 0 on success, -1 on allocation
+// failure.
+static int insert(struct result_cache *cache, const struct result_cache_key *key, const struct result_cache_entry *entry) {
+    uint64_t hash = hash_key(key);
+    struct result_cache_node *node = find_node(cache, key, hash);
+    if (node != NULL) {
+        node->entry = *entry;
+        return 0;
+    }
+
+    node = calloc(1, sizeof(struct result_cache_node));
+    if (node == NULL) {
+        return -1;
+    }
+
+    node->key = *key;
+    node->key.spec = strdup(key->spec);
+    if (node->key.spec == NULL) {
+        free(node);
+        return -1;
+    }
+
+    node->hash = hash;
+    node->entry = *entry;
+    node->next = cache->buckets[hash % RESULT_CACHE_BUCKETS];
+    cache->buckets[hash % RESULT_CACHE_BUCKETS] = node;
+    return 0;
+}
+
+// Loads every complete line of the log.  Returns the number of entries.
+static size_t load_log(struct result_cache *cache, FILE *log) {
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    size_t loaded = 0;
+
+    while ((len = getline(&line, &line_size, log)) > 0) {
+        if (line[len - 1] != '\n') {
+            break;
+        }
+        line[len - 1] = '\0';
+
+        struct result_cache_key key;
+        struct result_cache_entry entry;
+        unsigned int ticks;
+        int spec_start = -1;
+
+        sscanf(line, "%" SCNx64 " %u %d %d %" SCNu32 " %d %d %d %" SCNd64 " %zu %n",
+            &key.samples_hash, &ticks, &key.verify_sectors, &key.early,
+            &entry.bc_prod, &entry.sector_count, &entry.sectors_good, &entry.pass,
+            &entry.first_failure_offset, &entry.samples, &spec_start);
+        if (spec_start < 0 || line[spec_start] == '\0') {
+            continue;
+        }
+
+        key.write_bc_ticks = ticks;
+        key.spec = &line[spec_start];
+        if (insert(cache, &key, &entry) == 0) {
+            ++loaded;
+        }
+    }
+
+    free(line);
+    return loaded;
+}
+
+struct result_cache *result_cache_open(const char *dir) {
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: unable to create cache directory %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+
+    char *path;
+    if (asprintf(&path, "%s/%s", dir, RESULT_CACHE_LOG) < 0) {
+        return NULL;
+    }
+
+    struct result_cache *cache = calloc(1, sizeof(struct result_cache));
+    if (cache == NULL) {
+        free(path);
+        return NULL;
+    }
+
+    cache->log = fopen(path, "a+");
+    if (cache->log == NULL) {
+        fprintf(stderr, "ERROR: unable to open cache %s: %s\n", path, strerror(errno));
+        free(path);
+        free(cache);
+        return NULL;
+    }
+
+    size_t loaded = load_log(cache, cache->log);
+    fprintf(stderr, "Loaded %zu cached results from %s\n", loaded, path);
+    free(path);
+
+    // Start a fresh line in case the last one was torn.
+    fseek(cache->log, 0, SEEK_END);
+    if (ftell(cache->log) > 0) {
+        fseek(cache->log, -1, SEEK_END);
+        if (fgetc(cache->log) != '\n') {
+            fseek(cache->log, 0, SEEK_END);
+            fputc('\n', cache->log);
+        }
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void result_cache_close(struct result_cache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    for (int ii = 0; ii < RESULT_CACHE_BUCKETS; ++ii) {
+        struct result_cache_node *node = cache->buckets[ii];
+        while (node != NULL) {
+            struct result_cache_node *next = node->next;
+            free((char *)node->key.spec);
+            free(node);
+            node = next;
+        }
+    }
+
+    fclose(cache->log);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+int result_cache_lookup(struct result_cache *cache, const struct result_cache_key *key, struct result_cache_entry *entry) {
+    uint64_t hash = hash_key(key);
+
+    pthread_mutex_lock(&cache->lock);
+    const struct result_cache_node *node = find_node(cache, key, hash);
+    if (node != NULL) {
+        *entry = node->entry;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return node != NULL;
+}
+
+void result_cache_store(struct result_cache *cache, const struct result_cache_key *key, const struct result_cache_entry *entry) {
+    pthread_mutex_lock(&cache->lock);
+
+    if (insert(cache, key, entry) == 0) {
+        fprintf(cache->log, "%016" PRIx64 " %u %d %d %" PRIu32 " %d %d %d %" PRId64 " %zu %s\n",
+            key->samples_hash, key->write_bc_ticks, key->verify_sectors, key->early,
+            entry->bc_prod, entry->sector_count, entry->sectors_good, entry->pass,
+            entry->first_failure_offset, entry->samples, key->spec);
+        fflush(cache->log);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
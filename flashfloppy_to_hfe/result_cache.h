@@ -0,0 +1,55 @@
+#ifndef RESULT_CACHE_H_
+#define RESULT_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Persistent cache of decode outcomes, so a rerun sweep only decodes the
+// points it hasn't seen.  A point is identified by a hash of its samples
+// together with everything else that decides its result: the algorithm spec,
+// write_bc_ticks and how it was verified.  Results are appended to
+// <dir>/results.log as they're computed, one line each, so an interrupted
+// sweep keeps everything it finished and a torn last line is skipped when the
+// log is loaded again.
+//
+// Algorithm code isn't part of the key.  Delete the cache after changing an
+// algorithm.  All functions may be called from any thread.
+struct result_cache;
+
+struct result_cache_key {
+    uint64_t samples_hash;
+    uint16_t write_bc_ticks;
+    int verify_sectors;
+    int early;
+    const char *spec;
+};
+
+struct result_cache_entry {
+    uint32_t bc_prod;
+    int sector_count;
+    int sectors_good;
+    int pass;
+    int64_t first_failure_offset;
+
+    // Samples decoded, less than the capture if the decode stopped early.
+    size_t samples;
+};
+
+#define RESULT_CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+// Continues hash, starting from RESULT_CACHE_HASH_INIT, over count samples.
+// Hashing a capture in chunks gives the same result as hashing it whole.
+uint64_t result_cache_hash_samples(uint64_t hash, const uint16_t *samples, size_t count);
+
+// Opens the cache in dir, creating it if needed.  Returns NULL on error.
+struct result_cache *result_cache_open(const char *dir);
+
+void result_cache_close(struct result_cache *cache);
+
+// Returns 1 and fills entry if key is cached, otherwise 0.
+int result_cache_lookup(struct result_cache *cache, const struct result_cache_key *key, struct result_cache_entry *entry);
+
+// Adds key's result to the cache and its log.
+void result_cache_store(struct result_cache *cache, const struct result_cache_key *key, const struct result_cache_entry *entry);
+
+#endif
@@ -0,0 +1,296 @@
+#include "sweep.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SWEEP_MAX_VALUES_PER_PARAM 65536
+
+struct sweep_param {
+    char *key;
+    char **values;
+    int value_count;
+};
+
+static int parse_number(const char *str, const char **endptr, long *dst) {
+    char *end = NULL;
+    long value = strtol(str, &end, 10);
+    if (end == str) {
+        return -1;
+    }
+
+    switch (*end) {
+    case 'k': value *= 1024L; ++end; break;
+    case 'M': value *= 1024L * 1024L; ++end; break;
+    case 'G': value *= 1024L * 1024L * 1024L; ++end; break;
+    default: break;
+    }
+
+    *dst = value;
+    *endptr = end;
+    return 0;
+}
+
+static int push_value(struct sweep_param *param, char *value) {
+    if (value == NULL) {
+        return -1;
+    }
+
+    char **values = realloc(param->values, (param->value_count + 1) * sizeof(char *));
+    if (values == NULL) {
+        free(value);
+        return -1;
+    }
+
+    param->values = values;
+    param->values[param->value_count++] = value;
+    return 0;
+}
+
+// Fills param->values from a "start..end[:step]" range.
+static int expand_range(struct sweep_param *param, const char *range) {
+    const char *p = range;
+    long start, end, step = 1;
+    int geometric = 0;
+
+    if (parse_number(p, &p, &start) < 0 || strncmp(p, "..", 2) != 0) {
+        return -1;
+    }
+    p += 2;
+
+    if (parse_number(p, &p, &end) < 0) {
+        return -1;
+    }
+
+    if (*p == ':') {
+        ++p;
+        if (*p == 'x') {
+            geometric = 1;
+            ++p;
+        } else if (*p == '+') {
+            ++p;
+        }
+
+        if (parse_number(p, &p, &step) < 0) {
+            return -1;
+        }
+    }
+
+    if (*p != '\0') {
+        return -1;
+    }
+
+    if ((geometric && (step < 2 || start <= 0)) || (!geometric && step < 1) || end < start) {
+        return -1;
+    }
+
+    for (long value = start; value <= end;) {
+        if (param->value_count >= SWEEP_MAX_VALUES_PER_PARAM) {
+            return -1;
+        }
+
+        char *str = NULL;
+        if (asprintf(&str, "%ld", value) < 0) {
+            return -1;
+        }
+        if (push_value(param, str) < 0) {
+            return -1;
+        }
+
+        if (geometric) {
+            if (value > end / step) break;
+            value *= step;
+        } else {
+            if (value > end - step) break;
+            value += step;
+        }
+    }
+
+    return 0;
+}
+
+static void free_params(struct sweep_param *params, int param_count) {
+    for (int ii = 0; ii < param_count; ++ii) {
+        free(params[ii].key);
+        sweep_free(params[ii].values, params[ii].value_count);
+    }
+    free(params);
+}
+
+int sweep_expand(const char *spec, char ***specs_out) {
+    if (spec == NULL || specs_out == NULL) {
+        return -1;
+    }
+
+    const char *param_start = strchr(spec, '[');
+    const char *param_end = strrchr(spec, ']');
+
+    if (param_start == NULL || param_end == NULL || param_end < param_start) {
+        // No parameter list so the spec is already concrete.
+        char **specs = malloc(sizeof(char *));
+        if (specs == NULL) {
+            return -1;
+        }
+        specs[0] = strdup(spec);
+        *specs_out = specs;
+        return 1;
+    }
+
+    char *name = strndup(spec, param_start - spec);
+    char *param_list = strndup(param_start + 1, param_end - param_start - 1);
+
+    struct sweep_param *params = NULL;
+    int param_count = 0;
+    long spec_count = 1;
+    char **specs = NULL;
+    int ret = -1;
+
+    char *saveptr = NULL;
+    for (char *kv = strtok_r(param_list, ",", &saveptr);
+         kv != NULL;
+         kv = strtok_r(NULL, ",", &saveptr)) {
+        struct sweep_param *grown = realloc(params, (param_count + 1) * sizeof(struct sweep_param));
+        if (grown == NULL) {
+            goto out;
+        }
+        params = grown;
+
+        struct sweep_param *param = &params[param_count++];
+        memset(param, 0, sizeof(*param));
+
+        char *eq = strchr(kv, '=');
+        if (eq == NULL) {
+            // Bare key without a value is passed through unchanged.
+            param->key = strdup(kv);
+            continue;
+        }
+
+        *eq = '\0';
+        param->key = strdup(kv);
+
+        const char *value = eq + 1;
+        if (strstr(value, "..") != NULL) {
+            if (expand_range(param, value) < 0) {
+                fprintf(stderr, "ERROR: malformed range \"%s\" for parameter %s\n", value, param->key);
+                goto out;
+            }
+        } else if (push_value(param, strdup(value)) < 0) {
+            goto out;
+        }
+
+        spec_count *= param->value_count;
+        if (spec_count > INT32_MAX) {
+            fprintf(stderr, "ERROR: algorithm spec expands to too many runs\n");
+            goto out;
+        }
+    }
+
+    specs = calloc(spec_count, sizeof(char *));
+    if (specs == NULL) {
+        goto out;
+    }
+
+    for (long ii = 0; ii < spec_count; ++ii) {
+        size_t len = strlen(name) + 3;
+        long index = ii;
+
+        // Decode ii as a mixed-radix number with the last parameter varying
+        // fastest.
+        int *choice = calloc(param_count + 1, sizeof(int));
+        if (choice == NULL) {
+            goto out;
+        }
+        for (int jj = param_count - 1; jj >= 0; --jj) {
+            if (params[jj].value_count == 0) continue;
+            choice[jj] = index % params[jj].value_count;
+            index /= params[jj].value_count;
+        }
+
+        for (int jj = 0; jj < param_count; ++jj) {
+            len += strlen(params[jj].key) + 2;
+            if (params[jj].value_count > 0) {
+                len += strlen(params[jj].values[choice[jj]]);
+            }
+        }
+
+        char *out = malloc(len);
+        if (out == NULL) {
+            free(choice);
+            goto out;
+        }
+
+        char *p = out + sprintf(out, "%s[", name);
+        for (int jj = 0; jj < param_count; ++jj) {
+            if (jj > 0) *p++ = ',';
+            if (params[jj].value_count > 0) {
+                p += sprintf(p, "%s=%s", params[jj].key, params[jj].values[choice[jj]]);
+            } else {
+                p += sprintf(p, "%s", params[jj].key);
+            }
+        }
+        sprintf(p, "]");
+
+        free(choice);
+        specs[ii] = out;
+    }
+
+    *specs_out = specs;
+    specs = NULL;
+    ret = (int)spec_count;
+
+out:
+    if (specs != NULL) {
+        sweep_free(specs, (int)spec_count);
+    }
+    free_params(params, param_count);
+    free(param_list);
+    free(name);
+    return ret;
+}
+
+void sweep_free(char **specs, int count) {
+    if (specs == NULL) return;
+
+    for (int ii = 0; ii < count; ++ii) {
+        free(specs[ii]);
+    }
+    free(specs);
+}
+
+int sweep_expand_values(const char *str, long **values_out) {
+    struct sweep_param param = {0};
+    long *values = NULL;
+    int ret = -1;
+
+    if (strstr(str, "..") != NULL) {
+        if (expand_range(&param, str) < 0) {
+            goto out;
+        }
+    } else {
+        const char *end;
+        long value;
+        if (parse_number(str, &end, &value) < 0 || *end != '\0' || push_value(&param, strdup(str)) < 0) {
+            goto out;
+        }
+    }
+
+    values = malloc(param.value_count * sizeof(long));
+    if (values == NULL) {
+        goto out;
+    }
+
+    // Values are kept as strings for spec expansion, with suffixes already
+    // applied to range values.
+    for (int ii = 0; ii < param.value_count; ++ii) {
+        const char *end;
+        parse_number(param.values[ii], &end, &values[ii]);
+    }
+
+    *values_out = values;
+    ret = param.value_count;
+
+out:
+    sweep_free(param.values, param.value_count);
+    return ret;
+}
@@ -0,0 +1,30 @@
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+#include <stddef.h>
+
+// Expands an algorithm spec whose parameter values may be ranges into the
+// list of concrete specs it describes.  A range has the form
+//
+//     start..end[:step]
+//
+// where step is either "xN" (multiply by N each step) or "+N"/"N" (add N each
+// step, default +1).  Numbers accept a binary k/M/G suffix, so
+//
+//     bitcell_width_pi_v2[p_mul=1,p_div=2..65536:x2,i_mul=1,i_div=16..1M:x2]
+//
+// expands to 16 * 17 concrete specs.  Parameters are iterated in the order
+// given with the last one varying fastest.
+//
+// On success, *specs_out points to a malloc'd array of malloc'd strings and
+// the number of specs is returned.  Returns -1 on a malformed spec.
+int sweep_expand(const char *spec, char ***specs_out);
+
+void sweep_free(char **specs, int count);
+
+// Expands a single number or a range, as accepted for a parameter value
+// above, into a malloc'd array at *values_out.  Returns the number of values
+// or -1 if str is malformed.
+int sweep_expand_values(const char *str, long **values_out);
+
+#endif
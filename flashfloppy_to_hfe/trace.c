@@ -0,0 +1,59 @@
+#include "trace.h"
+
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+
+__thread struct trace_sink *trace_sink;
+
+int trace_open(const char *path, int level) {
+    struct trace_sink *sink = malloc(sizeof(struct trace_sink));
+    if (sink == NULL) return -1;
+
+    sink->fd = fopen(path, "wb");
+    if (sink->fd == NULL) {
+        free(sink);
+        return -1;
+    }
+
+    if (TRACE_LEVEL < level) {
+        fprintf(stderr, "WARNING: tracing level %d requested but only level %d is compiled in\n", level, TRACE_LEVEL);
+    }
+
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), sink->fd);
+    sink->level = level;
+    trace_sink = sink;
+    return 0;
+}
+
+void trace_close(void) {
+    if (trace_sink == NULL) return;
+
+    fclose(trace_sink->fd);
+    free(trace_sink);
+    trace_sink = NULL;
+}
+
+void trace_emit(uint64_t timestamp, enum trace_event event, unsigned int fraction_bits, int32_t a, int32_t b, int32_t c) {
+    struct trace_record record = {
+        .timestamp = htole64(timestamp),
+        .event = htole16(event),
+        .fraction_bits = htole16(fraction_bits),
+        .a = (int32_t)htole32((uint32_t)a),
+        .b = (int32_t)htole32((uint32_t)b),
+        .c = (int32_t)htole32((uint32_t)c),
+    };
+    fwrite(&record, sizeof(record), 1, trace_sink->fd);
+}
+
+const char *trace_event_name(enum trace_event event) {
+    switch (event) {
+    case TRACE_RUNT: return "runt";
+    case TRACE_ZERO_RUN: return "zero_run";
+    case TRACE_PHASE_ADJUST: return "phase_adjust";
+    case TRACE_CLAMP: return "clamp";
+    case TRACE_FIRST_EDGE: return "first_edge";
+    case TRACE_PERIOD_ADJUST: return "period_adjust";
+    }
+    return "unknown";
+}
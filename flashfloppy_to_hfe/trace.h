@@ -0,0 +1,103 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "decode_stats.h"
+
+// Structured tracing of algorithm internals.  Algorithms describe what their
+// PLL is doing with TRACE() and the events are written as fixed size binary
+// records to the calling thread's trace sink.  Dump a trace with trace_dump.
+//
+// TRACE_LEVEL sets the most detailed level compiled in (make TRACE_LEVEL=2).
+// At the default of 0 every TRACE() compiles to just its decode_stats hook.
+// The sink's level chooses at run time how much of what was compiled in is
+// recorded.
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 0
+#endif
+
+// Rare events: runts and clamping.
+#define TRACE_LEVEL_EVENTS 1
+
+// Per-flux detail: zero runs and every phase or frequency adjustment.
+#define TRACE_LEVEL_DETAIL 2
+
+enum trace_event {
+    // a = distance from the previous edge or bitcell.
+    TRACE_RUNT = 1,
+
+    // a = number of zero bitcells before this edge, b = remaining offset of
+    // the edge into its bitcell.
+    TRACE_ZERO_RUN = 2,
+
+    // a = phase error, b = adjustment applied, c = resulting bitcell period.
+    TRACE_PHASE_ADJUST = 3,
+
+    // a = bitcell period after clamping, b = +1 at the maximum or -1 at the
+    // minimum.
+    TRACE_CLAMP = 4,
+
+    // First edge after WGATE, which the PLL locks to.  a = bitcell period.
+    TRACE_FIRST_EDGE = 5,
+
+    // a = change in bitcell period, b = resulting bitcell period.
+    TRACE_PERIOD_ADJUST = 6,
+};
+
+// Trace file layout, all fields little-endian: the 8 byte TRACE_MAGIC then
+// one record per event.  timestamp counts 72MHz sample clock ticks since
+// WGATE.  Offsets and periods in a, b and c are in ticks / 2**fraction_bits;
+// counts and signs are never scaled.
+#define TRACE_MAGIC "FFTRACE1"
+
+struct trace_record {
+    uint64_t timestamp;
+    uint16_t event;
+    uint16_t fraction_bits;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+};
+
+struct trace_sink {
+    FILE *fd;
+    int level;
+};
+
+// Sink for the current thread, NULL if tracing is disabled.
+extern __thread struct trace_sink *trace_sink;
+
+// Opens path as the current thread's sink, recording events up to level.
+// Returns 0 on success or -1 on error.
+int trace_open(const char *path, int level);
+void trace_close(void);
+
+void trace_emit(uint64_t timestamp, enum trace_event event, unsigned int fraction_bits, int32_t a, int32_t b, int32_t c);
+
+const char *trace_event_name(enum trace_event event);
+
+#if TRACE_LEVEL > 0
+#define TRACE(lvl, event, timestamp, fraction_bits, a, b, c) \
+    do { \
+        if (DECODE_STATS) \
+            decode_stats_event((event), (a), (b)); \
+        if ((lvl) <= TRACE_LEVEL && trace_sink != NULL && (lvl) <= trace_sink->level) \
+            trace_emit((timestamp), (event), (fraction_bits), (a), (b), (c)); \
+    } while (0)
+#else
+// Keep the arguments referenced so values computed only for tracing don't
+// trip unused variable warnings, but never evaluate them.  Unless decode
+// statistics are compiled in, this is nothing at all.
+#define TRACE(lvl, event, timestamp, fraction_bits, a, b, c) \
+    do { \
+        if (DECODE_STATS) \
+            decode_stats_event((event), (a), (b)); \
+        if (0) { \
+            (void)(timestamp); (void)(a); (void)(b); (void)(c); \
+        } \
+    } while (0)
+#endif
+
+#endif
@@ -0,0 +1,50 @@
+#include "trace.h"
+
+#include <endian.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <string.h>
+
+// Prints a binary trace written with --trace as one event per line.
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <fftrace>\n", basename(argv[0]));
+        return 1;
+    }
+
+    FILE *fd = fopen(argv[1], "rb");
+    if (fd == NULL) {
+        fprintf(stderr, "ERROR: unable to open %s\n", argv[1]);
+        return 1;
+    }
+
+    char magic[8];
+    if (fread(magic, sizeof(magic), 1, fd) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is not a trace\n", argv[1]);
+        fclose(fd);
+        return 1;
+    }
+
+    printf("Timestamp,Event,A,B,C\n");
+
+    struct trace_record record;
+    while (fread(&record, sizeof(record), 1, fd) == 1) {
+        enum trace_event event = le16toh(record.event);
+        double scale = (double)(1U << le16toh(record.fraction_bits));
+        double a = (int32_t)le32toh((uint32_t)record.a);
+        double b = (int32_t)le32toh((uint32_t)record.b);
+        double c = (int32_t)le32toh((uint32_t)record.c);
+
+        // Zero run lengths and clamp directions are counts, not ticks.
+        if (event != TRACE_ZERO_RUN) a /= scale;
+        if (event != TRACE_CLAMP) b /= scale;
+        c /= scale;
+
+        printf("%f,%s,%g,%g,%g\n",
+            (double)le64toh(record.timestamp) / 72000000.0,
+            trace_event_name(event), a, b, c);
+    }
+
+    fclose(fd);
+    return 0;
+}
@@ -0,0 +1,628 @@
+#include "tune.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bc_buffer.h"
+#include "mfm_verify.h"
+#include "result_cache.h"
+#include "worker_pool.h"
+
+// Most parameters searched at once.  Each refinement step looks at 3**n - 1
+// neighbours of a point, so this also bounds the cost of a step.
+#define TUNE_MAX_PARAMS 4
+
+// Positions are in steps of 1/TUNE_STEPS_PER_OCTAVE of an octave.
+#define TUNE_STEPS_PER_OCTAVE 16
+#define TUNE_COARSE_STEP (2 * TUNE_STEPS_PER_OCTAVE)
+
+// Points refined around at each step.
+#define TUNE_REFINE_POINTS 4
+
+// Samples decoded between checks when stopping early.
+#define TUNE_EARLY_CHUNK_COUNT 4096
+
+// 2**(k/16) in 16.16 fixed point.
+static const uint32_t octave_fraction[TUNE_STEPS_PER_OCTAVE] = {
+    65536, 68438, 71468, 74632, 77936, 81386, 84990, 88752,
+    92682, 96785, 101070, 105545, 110218, 115098, 120194, 125515,
+};
+
+struct tune_param {
+    const char *name;
+    int32_t lo;
+    int32_t hi;
+};
+
+struct tune_point {
+    int32_t pos[TUNE_MAX_PARAMS];
+    int32_t values[TUNE_MAX_PARAMS];
+    char *spec;
+    struct kv_pair *params;
+    char value_strs[TUNE_MAX_PARAMS][12];
+
+    size_t passed;
+    size_t decoded;
+
+    // Whether the algorithm can decode the point as a batch lane.
+    int batchable;
+};
+
+struct tune {
+    const struct tune_config *config;
+    struct tune_param params[TUNE_MAX_PARAMS];
+    int param_count;
+    size_t fixed_count;
+
+    struct tune_point **points;
+    size_t point_count;
+
+    // Traces passed by the best point decoded against every trace.
+    size_t best_passed;
+    size_t decodes;
+
+    // Points being decoded against traces[trace] this round.  The first
+    // round_batched go in jobs of up to lanes points, the rest a job each.
+    struct tune_point **round;
+    size_t round_count;
+    size_t round_batched;
+    size_t trace;
+    unsigned int lanes;
+};
+
+struct tune_worker {
+    struct bc_buffer bc_out[ALGORITHM_MAX_BATCH_LANES];
+};
+
+static int32_t pos_value(int32_t pos) {
+    uint64_t scaled = (uint64_t)octave_fraction[pos % TUNE_STEPS_PER_OCTAVE] << (pos / TUNE_STEPS_PER_OCTAVE);
+    return (int32_t)((scaled + 0x8000) >> 16);
+}
+
+// Sets the searched positions to those whose values lie within [min, max].
+static int param_bounds(struct tune_param *param, int32_t min, int32_t max) {
+    if (min < 1 || max < min || max > INT32_MAX / 2) {
+        return -1;
+    }
+
+    param->lo = 0;
+    while (pos_value(param->lo) < min) {
+        ++param->lo;
+    }
+
+    param->hi = param->lo;
+    while (pos_value(param->hi + 1) <= max) {
+        ++param->hi;
+    }
+
+    return 0;
+}
+
+static void *tune_worker_init(void *arg) {
+    struct tune_worker *worker = calloc(1, sizeof(struct tune_worker));
+    if (worker == NULL) {
+        return NULL;
+    }
+
+    for (int ii = 0; ii < ALGORITHM_MAX_BATCH_LANES; ++ii) {
+        if (bc_buffer_init(&worker->bc_out[ii]) < 0) {
+            while (--ii >= 0) {
+                bc_buffer_free(&worker->bc_out[ii]);
+            }
+            free(worker);
+            return NULL;
+        }
+    }
+
+    return worker;
+}
+
+static void tune_worker_fini(void *ptr, void *arg) {
+    struct tune_worker *worker = ptr;
+
+    for (int ii = 0; ii < ALGORITHM_MAX_BATCH_LANES; ++ii) {
+        bc_buffer_free(&worker->bc_out[ii]);
+    }
+    free(worker);
+}
+
+static struct result_cache_key cache_key(const struct tune_config *config, const struct tune_trace *trace, const struct tune_point *point) {
+    return (struct result_cache_key){
+        .samples_hash = trace->samples_hash,
+        .write_bc_ticks = config->write_bc_ticks,
+        .verify_sectors = config->verify_sectors,
+        .early = config->early,
+        .spec = point->spec,
+    };
+}
+
+// Decodes and verifies lanes points, filling in results as a sweep reports
+// them.
+static void decode_points(struct tune_worker *worker, const struct tune_config *config, const struct tune_trace *trace,
+                          struct tune_point *const *points, unsigned int lanes, struct result_cache_entry *results) {
+    struct kv_pair *params[ALGORITHM_MAX_BATCH_LANES] = {NULL};
+    uint32_t bc_prods[ALGORITHM_MAX_BATCH_LANES];
+    for (unsigned int lane = 0; lane < lanes; ++lane) {
+        params[lane] = points[lane]->params;
+    }
+
+    if (config->early) {
+        struct mfm_verify_stream streams[ALGORITHM_MAX_BATCH_LANES];
+        size_t samples_fed[ALGORITHM_MAX_BATCH_LANES];
+        const struct algorithm_check check = {
+            .chunk = TUNE_EARLY_CHUNK_COUNT,
+            .check = mfm_verify_check,
+            .arg = streams,
+        };
+
+        for (unsigned int lane = 0; lane < lanes; ++lane) {
+            mfm_verify_stream_init(&streams[lane], config->verify_sectors);
+        }
+        algorithm_decode_checked(config->alg, config->write_bc_ticks, trace->samples, trace->count, worker->bc_out, params, lanes, &check, bc_prods, samples_fed);
+
+        for (unsigned int lane = 0; lane < lanes; ++lane) {
+            const struct mfm_verify_result *verify = &streams[lane].result;
+            results[lane] = (struct result_cache_entry){
+                .bc_prod = bc_prods[lane],
+                .sector_count = verify->sector_count,
+                .sectors_good = verify->sectors_good,
+                .pass = bc_prods[lane] != 0 && streams[lane].status == MFM_VERIFY_PASSED,
+                .first_failure_offset = verify->first_failure_offset,
+                .samples = samples_fed[lane],
+            };
+            mfm_verify_result_free(&streams[lane].result);
+        }
+        return;
+    }
+
+    if (lanes == 1) {
+        bc_prods[0] = algorithm_decode(config->alg, config->write_bc_ticks, trace->samples, trace->count, &worker->bc_out[0], params[0], NULL);
+    } else {
+        algorithm_decode_batch(config->alg, config->write_bc_ticks, trace->samples, trace->count, worker->bc_out, params, lanes, bc_prods);
+    }
+
+    for (unsigned int lane = 0; lane < lanes; ++lane) {
+        struct mfm_verify_result verify = {.first_failure_offset = -1};
+        if (worker->bc_out[lane].failed) {
+            bc_prods[lane] = 0;
+        } else if (bc_prods[lane] != 0 && mfm_verify(worker->bc_out[lane].words, bc_prods[lane], &verify) < 0) {
+            verify.sectors_good = -1;
+        }
+
+        results[lane] = (struct result_cache_entry){
+            .bc_prod = bc_prods[lane],
+            .sector_count = verify.sector_count,
+            .sectors_good = verify.sectors_good,
+            .pass = bc_prods[lane] != 0 && verify.sectors_good >= config->verify_sectors,
+            .first_failure_offset = verify.first_failure_offset,
+            .samples = trace->count,
+        };
+        mfm_verify_result_free(&verify);
+    }
+}
+
+static void tune_job(void *ptr, size_t job_index, void *arg) {
+    struct tune_worker *worker = ptr;
+    struct tune *tune = arg;
+    const struct tune_config *config = tune->config;
+    const struct tune_trace *trace = &config->traces[tune->trace];
+
+    size_t batched_jobs = (tune->round_batched + tune->lanes - 1) / tune->lanes;
+    struct tune_point **round;
+    unsigned int count = 1;
+    if (job_index < batched_jobs) {
+        round = &tune->round[job_index * tune->lanes];
+        count = tune->round_batched - job_index * tune->lanes;
+        if (count > tune->lanes) {
+            count = tune->lanes;
+        }
+    } else {
+        round = &tune->round[tune->round_batched + job_index - batched_jobs];
+    }
+
+    // Points already in the cache don't need decoding.
+    struct tune_point *points[ALGORITHM_MAX_BATCH_LANES];
+    struct result_cache_entry results[ALGORITHM_MAX_BATCH_LANES];
+    unsigned int lanes = 0;
+    for (unsigned int ii = 0; ii < count; ++ii) {
+        const struct result_cache_key key = cache_key(config, trace, round[ii]);
+        struct result_cache_entry cached;
+
+        if (config->cache != NULL && result_cache_lookup(config->cache, &key, &cached)) {
+            round[ii]->passed += cached.pass;
+            round[ii]->decoded++;
+        } else {
+            points[lanes++] = round[ii];
+        }
+    }
+
+    if (lanes == 0) {
+        return;
+    }
+
+    decode_points(worker, config, trace, points, lanes, results);
+    __atomic_add_fetch(&tune->decodes, lanes, __ATOMIC_RELAXED);
+
+    for (unsigned int lane = 0; lane < lanes; ++lane) {
+        points[lane]->passed += results[lane].pass;
+        points[lane]->decoded++;
+
+        // Failures to allocate aren't the point's fault, so aren't cached.
+        if (config->cache != NULL && !worker->bc_out[lane].failed && results[lane].sectors_good >= 0) {
+            const struct result_cache_key key = cache_key(config, trace, points[lane]);
+            result_cache_store(config->cache, &key, &results[lane]);
+        }
+    }
+}
+
+static struct tune_point *find_point(const struct tune *tune, const int32_t *values) {
+    for (size_t ii = 0; ii < tune->point_count; ++ii) {
+        if (memcmp(tune->points[ii]->values, values, tune->param_count * sizeof(int32_t)) == 0) {
+            return tune->points[ii];
+        }
+    }
+    return NULL;
+}
+
+// Adds the point at pos unless its values have been tried already.  Returns
+// the new point, or NULL if it isn't new or couldn't be allocated.
+static struct tune_point *add_point(struct tune *tune, const int32_t *pos) {
+    int32_t values[TUNE_MAX_PARAMS];
+    for (int ii = 0; ii < tune->param_count; ++ii) {
+        values[ii] = pos_value(pos[ii]);
+    }
+
+    if (find_point(tune, values) != NULL) {
+        return NULL;
+    }
+
+    struct tune_point **points = realloc(tune->points, (tune->point_count + 1) * sizeof(struct tune_point *));
+    if (points == NULL) {
+        return NULL;
+    }
+    tune->points = points;
+
+    struct tune_point *point = calloc(1, sizeof(struct tune_point));
+    if (point == NULL) {
+        return NULL;
+    }
+
+    point->params = calloc(tune->fixed_count + tune->param_count + 1, sizeof(struct kv_pair));
+    if (point->params == NULL) {
+        free(point);
+        return NULL;
+    }
+
+    size_t spec_len = strlen(tune->config->alg->name) + 3;
+    for (size_t ii = 0; ii < tune->fixed_count; ++ii) {
+        point->params[ii] = tune->config->fixed[ii];
+        spec_len += strlen(point->params[ii].key) + strlen(point->params[ii].value) + 2;
+    }
+    for (int ii = 0; ii < tune->param_count; ++ii) {
+        point->pos[ii] = pos[ii];
+        point->values[ii] = values[ii];
+        snprintf(point->value_strs[ii], sizeof(point->value_strs[ii]), "%d", values[ii]);
+
+        struct kv_pair *param = &point->params[tune->fixed_count + ii];
+        param->key = tune->params[ii].name;
+        param->value = point->value_strs[ii];
+        spec_len += strlen(param->key) + strlen(param->value) + 2;
+    }
+
+    point->spec = malloc(spec_len);
+    if (point->spec == NULL) {
+        free(point->params);
+        free(point);
+        return NULL;
+    }
+
+    char *p = point->spec + sprintf(point->spec, "%s[", tune->config->alg->name);
+    for (const struct kv_pair *param = point->params; param->key != NULL; ++param) {
+        if (param != point->params) *p++ = ',';
+        p += sprintf(p, "%s=%s", param->key, param->value);
+    }
+    sprintf(p, "]");
+
+    point->batchable = tune->lanes > 1 && algorithm_batchable(tune->config->alg, point->params);
+
+    tune->points[tune->point_count++] = point;
+    return point;
+}
+
+// Decodes the points added since first against each trace in turn, dropping
+// those that fall too far behind.
+static int evaluate(struct tune *tune, size_t first) {
+    const struct tune_config *config = tune->config;
+    const struct worker_pool_ops ops = {
+        .worker_init = tune_worker_init,
+        .job = tune_job,
+        .worker_fini = tune_worker_fini,
+    };
+
+    tune->round = malloc((tune->point_count - first + 1) * sizeof(struct tune_point *));
+    if (tune->round == NULL) {
+        return -1;
+    }
+
+    for (tune->trace = 0; tune->trace < config->trace_count; ++tune->trace) {
+        size_t remaining = config->trace_count - tune->trace;
+
+        // A point can't do better than the traces it has passed so far, so
+        // any of them also sets a bar for the rest.
+        size_t best = tune->best_passed;
+        for (size_t ii = first; ii < tune->point_count; ++ii) {
+            if (tune->points[ii]->passed > best) {
+                best = tune->points[ii]->passed;
+            }
+        }
+
+        // Batch only the points the algorithm takes as lanes.  Any others
+        // would otherwise decode one after another in a job while workers
+        // sit idle.
+        tune->round_count = 0;
+        tune->round_batched = 0;
+        for (int batchable = tune->lanes > 1; batchable >= 0; --batchable) {
+            for (size_t ii = first; ii < tune->point_count; ++ii) {
+                struct tune_point *point = tune->points[ii];
+                if (point->batchable == batchable && point->decoded == tune->trace && point->passed + remaining >= best) {
+                    tune->round[tune->round_count++] = point;
+                }
+            }
+            if (batchable) {
+                tune->round_batched = tune->round_count;
+            }
+        }
+
+        if (tune->round_count == 0) {
+            break;
+        }
+
+        size_t batched_jobs = (tune->round_batched + tune->lanes - 1) / tune->lanes;
+        size_t job_count = batched_jobs + tune->round_count - tune->round_batched;
+        if (worker_pool_run(config->jobs, job_count, &ops, tune) < 0) {
+            free(tune->round);
+            return -1;
+        }
+    }
+
+    free(tune->round);
+    tune->round = NULL;
+
+    for (size_t ii = first; ii < tune->point_count; ++ii) {
+        const struct tune_point *point = tune->points[ii];
+        if (point->decoded == config->trace_count && point->passed > tune->best_passed) {
+            tune->best_passed = point->passed;
+        }
+        if (config->results != NULL) {
+            fprintf(config->results, "\"%s\",%zu,%zu\n", point->spec, point->passed, point->decoded);
+        }
+    }
+    if (config->results != NULL) {
+        fflush(config->results);
+    }
+
+    return 0;
+}
+
+// Adds every point of a grid step apart, always including both ends of each
+// parameter's range.
+static void add_grid(struct tune *tune, int32_t step) {
+    int32_t pos[TUNE_MAX_PARAMS];
+    for (int ii = 0; ii < tune->param_count; ++ii) {
+        pos[ii] = tune->params[ii].lo;
+    }
+
+    for (;;) {
+        add_point(tune, pos);
+
+        int ii = tune->param_count - 1;
+        for (; ii >= 0; --ii) {
+            if (pos[ii] < tune->params[ii].hi) {
+                pos[ii] += step;
+                if (pos[ii] > tune->params[ii].hi) {
+                    pos[ii] = tune->params[ii].hi;
+                }
+                break;
+            }
+            pos[ii] = tune->params[ii].lo;
+        }
+
+        if (ii < 0) {
+            break;
+        }
+    }
+}
+
+// Adds the points step away from point along any combination of parameters.
+// Returns the number added.
+static size_t add_neighbours(struct tune *tune, const struct tune_point *point, int32_t step) {
+    size_t added = 0;
+    int combinations = 1;
+    for (int ii = 0; ii < tune->param_count; ++ii) {
+        combinations *= 3;
+    }
+
+    for (int combination = 0; combination < combinations; ++combination) {
+        int32_t pos[TUNE_MAX_PARAMS];
+        int in_range = 1;
+        int digits = combination;
+
+        for (int ii = 0; ii < tune->param_count; ++ii) {
+            pos[ii] = point->pos[ii] + (digits % 3 - 1) * step;
+            digits /= 3;
+            in_range &= pos[ii] >= tune->params[ii].lo && pos[ii] <= tune->params[ii].hi;
+        }
+
+        if (in_range && add_point(tune, pos) != NULL) {
+            ++added;
+        }
+    }
+
+    return added;
+}
+
+// Squared distance of point from the middle of the points that passed
+// passed traces in full, in steps.  The middle is held scaled by count.
+static int64_t distance_from_middle(const struct tune *tune, const struct tune_point *point, const int64_t *middle, int64_t count) {
+    int64_t distance = 0;
+    for (int ii = 0; ii < tune->param_count; ++ii) {
+        int64_t delta = point->pos[ii] * count - middle[ii];
+        distance += delta * delta;
+    }
+    return distance;
+}
+
+// Sorts the n best points to the front of tune->points: most traces passed
+// first, then nearest the middle of those passing as many.
+static void rank_points(struct tune *tune, size_t n) {
+    const struct tune_config *config = tune->config;
+    int64_t middle[TUNE_MAX_PARAMS] = {0};
+    int64_t count = 0;
+
+    for (size_t ii = 0; ii < tune->point_count; ++ii) {
+        const struct tune_point *point = tune->points[ii];
+        if (point->decoded == config->trace_count && point->passed == tune->best_passed) {
+            for (int jj = 0; jj < tune->param_count; ++jj) {
+                middle[jj] += point->pos[jj];
+            }
+            ++count;
+        }
+    }
+
+    // Selection sort, since only the first few are needed.
+    for (size_t ii = 0; ii < n && ii < tune->point_count; ++ii) {
+        size_t best = ii;
+        for (size_t jj = ii + 1; jj < tune->point_count; ++jj) {
+            const struct tune_point *lhs = tune->points[jj];
+            const struct tune_point *rhs = tune->points[best];
+            if (lhs->passed != rhs->passed) {
+                if (lhs->passed > rhs->passed) best = jj;
+            } else if (count > 0 &&
+                       distance_from_middle(tune, lhs, middle, count) < distance_from_middle(tune, rhs, middle, count)) {
+                best = jj;
+            }
+        }
+
+        struct tune_point *tmp = tune->points[ii];
+        tune->points[ii] = tune->points[best];
+        tune->points[best] = tmp;
+    }
+}
+
+static int find_fixed(const struct kv_pair *fixed, const char *name) {
+    for (; fixed != NULL && fixed->key != NULL; ++fixed) {
+        if (strcmp(fixed->key, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int tune_run(const struct tune_config *config, struct tune_result *result) {
+    struct tune tune = {
+        .config = config,
+        .lanes = 1,
+    };
+    int ret = -1;
+
+    memset(result, 0, sizeof(*result));
+
+    for (const struct kv_pair *fixed = config->fixed; fixed != NULL && fixed->key != NULL; ++fixed) {
+        ++tune.fixed_count;
+    }
+
+    for (const struct parameter *param = config->alg->params; param != NULL && param->name != NULL; ++param) {
+        if (find_fixed(config->fixed, param->name)) {
+            continue;
+        }
+
+        if (param->tune_max == 0) {
+            if (param->required) {
+                fprintf(stderr, "ERROR: %s requires %s, which can't be tuned\n", config->alg->name, param->name);
+                return -1;
+            }
+            continue;
+        }
+
+        if (tune.param_count == TUNE_MAX_PARAMS) {
+            fprintf(stderr, "ERROR: can't tune more than %d parameters at once\n", TUNE_MAX_PARAMS);
+            return -1;
+        }
+
+        struct tune_param *tune_param = &tune.params[tune.param_count++];
+        tune_param->name = param->name;
+        if (param_bounds(tune_param, param->tune_min, param->tune_max) < 0) {
+            fprintf(stderr, "ERROR: %s has an invalid tune range\n", param->name);
+            return -1;
+        }
+    }
+
+    if (tune.param_count == 0) {
+        fprintf(stderr, "ERROR: %s has no parameters left to tune\n", config->alg->name);
+        return -1;
+    }
+
+    if (config->alg->batch_init != NULL) {
+        tune.lanes = config->alg->batch_lanes;
+    }
+
+    if (config->results != NULL) {
+        fprintf(config->results, "Algorithm,Passed,Decoded\n");
+    }
+
+    add_grid(&tune, TUNE_COARSE_STEP);
+    if (evaluate(&tune, 0) < 0) {
+        goto out;
+    }
+
+    for (int32_t step = TUNE_COARSE_STEP / 2; step >= 1; step /= 2) {
+        // Look around the best points at this step, again as long as that
+        // turns up a point passing more traces.  Points merely as good don't
+        // count, or a broad passing region would be filled in point by point.
+        for (;;) {
+            size_t first = tune.point_count;
+            size_t best_passed = tune.best_passed;
+
+            rank_points(&tune, TUNE_REFINE_POINTS);
+            for (size_t ii = 0; ii < TUNE_REFINE_POINTS && ii < first; ++ii) {
+                add_neighbours(&tune, tune.points[ii], step);
+            }
+
+            if (tune.point_count == first) {
+                break;
+            }
+            if (evaluate(&tune, first) < 0) {
+                goto out;
+            }
+            if (tune.best_passed == best_passed) {
+                break;
+            }
+        }
+    }
+
+    if (tune.point_count == 0) {
+        goto out;
+    }
+
+    rank_points(&tune, 1);
+    result->spec = strdup(tune.points[0]->spec);
+    result->traces_passed = tune.points[0]->passed;
+    result->points = tune.point_count;
+    result->decodes = tune.decodes;
+    ret = result->spec != NULL ? 0 : -1;
+
+out:
+    for (size_t ii = 0; ii < tune.point_count; ++ii) {
+        free(tune.points[ii]->spec);
+        free(tune.points[ii]->params);
+        free(tune.points[ii]);
+    }
+    free(tune.points);
+    return ret;
+}
+
+void tune_result_free(struct tune_result *result) {
+    free(result->spec);
+    result->spec = NULL;
+}
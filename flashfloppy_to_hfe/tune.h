@@ -0,0 +1,77 @@
+#ifndef TUNE_H_
+#define TUNE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "algorithm.h"
+#include "kv_pair.h"
+#include "result_cache.h"
+
+// Searches an algorithm's parameter space for the settings that decode the
+// most of a set of traces, as an alternative to sweeping a full grid.
+//
+// Every parameter with a tune range in the algorithm's metadata that the
+// spec doesn't fix is searched, in log2 space.  A coarse grid a couple of
+// octaves apart is tried first, then the search repeatedly halves its step
+// around the best few points found so far, down to 1/16 of an octave.  The
+// values in between are reached without trying every combination of them.
+//
+// Points are decoded a round of traces at a time, and a point is dropped
+// once it can no longer pass as many traces as the best point so far.
+// Among points that pass equally many traces, the one nearest the middle of
+// all of them is preferred, so the result sits well inside the passing
+// region rather than on its edge.
+
+struct tune_trace {
+    const uint16_t *samples;
+    size_t count;
+
+    // Hash of the samples for looking decodes up in the cache.
+    uint64_t samples_hash;
+};
+
+struct tune_config {
+    const struct algorithm *alg;
+
+    // Parameters given in the spec, kept as they are.
+    const struct kv_pair *fixed;
+
+    uint16_t write_bc_ticks;
+    const struct tune_trace *traces;
+    size_t trace_count;
+
+    // Good sectors a decode needs to pass.
+    int verify_sectors;
+
+    // Stop each decode as soon as it's known to pass or fail.
+    int early;
+
+    unsigned int jobs;
+
+    // Decodes are looked up here first and added once done, unless NULL.
+    struct result_cache *cache;
+
+    // Each point tried is written here as CSV, unless NULL.
+    FILE *results;
+};
+
+struct tune_result {
+    // Spec of the best point, malloc'd.
+    char *spec;
+    size_t traces_passed;
+
+    size_t points;
+
+    // Decodes run, not counting those found in the cache.
+    size_t decodes;
+};
+
+// Returns 0 on success or -1 if the fixed parameters are invalid or the
+// search couldn't run.
+int tune_run(const struct tune_config *config, struct tune_result *result);
+
+void tune_result_free(struct tune_result *result);
+
+#endif
@@ -0,0 +1,261 @@
+#include "algorithm.h"
+#include "bc_buffer.h"
+#include "mfm_synth.h"
+#include "mfm_verify.h"
+
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Checks the IBM MFM verifier against a synthesized 1.44MB track with known
+// damage done to its bitcells.
+
+#define SECTORS 18
+
+// Bytes in a data record: the mark, 512 bytes of data and the CRC.
+#define DATA_RECORD_BYTES (1 + 512 + 2)
+
+static int failures;
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: ", __func__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            ++failures; \
+        } \
+    } while (0)
+
+struct track {
+    uint32_t *words;
+    uint32_t bc_prod;
+};
+
+static void flip_bitcell(struct track *track, uint32_t pos) {
+    track->words[pos / 32] ^= htobe32(1U << (31 - pos % 32));
+}
+
+static void set_bitcell(struct track *track, uint32_t pos, int value) {
+    uint32_t mask = htobe32(1U << (31 - pos % 32));
+    track->words[pos / 32] = value ? track->words[pos / 32] | mask : track->words[pos / 32] & ~mask;
+}
+
+// Overwrites the three A1 sync bytes at offset with ordinary 00 bytes.
+static void wipe_sync(struct track *track, uint32_t offset) {
+    for (uint32_t ii = 0; ii < 48; ++ii) {
+        set_bitcell(track, offset + ii, ii % 2 == 0);
+    }
+}
+
+// Flips the data bit of the index'th byte of the record whose sync mark
+// starts at offset.  Byte 0 is the mark.
+static void flip_record_bit(struct track *track, uint32_t offset, unsigned int index) {
+    flip_bitcell(track, offset + 48 + 16 * index + 1);
+}
+
+// Copies the clean track for a test to damage.
+static struct track copy_track(const struct track *clean) {
+    size_t size = (clean->bc_prod + 31) / 32 * sizeof(uint32_t);
+    struct track track = {.words = malloc(size), .bc_prod = clean->bc_prod};
+    memcpy(track.words, clean->words, size);
+    return track;
+}
+
+static void test_crc16(void) {
+    CHECK(mfm_crc16(0xFFFF, (const uint8_t *)"123456789", 9) == 0x29B1,
+        "CRC16-CCITT check value is 0x%04x", mfm_crc16(0xFFFF, (const uint8_t *)"123456789", 9));
+
+    const uint8_t sync[] = {0xA1, 0xA1, 0xA1};
+    CHECK(mfm_crc16(0xFFFF, sync, sizeof(sync)) == 0xCDB4, "CRC16 after sync is 0x%04x", mfm_crc16(0xFFFF, sync, sizeof(sync)));
+}
+
+static void test_clean(const struct track *clean, struct mfm_verify_result *result) {
+    CHECK(mfm_verify(clean->words, clean->bc_prod, result) == 0, "mfm_verify failed");
+    CHECK(result->sector_count == SECTORS, "%d sectors", result->sector_count);
+    CHECK(result->sectors_good == SECTORS, "%d good sectors", result->sectors_good);
+    CHECK(result->first_failure_offset == -1, "first failure at %ld", (long)result->first_failure_offset);
+
+    for (int ii = 0; ii < result->sector_count; ++ii) {
+        const struct mfm_sector *sector = &result->sectors[ii];
+        CHECK(sector->header_ok && sector->has_data && sector->data_ok, "sector %d not good", ii);
+        CHECK(sector->r == ii + 1 && sector->n == 2, "sector %d has R %u N %u", ii, sector->r, sector->n);
+        CHECK(sector->dam_offset > sector->idam_offset, "sector %d DAM before IDAM", ii);
+    }
+}
+
+static void test_bad_data(const struct track *clean, const struct mfm_verify_result *good) {
+    struct track track = copy_track(clean);
+    flip_record_bit(&track, good->sectors[5].dam_offset, 100);
+
+    struct mfm_verify_result result;
+    CHECK(mfm_verify(track.words, track.bc_prod, &result) == 0, "mfm_verify failed");
+    CHECK(result.sector_count == SECTORS, "%d sectors", result.sector_count);
+    CHECK(result.sectors_good == SECTORS - 1, "%d good sectors", result.sectors_good);
+    CHECK(result.sectors[5].header_ok && !result.sectors[5].data_ok, "sector 5 data passed");
+    CHECK(result.first_failure_offset == good->sectors[5].dam_offset,
+        "first failure at %ld, not sector 5 DAM at %u", (long)result.first_failure_offset, good->sectors[5].dam_offset);
+
+    mfm_verify_result_free(&result);
+    free(track.words);
+}
+
+static void test_bad_header(const struct track *clean, const struct mfm_verify_result *good) {
+    struct track track = copy_track(clean);
+    flip_record_bit(&track, good->sectors[3].idam_offset, 3);
+    flip_record_bit(&track, good->sectors[9].dam_offset, 1);
+
+    struct mfm_verify_result result;
+    CHECK(mfm_verify(track.words, track.bc_prod, &result) == 0, "mfm_verify failed");
+    CHECK(result.sectors_good == SECTORS - 2, "%d good sectors", result.sectors_good);
+    CHECK(!result.sectors[3].header_ok && !result.sectors[3].has_data, "sector 3 header passed");
+    CHECK(result.sectors[9].header_ok && !result.sectors[9].data_ok, "sector 9 data passed");
+
+    // The earlier of the two failures counts.
+    CHECK(result.first_failure_offset == good->sectors[3].idam_offset,
+        "first failure at %ld, not sector 3 IDAM at %u", (long)result.first_failure_offset, good->sectors[3].idam_offset);
+
+    mfm_verify_result_free(&result);
+    free(track.words);
+}
+
+// Bitcell just past the data record of sector.
+static uint32_t data_end(const struct mfm_sector *sector) {
+    return sector->dam_offset + 48 + DATA_RECORD_BYTES * 16;
+}
+
+// Scans track as a checked decode would, in chunks as the bitcells arrive.
+static void scan_chunked(struct mfm_verify_stream *stream, const struct track *track, uint32_t chunk) {
+    for (uint32_t prod = chunk; stream->status == MFM_VERIFY_RUNNING; prod += chunk) {
+        int final = prod >= track->bc_prod;
+        if (mfm_verify_stream_scan(stream, track->words, final ? track->bc_prod : prod, final) < 0 || final) {
+            break;
+        }
+    }
+}
+
+static void test_early_pass(const struct track *clean, const struct mfm_verify_result *good) {
+    struct mfm_verify_stream stream;
+
+    mfm_verify_stream_init(&stream, 0);
+    CHECK(stream.status == MFM_VERIFY_PASSED, "wanting no sectors didn't pass straight away");
+    mfm_verify_result_free(&stream.result);
+
+    // Stops as soon as the fourth good sector is in.
+    mfm_verify_stream_init(&stream, 4);
+    scan_chunked(&stream, clean, 1000);
+    CHECK(stream.status == MFM_VERIFY_PASSED, "status %d", stream.status);
+    CHECK(stream.result.sectors_good == 4, "%d good sectors", stream.result.sectors_good);
+    CHECK(stream.pos == data_end(&good->sectors[3]), "stopped at %u, not %u", stream.pos, data_end(&good->sectors[3]));
+    mfm_verify_result_free(&stream.result);
+
+    // Scanning in chunks finds what scanning all at once does.
+    mfm_verify_stream_init(&stream, -1);
+    scan_chunked(&stream, clean, 777);
+    CHECK(stream.status == MFM_VERIFY_RUNNING, "whole stream scan finished with status %d", stream.status);
+    CHECK(stream.result.sector_count == good->sector_count, "%d sectors in chunks", stream.result.sector_count);
+    for (int ii = 0; ii < stream.result.sector_count && ii < good->sector_count; ++ii) {
+        CHECK(memcmp(&stream.result.sectors[ii], &good->sectors[ii], sizeof(struct mfm_sector)) == 0, "sector %d differs in chunks", ii);
+    }
+    mfm_verify_result_free(&stream.result);
+}
+
+static void test_early_bad_crc(const struct track *clean, const struct mfm_verify_result *good) {
+    struct track track = copy_track(clean);
+    flip_record_bit(&track, good->sectors[5].dam_offset, 100);
+
+    struct mfm_verify_stream stream;
+    mfm_verify_stream_init(&stream, SECTORS);
+    scan_chunked(&stream, &track, 1000);
+    CHECK(stream.status == MFM_VERIFY_FAILED, "status %d", stream.status);
+    CHECK(stream.result.first_failure_offset == good->sectors[5].dam_offset,
+        "first failure at %ld, not sector 5 DAM at %u", (long)stream.result.first_failure_offset, good->sectors[5].dam_offset);
+    CHECK(stream.pos == data_end(&good->sectors[5]), "stopped at %u, not %u", stream.pos, data_end(&good->sectors[5]));
+
+    mfm_verify_result_free(&stream.result);
+    free(track.words);
+}
+
+static void test_early_missing_sync(const struct track *clean, const struct mfm_verify_result *good) {
+    struct track track = copy_track(clean);
+    wipe_sync(&track, good->sectors[7].idam_offset);
+    wipe_sync(&track, good->sectors[7].dam_offset);
+
+    // Scanning the whole stream just misses the sector.
+    struct mfm_verify_result result;
+    CHECK(mfm_verify(track.words, track.bc_prod, &result) == 0, "mfm_verify failed");
+    CHECK(result.sectors_good == SECTORS - 1, "%d good sectors", result.sectors_good);
+    CHECK(result.first_failure_offset == -1, "first failure at %ld", (long)result.first_failure_offset);
+    mfm_verify_result_free(&result);
+
+    // Stopping early gives up gap3 and a sync's worth of bytes past the data
+    // record before, with its 320 byte window.
+    uint32_t deadline = data_end(&good->sectors[6]) + 320 * 16 + 48;
+    struct mfm_verify_stream stream;
+    mfm_verify_stream_init(&stream, SECTORS);
+    scan_chunked(&stream, &track, 1000);
+    CHECK(stream.status == MFM_VERIFY_FAILED, "status %d", stream.status);
+    CHECK(stream.result.first_failure_offset == deadline + 1,
+        "first failure at %ld, not %u", (long)stream.result.first_failure_offset, deadline + 1);
+    CHECK(stream.result.sectors_good == 7, "%d good sectors", stream.result.sectors_good);
+    mfm_verify_result_free(&stream.result);
+
+    // With no sync marks at all, the first IDAM has 512 bytes to turn up.
+    for (uint32_t word = 0; word < (track.bc_prod + 31) / 32; ++word) {
+        track.words[word] = htobe32(0xAAAAAAAA);
+    }
+    mfm_verify_stream_init(&stream, SECTORS);
+    scan_chunked(&stream, &track, 1000);
+    CHECK(stream.status == MFM_VERIFY_FAILED, "status %d", stream.status);
+    CHECK(stream.result.first_failure_offset == 512 * 16 + 48 + 1,
+        "first failure at %ld, not %u", (long)stream.result.first_failure_offset, 512 * 16 + 48 + 1);
+    mfm_verify_result_free(&stream.result);
+
+    free(track.words);
+}
+
+int main(void) {
+    uint16_t *samples;
+    size_t count;
+    if (mfm_synth_spec("synth[jitter=100]", &samples, &count) < 0) {
+        return 1;
+    }
+
+    struct bc_buffer out;
+    if (bc_buffer_init(&out) < 0) {
+        fprintf(stderr, "ERROR: failed to reserve bitcell buffer\n");
+        return 1;
+    }
+
+    char algorithm[] = "flashfloppy_v341";
+    struct kv_pair *params = NULL;
+    const struct algorithm *alg = algorithm_lookup(algorithm, &params);
+    const struct track clean = {
+        .words = out.words,
+        .bc_prod = algorithm_decode(alg, (500*72) / 500, samples, count, &out, params, NULL),
+    };
+    free(params);
+    free(samples);
+
+    struct mfm_verify_result good;
+    test_crc16();
+    test_clean(&clean, &good);
+    if (good.sector_count == SECTORS) {
+        test_bad_data(&clean, &good);
+        test_bad_header(&clean, &good);
+        test_early_pass(&clean, &good);
+        test_early_bad_crc(&clean, &good);
+        test_early_missing_sync(&clean, &good);
+    }
+
+    mfm_verify_result_free(&good);
+    bc_buffer_free(&out);
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "worker_pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct worker_pool {
+    const struct worker_pool_ops *ops;
+    void *arg;
+    size_t job_count;
+    size_t next_job;
+    int failed;
+};
+
+unsigned int worker_pool_default_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (unsigned int)cpus : 1;
+}
+
+static void *worker_main(void *ptr) {
+    struct worker_pool *pool = ptr;
+    void *worker = NULL;
+
+    if (pool->ops->worker_init != NULL) {
+        worker = pool->ops->worker_init(pool->arg);
+        if (worker == NULL) {
+            __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+
+    for (;;) {
+        size_t job = __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED);
+        if (job >= pool->job_count) {
+            break;
+        }
+
+        pool->ops->job(worker, job, pool->arg);
+    }
+
+    if (pool->ops->worker_fini != NULL) {
+        pool->ops->worker_fini(worker, pool->arg);
+    }
+
+    return NULL;
+}
+
+int worker_pool_run(
+    unsigned int thread_count,
+    size_t job_count,
+    const struct worker_pool_ops *ops,
+    void *arg
+) {
+    struct worker_pool pool = {
+        .ops = ops,
+        .arg = arg,
+        .job_count = job_count,
+        .next_job = 0,
+        .failed = 0,
+    };
+
+    if (thread_count == 0) {
+        thread_count = 1;
+    }
+    if (thread_count > job_count) {
+        thread_count = job_count > 0 ? job_count : 1;
+    }
+
+    // A single worker runs on the calling thread.
+    if (thread_count == 1) {
+        worker_main(&pool);
+        return pool.failed ? -1 : 0;
+    }
+
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    if (threads == NULL) {
+        return -1;
+    }
+
+    unsigned int started = 0;
+    for (; started < thread_count; ++started) {
+        int ret = pthread_create(&threads[started], NULL, worker_main, &pool);
+        if (ret != 0) {
+            // Carry on with however many workers did start.
+            fprintf(stderr, "WARNING: failed to start worker thread: %s\n", strerror(ret));
+            break;
+        }
+    }
+
+    if (started == 0) {
+        worker_main(&pool);
+    }
+
+    for (unsigned int ii = 0; ii < started; ++ii) {
+        pthread_join(threads[ii], NULL);
+    }
+
+    free(threads);
+    return pool.failed ? -1 : 0;
+}
@@ -0,0 +1,29 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <stddef.h>
+
+// Callbacks run by each worker thread.  worker_init() is called once per
+// thread before any jobs run and returns per-thread state (e.g. reusable
+// buffers) which is handed to every job() that thread executes and finally to
+// worker_fini().  worker_init() and worker_fini() may be NULL.
+struct worker_pool_ops {
+    void *(*worker_init)(void *arg);
+    void (*job)(void *worker, size_t job_index, void *arg);
+    void (*worker_fini)(void *worker, void *arg);
+};
+
+// Number of online CPUs, or 1 if that cannot be determined.
+unsigned int worker_pool_default_threads(void);
+
+// Runs job_count jobs across up to thread_count threads.  Jobs are handed out
+// in index order but may complete in any order.  Returns 0 on success or -1 if
+// the threads could not be started or a worker failed to initialize.
+int worker_pool_run(
+    unsigned int thread_count,
+    size_t job_count,
+    const struct worker_pool_ops *ops,
+    void *arg
+);
+
+#endif
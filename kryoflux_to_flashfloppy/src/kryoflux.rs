@@ -0,0 +1,198 @@
+use anyhow::{anyhow, bail, Result};
+use std::ops::Range;
+
+/// A decoded KryoFlux stream: every flux interval in sample clocks, in one
+/// contiguous array, split into revolutions at each index pulse.
+pub struct KryofluxStream {
+    pub flux: Vec<u32>,
+    pub revolutions: Vec<Range<usize>>,
+}
+
+impl KryofluxStream {
+    pub fn revolutions(&self) -> impl Iterator<Item = &[u32]> {
+        self.revolutions.iter().map(|range| &self.flux[range.clone()])
+    }
+}
+
+/// Cursor over the raw stream bytes.
+struct Reader<'a> {
+    data: &'a [u8],
+    pos: usize,
+}
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, count: usize, what: &str) -> Result<&'a [u8]> {
+        let bytes = self
+            .data
+            .get(self.pos..self.pos + count)
+            .ok_or(anyhow!("EOF during {}", what))?;
+        self.pos += count;
+        Ok(bytes)
+    }
+
+    fn byte(&mut self, what: &str) -> Result<u8> {
+        Ok(self.take(1, what)?[0])
+    }
+}
+
+/// Parses the raw bytes of a KryoFlux stream file.  Ovl16 blocks carry the
+/// following flux interval past 16 bits, so long unformatted gaps come out
+/// as one long interval.
+pub fn parse_kryoflux_stream(data: &[u8]) -> Result<KryofluxStream> {
+    let mut reader = Reader { data, pos: 0 };
+
+    // A typical stream is mostly Flux1 blocks, one byte per interval.
+    let mut flux = Vec::<u32>::with_capacity(data.len());
+    let mut revolutions = Vec::new();
+    let mut rev_start = 0;
+    let mut overflow: u32 = 0;
+
+    while reader.pos < data.len() {
+        let header = reader.byte("header")?;
+
+        let interval = match header {
+            0x00..=0x07 /* Flux2 */ => {
+                let lower = reader.byte("Flux2")?;
+                ((header as u32) << 8) + lower as u32
+            }
+            0x08 /* Nop1 */ => continue,
+            0x09 /* Nop2 */ => {
+                reader.take(1, "NOP2")?;
+                continue;
+            }
+            0x0A /* Nop3 */ => {
+                reader.take(2, "NOP3")?;
+                continue;
+            }
+            0x0B /* Ovl16 */ => {
+                overflow += 0x10000;
+                continue;
+            }
+            0x0C /* Flux3 */ => {
+                let bytes = reader.take(2, "Flux3")?;
+                ((bytes[0] as u32) << 8) + bytes[1] as u32
+            }
+            0x0D /* OOB */ => {
+                let oob = reader.take(3, "OOB")?;
+                let oob_type = oob[0];
+                let oob_size = u16::from_le_bytes([oob[1], oob[2]]) as usize;
+
+                match oob_type {
+                    0x1 /* StreamInfo */
+                    | 0x4 /* KFInfo */ => {
+                        reader.take(oob_size, "OOB")?;
+                    }
+                    0x2 /* Index */ => {
+                        reader.take(oob_size, "OOB")?;
+
+                        revolutions.push(rev_start..flux.len());
+                        rev_start = flux.len();
+                    }
+                    0x3 /* StreamEnd */ => break,
+                    0x0 | _ => bail!("Invalid OOB"),
+                }
+                continue;
+            }
+            0x0E..=0xFF /* Flux1 */ => header as u32,
+        };
+
+        flux.push(overflow + interval);
+        overflow = 0;
+    }
+
+    revolutions.push(rev_start..flux.len());
+    Ok(KryofluxStream { flux, revolutions })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// An Index OOB block with its 12 byte payload.
+    const INDEX: [u8; 16] = [0x0D, 0x02, 0x0C, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0];
+    const STREAM_END: [u8; 8] = [0x0D, 0x03, 0x08, 0x00, 0, 0, 0, 0];
+
+    fn revolutions(stream: &KryofluxStream) -> Vec<Vec<u32>> {
+        stream.revolutions().map(|rev| rev.to_vec()).collect()
+    }
+
+    #[test]
+    fn decodes_flux_blocks() {
+        let data = [
+            0x0E, 0xFF, // Flux1
+            0x00, 0x0E, 0x07, 0xFF, // Flux2
+            0x0C, 0x12, 0x34, // Flux3
+            0x08, 0x09, 0xAA, 0x0A, 0xBB, 0xCC, // Nop1, Nop2, Nop3
+            0x40,
+        ];
+        let stream = parse_kryoflux_stream(&data).unwrap();
+        assert_eq!(stream.flux, vec![0x0E, 0xFF, 0x000E, 0x07FF, 0x1234, 0x40]);
+        assert_eq!(stream.revolutions, vec![0..6]);
+    }
+
+    #[test]
+    fn accumulates_ovl16() {
+        let data = [
+            0x0B, 0x20, // one overflow then Flux1
+            0x0B, 0x0B, 0x0B, 0x03, 0x45, // three then Flux2
+            0x0B, 0x08, 0x0B, 0x0C, 0x00, 0x01, // a Nop between two then Flux3
+            0x30, // and none after
+        ];
+        let stream = parse_kryoflux_stream(&data).unwrap();
+        assert_eq!(stream.flux, vec![0x10020, 0x30345, 0x20001, 0x30]);
+    }
+
+    #[test]
+    fn ovl16_carries_across_index() {
+        let mut data = vec![0x0B, 0x0B];
+        data.extend_from_slice(&INDEX);
+        data.push(0x50);
+        let stream = parse_kryoflux_stream(&data).unwrap();
+        assert_eq!(revolutions(&stream), vec![vec![], vec![0x20050]]);
+    }
+
+    #[test]
+    fn splits_revolutions_at_index() {
+        let mut data = vec![0x10, 0x11];
+        data.extend_from_slice(&INDEX);
+        data.extend_from_slice(&[0x20, 0x21, 0x22]);
+        data.extend_from_slice(&INDEX);
+        data.extend_from_slice(&[0x0D, 0x01, 0x02, 0x00, b'x', b'y']); // StreamInfo
+        data.push(0x30);
+        data.extend_from_slice(&INDEX);
+        data.extend_from_slice(&STREAM_END);
+        data.push(0x40); // past StreamEnd, ignored
+
+        let stream = parse_kryoflux_stream(&data).unwrap();
+        assert_eq!(
+            revolutions(&stream),
+            vec![vec![0x10, 0x11], vec![0x20, 0x21, 0x22], vec![0x30], vec![]]
+        );
+    }
+
+    #[test]
+    fn rejects_truncated_streams() {
+        let cases: [(&[u8], &str); 6] = [
+            (&[0x10, 0x05], "EOF during Flux2"),
+            (&[0x0C, 0x12], "EOF during Flux3"),
+            (&[0x09], "EOF during NOP2"),
+            (&[0x0A, 0x00], "EOF during NOP3"),
+            (&[0x0D, 0x02, 0x0C], "EOF during OOB"),
+            (&[0x0D, 0x02, 0x0C, 0x00, 0, 0, 0], "EOF during OOB"),
+        ];
+        for (data, error) in cases {
+            match parse_kryoflux_stream(data) {
+                Ok(_) => panic!("{:02x?} parsed", data),
+                Err(err) => assert_eq!(err.to_string(), error, "{:02x?}", data),
+            }
+        }
+    }
+
+    #[test]
+    fn rejects_invalid_oob() {
+        let err = parse_kryoflux_stream(&[0x0D, 0x00, 0x00, 0x00])
+            .err()
+            .unwrap();
+        assert_eq!(err.to_string(), "Invalid OOB");
+    }
+}
@@ -2,7 +2,16 @@ use anyhow::{anyhow, bail, Result};
 use byteorder::{LittleEndian, WriteBytesExt};
 use clap::Parser;
 use vcd::{Writer, Value, TimescaleUnit, SimulationCommand};
-use std::{collections::VecDeque, ffi::OsString, path::PathBuf};
+use std::{
+    collections::BTreeMap,
+    ffi::OsString,
+    fmt::Write as _,
+    path::{Path, PathBuf},
+    sync::{atomic::{AtomicUsize, Ordering}, mpsc},
+};
+
+mod kryoflux;
+use kryoflux::parse_kryoflux_stream;
 
     const KRYOFLUX_MCLK_HZ : f64 = ((18_432_000.0 * 73.0) / 14.0) / 2.0;
     const KRYOFLUX_SCLK_HZ : f64 = KRYOFLUX_MCLK_HZ / 2.0;
@@ -28,6 +37,7 @@ use std::{collections::VecDeque, ffi::OsString, path::PathBuf};
 
 #[derive(Parser)]
 struct Args {
+    /// A KryoFlux stream file, or a capture directory of NN.S.raw files
     infile: PathBuf,
 
     #[clap(long)]
@@ -41,23 +51,138 @@ struct Args {
 
     #[clap(long)]
     vcd: bool,
+
+    /// Tracks converted at once when given a directory [default: CPU count]
+    #[clap(short, long)]
+    jobs: Option<usize>,
 }
 
 fn main() -> Result<()> {
     let opts = Args::parse();
 
-    let kryoflux_revs = read_kryoflux_samples(&opts.infile)?;
-
-    // Precomp
-    let write_precomp = (opts.write_precomp_ns / 1.0e9 * KRYOFLUX_SCLK_HZ).round() as u16;
+    let write_precomp = (opts.write_precomp_ns / 1.0e9 * KRYOFLUX_SCLK_HZ).round() as u32;
     println!("Write precomp: {:.3}ns ({})", opts.write_precomp_ns, write_precomp); 
 
-    let kryoflux_revs = kryoflux_revs.iter().map(|pulse_times| {
-        let mut adj_pulse_times = pulse_times.clone();
+    let outdir = opts.out_dir.clone().unwrap_or_default();
+
+    if !opts.infile.is_dir() {
+        let mut messages = String::new();
+        let result = convert_track(&opts, &opts.infile, &outdir, write_precomp, &mut messages);
+        print!("{}", messages);
+        return result;
+    }
+
+    let tracks = find_tracks(&opts.infile)?;
+    let jobs = opts.jobs
+        .unwrap_or_else(|| std::thread::available_parallelism().map_or(1, |n| n.get()))
+        .clamp(1, tracks.len().max(1));
+
+    println!("Converting {} tracks with {} jobs", tracks.len(), jobs);
+
+    // Workers take the next track as they finish one, so at most one track
+    // per worker is in memory.  Each track's messages are held until every
+    // track before it has been printed.
+    let next_track = AtomicUsize::new(0);
+    let (sender, receiver) = mpsc::channel();
+    let mut failed = 0;
+
+    std::thread::scope(|scope| {
+        for _ in 0..jobs {
+            let sender = sender.clone();
+            let next_track = &next_track;
+            let tracks = &tracks;
+            let opts = &opts;
+            let outdir = &outdir;
+
+            scope.spawn(move || loop {
+                let idx = next_track.fetch_add(1, Ordering::Relaxed);
+                if idx >= tracks.len() {
+                    break;
+                }
+
+                let mut messages = String::new();
+                let result = convert_track(opts, &tracks[idx], outdir, write_precomp, &mut messages);
+                if sender.send((idx, messages, result)).is_err() {
+                    break;
+                }
+            });
+        }
+        drop(sender);
+
+        let mut pending = BTreeMap::new();
+        let mut next_print = 0;
+        for (idx, messages, result) in receiver {
+            pending.insert(idx, (messages, result));
+
+            while let Some((messages, result)) = pending.remove(&next_print) {
+                print!("{}", messages);
+                if let Err(err) = result {
+                    eprintln!("ERROR: {}: {:#}", tracks[next_print].display(), err);
+                    failed += 1;
+                }
+                next_print += 1;
+            }
+        }
+    });
+
+    if failed > 0 {
+        bail!("{} of {} tracks failed", failed, tracks.len());
+    }
+
+    Ok(())
+}
+
+/// Returns the NN.S.raw stream files in dir, ordered by track then side.
+fn find_tracks(dir: &Path) -> Result<Vec<PathBuf>> {
+    let mut tracks = Vec::new();
+
+    for entry in std::fs::read_dir(dir)? {
+        let path = entry?.path();
+        if path.extension().map_or(true, |ext| ext != "raw") {
+            continue;
+        }
+
+        let Some(stem) = path.file_stem().and_then(|stem| stem.to_str()) else {
+            continue;
+        };
+        let Some((track, side)) = stem.split_once('.') else {
+            continue;
+        };
+        let (Ok(track), Ok(side)) = (track.parse::<u32>(), side.parse::<u32>()) else {
+            continue;
+        };
+
+        tracks.push((track, side, path));
+    }
+
+    if tracks.is_empty() {
+        bail!("No NN.S.raw stream files in {}", dir.display());
+    }
+
+    tracks.sort();
+    Ok(tracks.into_iter().map(|(_, _, path)| path).collect())
+}
+
+/// Converts one stream file into per-revolution outputs in outdir.  Progress
+/// is appended to messages rather than printed so that tracks converted
+/// concurrently don't interleave.
+fn convert_track(
+    opts: &Args,
+    infile: &Path,
+    outdir: &Path,
+    write_precomp: u32,
+    messages: &mut String,
+) -> Result<()> {
+    let mut kryoflux = parse_kryoflux_stream(&std::fs::read(infile)?)?;
+
+    // Each interval is classified before it's adjusted, so the revolutions
+    // can be adjusted in place.
+    for range in &kryoflux.revolutions {
+        let pulse_times = &mut kryoflux.flux[range.clone()];
         let mut history = [0; 2];
 
-        for (idx, interval) in pulse_times.iter().enumerate() {
-            let sample_us = (*interval as f64) / KRYOFLUX_SCLK_HZ * 1_000_000.0;
+        for idx in 0..pulse_times.len() {
+            let sample_us = (pulse_times[idx] as f64) / KRYOFLUX_SCLK_HZ * 1_000_000.0;
             let sample_us = sample_us.round() as usize;
 
             history[0] = history[1];
@@ -65,143 +190,71 @@ fn main() -> Result<()> {
 
             match history {
                 [2, x] if x >= 3 => {
-                    adj_pulse_times[idx-1] -= write_precomp;
-                    adj_pulse_times[idx] += write_precomp;
+                    pulse_times[idx-1] -= write_precomp;
+                    pulse_times[idx] += write_precomp;
                 },
                 [x, 2] if x >= 3 => {
-                    adj_pulse_times[idx-1] += write_precomp;
-                    adj_pulse_times[idx] -= write_precomp;
+                    pulse_times[idx-1] += write_precomp;
+                    pulse_times[idx] -= write_precomp;
                 },
                 _ => {}
             }
         }
+    }
 
-        adj_pulse_times
-    }).collect::<Vec<_>>();
-
-    let outdir = opts.out_dir.unwrap_or_default();
-
-    let outstem = opts.infile.file_stem().ok_or(anyhow!(
+    let outstem = infile.file_stem().ok_or(anyhow!(
             "Failed to file_stem from input file: {}",
-            opts.infile.display()
+            infile.display()
         ))?; 
 
-    for (rev, pulse_times) in kryoflux_revs.into_iter().enumerate() {
+    for (rev, pulse_times) in kryoflux.revolutions().enumerate() {
         if opts.log {
             let mut log_filename = OsString::new();
             log_filename.push(&outstem);
             log_filename.push(format!(".revolution{}.log", rev));
 
-            let mut log_path = outdir.clone();
-            log_path.push(log_filename);
+            let log_path = outdir.join(log_filename);
 
-            println!("Writing log to {}", log_path.display());
+            writeln!(messages, "Writing log to {}", log_path.display())?;
 
             let mut log_file = std::fs::File::create(log_path)?;
 
-            write_log_samples(&mut log_file, &pulse_times)?;
+            write_log_samples(&mut log_file, pulse_times, messages)?;
         }
 
         let mut ff_filename = OsString::new();
         ff_filename.push(&outstem);
         ff_filename.push(format!(".revolution{}.ff_samples", rev));
 
-        let mut ff_path = outdir.clone();
-        ff_path.push(ff_filename);
+        let ff_path = outdir.join(ff_filename);
 
-        println!("Writing FlashFloppy samples to {}", ff_path.display());
+        writeln!(messages, "Writing FlashFloppy samples to {}", ff_path.display())?;
 
         let mut ff_file = std::fs::File::create(ff_path)?;
 
-        write_ff_samples(&mut ff_file, &pulse_times)?;
+        write_ff_samples(&mut ff_file, pulse_times)?;
 
         if opts.vcd {
             let mut vcd_filename = OsString::new();
             vcd_filename.push(&outstem);
             vcd_filename.push(format!(".revolution{}.vcd", rev));
 
-            let mut vcd_path = outdir.clone();
-            vcd_path.push(vcd_filename);
+            let vcd_path = outdir.join(vcd_filename);
 
-            println!("Writing VCD to {}", vcd_path.display());
+            writeln!(messages, "Writing VCD to {}", vcd_path.display())?;
 
             let mut vcd_file = std::fs::File::create(vcd_path)?;
 
-            write_vcd(&mut vcd_file, &pulse_times)?;
+            write_vcd(&mut vcd_file, pulse_times)?;
         }
     }
 
     Ok(())
 }
 
-fn read_kryoflux_samples(
-    kryoflux_raw_path: &PathBuf,
-) -> Result<Vec<Vec<u16>>> {
-    let mut infile: VecDeque<u8> = std::fs::read(&kryoflux_raw_path)?.into();
-
-    let mut result : Vec<Vec<u16>> = Vec::new();
-    let mut cur_pulse_intervals = Vec::<u16>::new();
-
-    while let Some(header) = infile.pop_front() {
-        match header {
-            0x00..=0x07 /* Flux2 */ => {
-                let lower = infile.pop_front().ok_or(anyhow!("EOF during Flux2"))?;
-
-                cur_pulse_intervals.push(((header as u16) << 8) + lower as u16);
-            }
-            0x08 /* Nop1 */=> {}
-            0x09 /* Nop2 */=> {
-                infile.pop_front().ok_or(anyhow!("EOF during NOP2"))?;
-            }
-            0x0A /* Nop3 */=> {
-                infile.pop_front().ok_or(anyhow!("EOF during NOP3"))?;
-                infile.pop_front().ok_or(anyhow!("EOF during NOP3"))?;
-            },
-            0x0B /* Ovl16 */ => {
-                todo!("OVL16")
-            },
-            0x0C /* Flux3 */=> {
-                let upper = infile.pop_front().ok_or(anyhow!("EOF during Flux3"))?;
-                let lower = infile.pop_front().ok_or(anyhow!("EOF during Flux3"))?;
-                cur_pulse_intervals.push(((upper as u16) << 8) + lower as u16);
-            },
-            0x0D /* OOB */=> {
-                let oob_type = infile.pop_front().ok_or(anyhow!("EOF during OOB"))?;
-                let oob_size_lower = infile.pop_front().ok_or(anyhow!("EOF during OOB"))?;
-                let oob_size_upper = infile.pop_front().ok_or(anyhow!("EOF during OOB"))?;
-
-                let oob_size = ((oob_size_upper as u16) << 8) + (oob_size_lower as u16);
-
-                match oob_type {
-                    0x1 /* StreamInfo */
-                    | 0x4 /* KFInfo */ => {
-                        for _ in 0..oob_size {
-                            infile.pop_front().ok_or(anyhow!("EOF during OOB"))?;  
-                        }
-                    },
-                    0x2 /* Index */ => {
-                        for _ in 0..oob_size {
-                            infile.pop_front().ok_or(anyhow!("EOF during OOB"))?;  
-                        }
-
-                        result.push(cur_pulse_intervals.clone());
-                        cur_pulse_intervals.clear();
-                    }
-                    0x3 /* StreamEnd */ => break,
-                    0x0 | _ => bail!("Invalid OOB"),
-                }
-            }
-            0x0E..=0xFF /* Flux1 */ => cur_pulse_intervals.push(header as u16),
-        }
-    }
-
-    result.push(cur_pulse_intervals);
-    Ok(result)
-}
-
 fn write_ff_samples<W>(
     outfile: &mut W,
-    pulse_intervals: &[u16],
+    pulse_intervals: &[u32],
 ) -> Result<()>
 where
     W: std::io::Write
@@ -221,7 +274,7 @@ where
 
 fn write_vcd<W>(
     outfile: &mut W,
-    pulse_intervals: &[u16],
+    pulse_intervals: &[u32],
 ) -> Result<()>
 where
     W: std::io::Write
@@ -254,7 +307,8 @@ where
 
 fn write_log_samples<W>(
     outfile: &mut W,
-    pulse_intervals: &[u16],
+    pulse_intervals: &[u32],
+    messages: &mut String,
 ) -> Result<()>
 where
     W: std::io::Write
@@ -289,7 +343,7 @@ where
     }
 
     write!(outfile, "Sample dev min: {sample_us_dev_min:3.6}, max: {sample_us_dev_max:3.6}\n")?;
-    println!("Sample dev min: {sample_us_dev_min:3.6}, max: {sample_us_dev_max:3.6}");
+    writeln!(messages, "Sample dev min: {sample_us_dev_min:3.6}, max: {sample_us_dev_max:3.6}")?;
 
     Ok(())
 }
@@ -1,14 +1,12 @@
 #!/usr/bin/env python3
 import click
 import csv
-import itertools
 import os
 import re
 import subprocess
 import sys
 import typing
 from dataclasses import dataclass
-from multiprocessing import Pool
 
 @dataclass
 class Format:
@@ -55,125 +53,69 @@ FORMATS=[
 
 PRECOMP_MIN=0
 PRECOMP_MAX=400
+PRECOMP_STEP=50
 
 @dataclass
 class Algorithm:
     name: str
-    p_div_range: range
-    i_div_range: range
-    name_format: str
+    # Algorithm spec handed to flashfloppy_to_hfe.  Parameter ranges are
+    # expanded and swept in-process.
+    spec: str
 
 ALGORITHMS = [
     Algorithm(
         name='flashfloppy_master',
-        p_div_range = range(1),
-        i_div_range = range(1),
-        name_format = 'flashfloppy_master'
+        spec='flashfloppy_master'
     ),
     Algorithm(
         name='greaseweazle_default_pll',
-        p_div_range = range(1),
-        i_div_range = range(1),
-        name_format = 'greaseweazle_default_pll'
+        spec='greaseweazle_default_pll'
     ),
     Algorithm(
         name='bitcell_width_pi_v1',
-        p_div_range = range(2, 18),
-        i_div_range = range(4, 20),
-        name_format = 'bitcell_width_pi_v1[p_mul=1,p_div={p_div},i_mul=1,i_div={i_div}]'
+        spec='bitcell_width_pi_v1[p_mul=1,p_div=4..128k:x2,i_mul=1,i_div=16..512k:x2]'
     ),
     Algorithm(
         name='bitcell_width_pi_v2',
-        p_div_range = range(2, 18),
-        i_div_range = range(4, 20),
-        name_format = 'bitcell_width_pi_v2[p_mul=1,p_div={p_div},i_mul=1,i_div={i_div}]'
+        spec='bitcell_width_pi_v2[p_mul=1,p_div=4..128k:x2,i_mul=1,i_div=16..512k:x2]'
     )
 ]
 
-def run_stderr(s):
-    r = subprocess.run(s.split(' '), stderr=subprocess.PIPE)
-    return r.stderr.decode('utf-8').strip()
+def synth_spec(format, rate):
+    # Tracks are laid out for the format's nominal rate and written by a drive
+    # running off by the swept rate.  Precomp is applied by flashfloppy_to_hfe.
+    offset_ppm = round((rate / format.data_rate_kbps - 1) * 1_000_000)
+    return (f'synth[secs={format.sectors_per_cylinder},bps={format.bytes_per_sector},gap3=84,'
+            f'rate={format.data_rate_kbps},rpm={format.rpm},offset={offset_ppm}]')
 
 
-def run(s):
-    r = subprocess.run(s.split(' '), stderr=subprocess.STDOUT, stdout=subprocess.PIPE)
-    return r.stdout.decode('utf-8').strip()
+def param_value(spec, name):
+    m = re.search(rf'[\[,]{name}=(\d+)', spec)
+    return int(m.group(1)) if m else 1
 
 
-def generate_diskdef(format, rate, out_dir):
-    cfg_filename = f'{out_dir}/{format.name}.{rate}.cfg'
-    if os.path.isfile(cfg_filename):
-        return cfg_filename
+def sweep_algorithms(format, rate, algorithms, jobs, out_dir):
+    results_filename = f'{out_dir}/{format.name}.{rate}.sweep.csv'
 
-    cfg = f'''
-disk {format.name}.{rate}
-    cyls = {format.cylinders}
-    heads = {format.heads}
-    tracks * ibm.mfm
-        secs = {format.sectors_per_cylinder}
-        bps = {format.bytes_per_sector}
-        gap3 = 84
-        rate = {rate}
-        rpm = {format.rpm}
-    end
-end'''
-    with open(cfg_filename, 'w') as f:
-        f.write(cfg)
+    # Every precomp value is swept from the one synthesized track in a single
+    # run.
+    args = ['../flashfloppy_to_hfe/flashfloppy_to_hfe', '--results', results_filename,
+            '--verify', str(format.sectors_per_cylinder), '--early',
+            '--cache', f'{out_dir}/cache',
+            '--precomp', f'{PRECOMP_MIN}..{PRECOMP_MAX}:+{PRECOMP_STEP}']
+    if jobs is not None:
+        args += ['--jobs', str(jobs)]
+    args += [synth_spec(format, rate), f'{out_dir}/', str(format.data_rate_kbps)]
+    args += [algorithm.spec for algorithm in algorithms]
+    subprocess.run(args, stdout=subprocess.DEVNULL, check=True)
 
-    return cfg_filename
+    with open(results_filename, newline='') as f:
+        results = [(int(row['Precomp']), row['Algorithm'], row['Pass'] == '1') for row in csv.DictReader(f)]
 
+    for (precomp, algorithm_name, result) in results:
+        print(f'Checking {algorithm_name} @{precomp}...{"pass" if result else "fail"}')
 
-def generate_kryo(format, rate, out_dir):
-    img_filename = f'{out_dir}/{format.name}.img'
-    if not os.path.isfile(img_filename):
-        run_stderr(f'dd if=/dev/random of={img_filename} bs={format.bytes_per_sector} count={format.sectors()}')
-
-    cfg_filename = generate_diskdef(format, rate, out_dir)
-    s = run_stderr(
-        f'gw convert {img_filename} {out_dir}/00.0.raw --diskdefs={cfg_filename} --format={format.name}.{rate} --tracks=c=0:h=0'
-    )
-
-
-#    print(s)
-
-
-def generate_ff(precomp, out_dir):
-    s = run(
-        f'../kryoflux_to_flashfloppy/target/debug/kryoflux_to_flashfloppy {out_dir}/00.0.raw --out-dir {out_dir} --write-precomp-ns {precomp}'
-    )
-
-
-#    print(s)
-
-
-def check_algorithm(format, algorithm, proportial_div, integral_div, out_dir):
-    algorithm_name = algorithm.name_format.format(p_div=proportial_div, i_div=integral_div)
-    out_filename = f'{out_dir}/00.0.revolution1.{format.data_rate_kbps}_{algorithm_name}.hfe'
-    img_filename = f'{out_dir}/00.0.revolution1.{format.data_rate_kbps}_{algorithm_name}.img'
-
-    print(f'Checking {algorithm_name}...', end='')
-
-    if os.path.isfile(out_filename):
-        os.remove(out_filename)
-
-    s = run(
-        f'../flashfloppy_to_hfe/flashfloppy_to_hfe {out_dir}/00.0.revolution1.ff_samples {out_dir}/ {format.data_rate_kbps} {algorithm_name}'
-    )
-    if not os.path.isfile(out_filename):
-        print('fail')
-        return (proportial_div, integral_div, False)
-    
-    cfg_filename = generate_diskdef(format, format.data_rate_kbps, out_dir)
-    s = run(
-        f'gw convert {out_filename} {img_filename} --diskdefs={cfg_filename} --format={format.name}.{format.data_rate_kbps} --tracks=c=0:h=0'
-    )
-    m = re.search(r'Found (\d+) sectors of \d+', s)
-    if int(m.group(1)) == format.sectors_per_cylinder:
-        print('pass')
-        return (proportial_div, integral_div, True)
-    else:
-        print('fail')
-        return (proportial_div, integral_div, False)
+    return sorted(results)
 
 @click.command()
 @click.option(
@@ -204,21 +146,16 @@ def main(algorithm, jobs):
         resultwriter = csv.writer(f)
         resultwriter.writerow(['Rate (kbps)', 'Precomp (ns)', 'Algorithm', 'p_div', 'i_div'])
 
-        with Pool(processes=jobs) as pool:
-            for format in FORMATS:
-                data_rate_min = round(format.data_rate_kbps*.92/5) * 5
-                data_rate_max = round(format.data_rate_kbps*1.08/5) * 5
-                data_rate_step = max(round((data_rate_max-data_rate_min)/16/5) * 5, 5)
-
-                for rate in range(data_rate_min, data_rate_max + 1, data_rate_step):
-                    generate_kryo(format, rate, out_dir)
-                    for precomp in range(PRECOMP_MIN, PRECOMP_MAX + 1, 50):
-                        print(f'Generating {rate} @{precomp}')
-                        generate_ff(precomp, out_dir)
-                        for curr_algorithm in [x for x in ALGORITHMS if x.name in algorithm]:
-                            for (p_div, i_div, result) in pool.starmap(check_algorithm, [(format, curr_algorithm, (1 << i_div), (1 << p_div), out_dir) for (i_div, p_div) in itertools.product(curr_algorithm.p_div_range, curr_algorithm.i_div_range)]):
-                                if result:
-                                    resultwriter.writerow([rate, precomp, curr_algorithm.name, p_div, i_div])
+        for format in FORMATS:
+            data_rate_min = round(format.data_rate_kbps*.92/5) * 5
+            data_rate_max = round(format.data_rate_kbps*1.08/5) * 5
+            data_rate_step = max(round((data_rate_max-data_rate_min)/16/5) * 5, 5)
+
+            for rate in range(data_rate_min, data_rate_max + 1, data_rate_step):
+                print(f'Sweeping {rate}')
+                for (precomp, algorithm_name, result) in sweep_algorithms(format, rate, [x for x in ALGORITHMS if x.name in algorithm], jobs, out_dir):
+                    if result:
+                        resultwriter.writerow([rate, precomp, algorithm_name.split('[')[0], param_value(algorithm_name, 'p_div'), param_value(algorithm_name, 'i_div')])
 
 if __name__ == '__main__':
     main()